@@ -0,0 +1,51 @@
+/*
+ * kQuery - Copyright (C) 2015
+ *
+ * Federico Menozzi <federicogmenozzi@gmail.com>
+ * Halen Wooten     <halen+github@hpwooten.com>  
+ *
+ * This program is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU General Public License as published by the 
+ * Free Software Foundation; either version 2 of the License, 
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the 
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along 
+ * with this program; if not, write to the Free Software Foundation, Inc., 
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Synthetic rows and timing shared by the benchmarks, which include kquery.c
+ * directly so they exercise the same loaders and wrappers.
+ */
+
+#define KQUERY_NO_MAIN
+#include "../kquery.c"
+
+/* Fill rows with a plausible process tree */
+void b_SyntheticRows(struct process_row* rows, int num_rows)
+{
+    int i;
+    for (i = 0; i < num_rows; i++) {
+        rows[i].pid        = i + 1;
+        rows[i].parent_pid = i == 0 ? 0 : 1 + (i - 1) / 4;
+        rows[i].state      = i % 7 == 0 ? 0 : 1;
+        rows[i].flags      = i % 5 == 0 ? 0x00200040 : 0x00400100;
+        rows[i].priority   = 100 + i % 40;
+        rows[i].num_vmas   = i % 5 == 0 ? 0 : 10 + i % 90;
+        rows[i].total_vm   = i % 5 == 0 ? 0 : 1000 + (i * 7919ULL) % 100000;
+        snprintf(rows[i].name, PROCESS_NAME_LEN, "proc%d", i % 50);
+    }
+}
+
+double b_Now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
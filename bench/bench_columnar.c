@@ -0,0 +1,144 @@
+/*
+ * kQuery - Copyright (C) 2015
+ *
+ * Federico Menozzi <federicogmenozzi@gmail.com>
+ * Halen Wooten     <halen+github@hpwooten.com>  
+ *
+ * This program is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU General Public License as published by the 
+ * Free Software Foundation; either version 2 of the License, 
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the 
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along 
+ * with this program; if not, write to the Free Software Foundation, Inc., 
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+/*
+ * Runs simple process queries over a synthetic snapshot in SQLite and on the
+ * columnar copy that --snapshot uses for them, writing results to memory.
+ * Usage: ./bench_columnar [rows]
+ */
+
+#include "bench.h"
+
+/* Number of times each query is run */
+#define NUM_RUNS 5
+
+char* b_Queries[][2] = {
+    {"count where",
+     "SELECT count(*) FROM process WHERE num_vmas > 50"},
+    {"sum and max",
+     "SELECT sum(total_vm), max(num_vmas) FROM process WHERE state = 1"},
+    {"group by name",
+     "SELECT name, count(*), avg(total_vm) FROM process GROUP BY name"},
+    {"top 10 by total_vm",
+     "SELECT pid, name, total_vm FROM process ORDER BY total_vm DESC LIMIT 10"},
+    {"filter on name",
+     "SELECT pid, priority FROM process WHERE name = 'proc7' AND priority < 110"},
+};
+
+#define NUM_QUERIES (sizeof(b_Queries) / sizeof(b_Queries[0]))
+
+/* Load rows into a new SQLite table, returning the time spent loading */
+double b_LoadSQLite(sqlite3* db, struct process_row* rows, int num_rows)
+{
+    sqlite3_stmt* insert = NULL;
+    double start = b_Now();
+
+    k_CreateProcessTable(db);
+    sqlite3_exec(db, "BEGIN", NULL, 0, NULL);
+    sqlite3_prepare_v2(db, "INSERT INTO process VALUES (?,?,?,?,?,?,?,?)", -1,
+                       &insert, NULL);
+    k_InsertProcessRows(insert, rows, num_rows);
+    sqlite3_finalize(insert);
+    k_BuildIndexes(db, k_ProcessIndexes, NUM_PROCESS_INDEXES);
+    sqlite3_exec(db, "COMMIT", NULL, 0, NULL);
+
+    return b_Now() - start;
+}
+
+/* Copy rows into cols, returning the time spent */
+double b_LoadColumns(k_Columns* cols, struct process_row* rows, int num_rows)
+{
+    double start = b_Now();
+    k_AppendColumns(cols, rows, num_rows);
+    return b_Now() - start;
+}
+
+/* Average time to run query in SQLite, with its rows written to out */
+double b_QuerySQLite(sqlite3* db, char* query, k_Writer* out)
+{
+    sqlite3_stmt* stmt = NULL;
+    double start = b_Now();
+    int i;
+
+    if (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) != SQLITE_OK)
+        return -1;
+    for (i = 0; i < NUM_RUNS; i++) {
+        out->len = 0;
+        k_StepQuery(stmt, &k_Formats[0], out);
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+
+    return (b_Now() - start) / NUM_RUNS;
+}
+
+/* Average time to run query on cols, negative if it falls back to SQLite */
+double b_QueryColumns(sqlite3* db, k_Columns* cols, char* query, k_Writer* out)
+{
+    char* sql = k_NormalizeQuery(query);
+    k_FastQuery fast;
+    double start = b_Now();
+    int i, rc = SQLITE_OK;
+
+    if (sql == NULL || k_ParseFastQuery(sql, &fast) != SQLITE_OK)
+        rc = FAST_FALLBACK;
+    for (i = 0; i < NUM_RUNS && rc == SQLITE_OK; i++) {
+        out->len = 0;
+        rc = k_RunFastQuery(db, &fast, cols, &k_Formats[0], out);
+    }
+
+    return rc == SQLITE_OK ? (b_Now() - start) / NUM_RUNS : -1;
+}
+
+int main(int argc, char* argv[])
+{
+    int num_rows = argc > 1 ? atoi(argv[1]) : 2000000;
+    struct process_row* rows = malloc(num_rows * sizeof(struct process_row));
+    sqlite3* db = k_SQLiteOpen();
+    k_Columns cols = {0};
+    k_Writer out = {-1};
+    int i;
+
+    b_SyntheticRows(rows, num_rows);
+
+    printf("%d rows, times in ms\n", num_rows);
+    printf("  %-20s %10s %10s\n", "", "sqlite", "columnar");
+    printf("  %-20s %10.1f", "load", b_LoadSQLite(db, rows, num_rows) * 1000);
+    printf(" %10.1f\n", b_LoadColumns(&cols, rows, num_rows) * 1000);
+
+    for (i = 0; i < NUM_QUERIES; i++) {
+        double secs;
+
+        printf("  %-20s %10.1f", b_Queries[i][0],
+               b_QuerySQLite(db, b_Queries[i][1], &out) * 1000);
+        if ((secs = b_QueryColumns(db, &cols, b_Queries[i][1], &out)) < 0)
+            printf(" %10s\n", "n/a");
+        else
+            printf(" %10.1f\n", secs * 1000);
+        fflush(stdout);
+    }
+
+    k_WriterFree(&out);
+    sqlite3_close(db);
+    free(rows);
+    return 0;
+}
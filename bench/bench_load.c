@@ -0,0 +1,90 @@
+/*
+ * kQuery - Copyright (C) 2015
+ *
+ * Federico Menozzi <federicogmenozzi@gmail.com>
+ * Halen Wooten     <halen+github@hpwooten.com>  
+ *
+ * This program is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU General Public License as published by the 
+ * Free Software Foundation; either version 2 of the License, 
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the 
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along 
+ * with this program; if not, write to the Free Software Foundation, Inc., 
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Loads synthetic Process rows into an in-memory database, comparing one
+ * sqlite3_exec per row (the old loader) against the prepared, bound,
+ * single-transaction loader. Usage: ./bench_load [rows]
+ */
+
+#include "bench.h"
+
+/* Old loader: format each row as an INSERT and execute it on its own */
+double b_LoadExec(sqlite3* db, struct process_row* rows, int num_rows)
+{
+    char sql[MAX_CALL + PROCESS_NAME_LEN * 2];
+    double start = b_Now();
+    int i;
+
+    for (i = 0; i < num_rows; i++) {
+        struct process_row* row = &rows[i];
+        snprintf(sql, sizeof(sql),
+                 "INSERT INTO process VALUES (%d,'%s',%d,%lld,%u,%d,%d,%llu);",
+                 row->pid, row->name, row->parent_pid, row->state, row->flags,
+                 row->priority, row->num_vmas, row->total_vm);
+        sqlite3_exec(db, sql, NULL, 0, NULL);
+    }
+
+    return b_Now() - start;
+}
+
+/* New loader: one prepared INSERT inside a single transaction */
+double b_LoadPrepared(sqlite3* db, struct process_row* rows, int num_rows)
+{
+    sqlite3_stmt* insert = NULL;
+    double start = b_Now();
+
+    sqlite3_exec(db, "BEGIN", NULL, 0, NULL);
+    sqlite3_prepare_v2(db, "INSERT INTO process VALUES (?,?,?,?,?,?,?,?)", -1,
+                       &insert, NULL);
+    k_InsertProcessRows(insert, rows, num_rows);
+    sqlite3_finalize(insert);
+    sqlite3_exec(db, "COMMIT", NULL, 0, NULL);
+
+    return b_Now() - start;
+}
+
+int main(int argc, char* argv[])
+{
+    int num_rows = argc > 1 ? atoi(argv[1]) : 100000;
+    struct process_row* rows = malloc(num_rows * sizeof(struct process_row));
+    double exec_secs, prepared_secs;
+    sqlite3* db;
+
+    b_SyntheticRows(rows, num_rows);
+
+    db = k_SQLiteOpen();
+    k_CreateProcessTable(db);
+    exec_secs = b_LoadExec(db, rows, num_rows);
+    sqlite3_close(db);
+
+    db = k_SQLiteOpen();
+    k_CreateProcessTable(db);
+    prepared_secs = b_LoadPrepared(db, rows, num_rows);
+    sqlite3_close(db);
+
+    printf("%d rows\n", num_rows);
+    printf("  exec per row:         %10.0f rows/sec\n", num_rows / exec_secs);
+    printf("  prepared transaction: %10.0f rows/sec\n", num_rows / prepared_secs);
+
+    free(rows);
+    return 0;
+}
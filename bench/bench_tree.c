@@ -0,0 +1,136 @@
+/*
+ * kQuery - Copyright (C) 2015
+ *
+ * Federico Menozzi <federicogmenozzi@gmail.com>
+ * Halen Wooten     <halen+github@hpwooten.com>  
+ *
+ * This program is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU General Public License as published by the 
+ * Free Software Foundation; either version 2 of the License, 
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the 
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along 
+ * with this program; if not, write to the Free Software Foundation, Inc., 
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Runs process-tree queries over a synthetic snapshot loaded three ways:
+ * without secondary indexes, with them updated on every insert (what
+ * reloading a snapshot does), and with them built in bulk after loading
+ * (what the first load does). The joins walk the tree level by level
+ * without recursive CTEs, which SQLite 3.7.17 lacks.
+ * Usage: ./bench_tree [rows]
+ */
+
+#include "bench.h"
+
+/* Number of times each query is run */
+#define NUM_RUNS 5
+
+typedef enum { NO_INDEX, INDEX_PER_ROW, INDEX_AFTER_LOAD } b_IndexMode;
+
+char* b_Queries[][2] = {
+    {"children of pid 1000",
+     "SELECT count(*) FROM process WHERE parent_pid = 1000"},
+    {"grandchildren of 100",
+     "SELECT count(*) FROM process c JOIN process p ON c.parent_pid = p.pid "
+     "WHERE p.parent_pid = 100"},
+    {"4 levels below pid 1",
+     "SELECT count(*) FROM process a JOIN process b ON b.parent_pid = a.pid "
+     "JOIN process c ON c.parent_pid = b.pid "
+     "JOIN process d ON d.parent_pid = c.pid WHERE a.parent_pid = 1"},
+    {"subtree of pid 100",
+     "WITH RECURSIVE t(pid) AS (SELECT 100 UNION ALL "
+     "SELECT p.pid FROM process p JOIN t ON p.parent_pid = t.pid) "
+     "SELECT count(*) FROM t"},
+    {"whole tree with depth",
+     "WITH RECURSIVE t(pid, depth) AS (SELECT 1, 0 UNION ALL "
+     "SELECT p.pid, t.depth + 1 FROM process p JOIN t ON p.parent_pid = t.pid) "
+     "SELECT max(depth) FROM t"},
+};
+
+#define NUM_QUERIES (sizeof(b_Queries) / sizeof(b_Queries[0]))
+
+/* Load rows into a new database, returning the time spent loading */
+double b_Load(sqlite3* db, struct process_row* rows, int num_rows, b_IndexMode mode)
+{
+    sqlite3_stmt* insert = NULL;
+    double start = b_Now();
+
+    k_CreateProcessTable(db);
+    sqlite3_exec(db, "BEGIN", NULL, 0, NULL);
+    if (mode == INDEX_PER_ROW)
+        k_BuildIndexes(db, k_ProcessIndexes, NUM_PROCESS_INDEXES);
+    sqlite3_prepare_v2(db, "INSERT INTO process VALUES (?,?,?,?,?,?,?,?)", -1,
+                       &insert, NULL);
+    k_InsertProcessRows(insert, rows, num_rows);
+    sqlite3_finalize(insert);
+    if (mode == INDEX_AFTER_LOAD)
+        k_BuildIndexes(db, k_ProcessIndexes, NUM_PROCESS_INDEXES);
+    sqlite3_exec(db, "COMMIT", NULL, 0, NULL);
+
+    return b_Now() - start;
+}
+
+/* Average time to run query to completion, negative if it can't be
+ * prepared (recursive CTEs need SQLite 3.8.3) */
+double b_Query(sqlite3* db, char* query)
+{
+    sqlite3_stmt* stmt = NULL;
+    double start = b_Now();
+    int i;
+
+    if (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) != SQLITE_OK)
+        return -1;
+    for (i = 0; i < NUM_RUNS; i++) {
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+            ;
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+
+    return (b_Now() - start) / NUM_RUNS;
+}
+
+int main(int argc, char* argv[])
+{
+    char* mode_names[] = {"no index", "index per row", "index after load"};
+    int num_rows = argc > 1 ? atoi(argv[1]) : 100000;
+    struct process_row* rows = malloc(num_rows * sizeof(struct process_row));
+    int mode, i;
+
+    b_SyntheticRows(rows, num_rows);
+
+    printf("%d rows, times in ms\n", num_rows);
+    printf("  %-18s %10s", "", "load");
+    for (i = 0; i < NUM_QUERIES; i++)
+        printf(" %24s", b_Queries[i][0]);
+    printf("\n");
+
+    for (mode = NO_INDEX; mode <= INDEX_AFTER_LOAD; mode++) {
+        sqlite3* db = k_SQLiteOpen();
+
+        printf("  %-18s %10.1f", mode_names[mode],
+               b_Load(db, rows, num_rows, mode) * 1000);
+        for (i = 0; i < NUM_QUERIES; i++) {
+            double secs = b_Query(db, b_Queries[i][1]);
+            if (secs < 0)
+                printf(" %24s", "n/a");
+            else
+                printf(" %24.1f", secs * 1000);
+            fflush(stdout);
+        }
+        printf("\n");
+
+        sqlite3_close(db);
+    }
+
+    free(rows);
+    return 0;
+}
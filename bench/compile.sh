@@ -0,0 +1,5 @@
+#!/bin/bash
+cd "$(dirname "$0")"
+gcc -O2 ../deps/sqlite3.c bench_load.c -o bench_load -ldl -lpthread -lm
+gcc -O2 ../deps/sqlite3.c bench_tree.c -o bench_tree -ldl -lpthread -lm
+gcc -O2 ../deps/sqlite3.c bench_columnar.c -o bench_columnar -ldl -lpthread -lm
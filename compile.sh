@@ -1,2 +1,2 @@
 #!/bin/bash
-gcc deps/sqlite3.c kquery.c -o kquery -ldl -lpthread
+gcc deps/sqlite3.c kquery.c -o kquery -ldl -lpthread -lm
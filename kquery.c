@@ -19,16 +19,29 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#define _GNU_SOURCE  // memfd_create, F_ADD_SEALS
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <termios.h>
 #include <unistd.h>
 #include <math.h>
+#include <time.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "deps/sqlite3.h"
 
@@ -50,23 +63,28 @@
 /* Global vars for use in interface to module */
 int fp;
 char the_file[256] = "/sys/kernel/debug/";
-char callbuf[MAX_CALL];  // Assumes no bufferline is longer
-char respbuf[MAX_RESP];  // Assumes no bufferline is longer
 
-/* Interface for performing "system calls" into kernel module */
-int k_DoSyscall(char *call_string)
+/* Open a separate connection to the module, each with its own cursor */
+int k_OpenModule()
 {
-    int rc;
+    int fd = open(the_file, O_RDWR);
+    if (fd == -1)
+        fprintf(stderr, MAKE_RED "Error opening %s\n" RESET_COLOR, the_file);
+    return fd;
+}
 
-    strcpy(callbuf, call_string);
+/* Perform a call on connection fd, returning the length of the response */
+int k_DoCall(int fd, char *call_string, void *resp, size_t resp_len)
+{
+    int rc;
 
-    rc = write(fp, callbuf, strlen(callbuf) + 1);
+    rc = write(fd, call_string, strlen(call_string) + 1);
     if (rc == -1) {
         fprintf(stderr, MAKE_RED "Error writing %s\n" RESET_COLOR, the_file);
         return rc;
     }
 
-    rc = read(fp, respbuf, sizeof(respbuf));
+    rc = read(fd, resp, resp_len);
     if (rc == -1) {
         fprintf(stderr, MAKE_RED "Error reading %s\n" RESET_COLOR, the_file);
         return rc;
@@ -74,6 +92,283 @@ int k_DoSyscall(char *call_string)
 
     return rc;
 }
+
+/* Sample of the processes every scan returns, drawn by the module during its
+ * task walk: each process is kept with probability rate, or a uniform
+ * reservoir of at most rows processes is kept. Neither set keeps them all. */
+typedef struct {
+    double rate;  // In (0, 1), or 0
+    int rows;
+} k_Sample;
+
+k_Sample sample;
+
+/* Fraction of the processes kept by the last scan, which aggregates over a
+ * sample are divided by (sample_rate() in SQL) */
+double scan_sample_rate = 1.0;
+pthread_mutex_t sample_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Parse a sample given as P% or a number of rows, or "off". -1 if invalid. */
+int k_ParseSample(k_Sample* s, const char* arg)
+{
+    char* end;
+    double v = strtod(arg, &end);
+
+    if (strcmp(arg, "off") == 0) {
+        s->rate = 0;
+        s->rows = 0;
+    } else if (end != arg && strcmp(end, "%") == 0 && v >= 0.0001 && v <= 100) {
+        s->rate = v < 100 ? (int) (v * 10000 + 0.5) / 1000000.0 : 0;  // In ppm
+        s->rows = 0;
+    } else if (end != arg && *end == '\0' && v >= 1 && v <= INT_MAX && v == (int) v) {
+        s->rate = 0;
+        s->rows = (int) v;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/* Start a scan of the processes with min_pid <= pid <= max_pid on fd,
+ * sampled as configured */
+int k_OpenProcessScan(int fd, int min_pid, int max_pid)
+{
+    char call[MAX_CALL];
+    int rc, kept = 0, matched = 0;
+    double rate = 1.0;
+
+    snprintf(call, sizeof(call), "process_open %d %d %d %d", min_pid, max_pid,
+             (int) (sample.rate * 1000000 + 0.5), sample.rows);
+    rc = k_DoCall(fd, call, call, sizeof(call));
+    if (rc == -1)
+        return rc;
+
+    /* Responds with the number of rows kept and of processes in range */
+    call[sizeof(call) - 1] = '\0';
+    if (sample.rate > 0)
+        rate = sample.rate;
+    else if (sscanf(call, "%d %d", &kept, &matched) == 2 && kept < matched)
+        rate = (double) kept / matched;
+
+    pthread_mutex_lock(&sample_mutex);
+    scan_sample_rate = rate;
+    pthread_mutex_unlock(&sample_mutex);
+
+    return rc;
+}
+
+/* Fetch the next batch of at most max_rows rows of the scan on fd (as many as
+ * fit if 0), batch holds MAX_RESP bytes */
+int k_FetchProcessBatch(int fd, struct process_batch* batch, int max_rows)
+{
+    char call[MAX_CALL];
+    int rc;
+
+    snprintf(call, sizeof(call), "process_fetch %d", max_rows);
+    rc = k_DoCall(fd, call, batch, MAX_RESP);
+    if (rc < (int) sizeof(struct process_batch)) {
+        batch->num_rows = 0;
+        batch->done = 1;
+        return -1;
+    }
+    return rc;
+}
+//
+//--------------------------------------------------------------------------//
+
+//--------------------------------- MEMORY ---------------------------------//
+//
+/* SQLite allocates from per-size-class free lists carved out of large slabs,
+ * so once a session reaches steady state, blocks are recycled instead of
+ * going through malloc. Slabs are never returned, which keeps long-lived
+ * allocations (cached statements, reused snapshots) from fragmenting the
+ * heap between short-lived ones. */
+#define SLAB_SIZE   (1 << 20)
+#define MIN_CLASS   4   // 16 bytes
+#define MAX_CLASS   16  // 64 KiB
+#define NUM_CLASSES (MAX_CLASS - MIN_CLASS + 1)
+
+/* Every block starts with its usable size */
+#define BLOCK_HEADER sizeof(sqlite3_int64)
+
+pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+void* pool_free[NUM_CLASSES];
+char* pool_slab;
+size_t pool_slab_left;
+
+int k_SizeClass(int n)
+{
+    int c = MIN_CLASS;
+    while ((1 << c) < n)
+        c++;
+    return c;
+}
+
+void* k_PoolMalloc(int n)
+{
+    sqlite3_int64* block;
+    int c;
+
+    if (n > (1 << MAX_CLASS)) {
+        block = malloc(BLOCK_HEADER + n);
+        if (block == NULL)
+            return NULL;
+        *block = n;
+        return block + 1;
+    }
+
+    c = k_SizeClass(n);
+
+    pthread_mutex_lock(&pool_mutex);
+    if (pool_free[c - MIN_CLASS] != NULL) {
+        block = pool_free[c - MIN_CLASS];
+        pool_free[c - MIN_CLASS] = *(void**) (block + 1);
+    } else {
+        if (pool_slab_left < BLOCK_HEADER + (1 << c)) {
+            pool_slab = malloc(SLAB_SIZE);
+            pool_slab_left = pool_slab ? SLAB_SIZE : 0;
+        }
+        block = (sqlite3_int64*) pool_slab;
+        if (block != NULL) {
+            pool_slab += BLOCK_HEADER + (1 << c);
+            pool_slab_left -= BLOCK_HEADER + (1 << c);
+        }
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (block == NULL)
+        return NULL;
+    *block = 1 << c;
+    return block + 1;
+}
+
+void k_PoolFree(void* p)
+{
+    sqlite3_int64* block = (sqlite3_int64*) p - 1;
+
+    if (*block > (1 << MAX_CLASS)) {
+        free(block);
+        return;
+    }
+
+    pthread_mutex_lock(&pool_mutex);
+    *(void**) p = pool_free[k_SizeClass(*block) - MIN_CLASS];
+    pool_free[k_SizeClass(*block) - MIN_CLASS] = block;
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+int k_PoolSize(void* p)
+{
+    return (int) ((sqlite3_int64*) p)[-1];
+}
+
+void* k_PoolRealloc(void* p, int n)
+{
+    void* q;
+
+    if (n <= k_PoolSize(p) && n > k_PoolSize(p) / 2)
+        return p;
+
+    q = k_PoolMalloc(n);
+    if (q == NULL)
+        return NULL;
+    memcpy(q, p, n < k_PoolSize(p) ? n : k_PoolSize(p));
+    k_PoolFree(p);
+    return q;
+}
+
+int k_PoolRoundup(int n)
+{
+    if (n > (1 << MAX_CLASS))
+        return (n + 7) & ~7;
+    return 1 << k_SizeClass(n);
+}
+
+int k_PoolInit(void* NotUsed)
+{
+    return SQLITE_OK;
+}
+
+void k_PoolShutdown(void* NotUsed)
+{
+}
+
+/* Route SQLite's allocations through the pools, before SQLite is used */
+int k_InstallAllocator()
+{
+    static const sqlite3_mem_methods methods = {
+        k_PoolMalloc, k_PoolFree, k_PoolRealloc, k_PoolSize,
+        k_PoolRoundup, k_PoolInit, k_PoolShutdown, NULL
+    };
+    return sqlite3_config(SQLITE_CONFIG_MALLOC, &methods);
+}
+
+/* Bump allocator for scratch memory that lives until the end of a query,
+ * such as the query text and batches of decoded rows. Chunks are kept across
+ * resets, so resetting is a pointer move and steady state needs no malloc. */
+typedef struct k_Chunk {
+    struct k_Chunk* next;
+    size_t size;
+} k_Chunk;
+
+typedef struct {
+    k_Chunk* first;
+    k_Chunk* current;
+    size_t used;  // Bytes used in current, after the chunk header
+} k_Arena;
+
+#define ARENA_CHUNK_SIZE (256 * 1024)
+
+k_Arena query_arena;
+
+void* k_ArenaAlloc(k_Arena* arena, size_t n)
+{
+    k_Chunk* chunk = arena->current;
+    void* p;
+
+    n = (n + 15) & ~(size_t) 15;
+
+    /* Move on to the next chunk that fits, allocating one if needed */
+    while (chunk == NULL || arena->used + n > chunk->size) {
+        k_Chunk* next = chunk ? chunk->next : arena->first;
+        if (next == NULL) {
+            size_t size = n > ARENA_CHUNK_SIZE ? n : ARENA_CHUNK_SIZE;
+            next = malloc(sizeof(k_Chunk) + size);
+            if (next == NULL)
+                return NULL;
+            next->next = NULL;
+            next->size = size;
+            if (chunk)
+                chunk->next = next;
+            else
+                arena->first = next;
+        }
+        chunk = arena->current = next;
+        arena->used = 0;
+    }
+
+    p = (char*) (chunk + 1) + arena->used;
+    arena->used += n;
+    return p;
+}
+
+/* Release everything allocated from arena */
+void k_ArenaReset(k_Arena* arena)
+{
+    arena->current = NULL;
+    arena->used = 0;
+}
+
+/* Free the chunks of arena */
+void k_ArenaFree(k_Arena* arena)
+{
+    while (arena->first != NULL) {
+        k_Chunk* next = arena->first->next;
+        free(arena->first);
+        arena->first = next;
+    }
+    k_ArenaReset(arena);
+}
 //
 //--------------------------------------------------------------------------//
 
@@ -156,6 +451,8 @@ int k_GetQueryFromStdin(char* query, size_t max_query_len)
 {
     int i = 0, rc = 0;
 
+    query[0] = '\0';
+
     while (1) {
         int ch = k_Getch();
         if (ch == EOF) {
@@ -170,7 +467,8 @@ int k_GetQueryFromStdin(char* query, size_t max_query_len)
                 break;
             }
 
-            if (query[i-1] == ';') {
+            /* Meta-commands end at the newline, statements at a ';' */
+            if (query[0] == '.' || (i != 0 && query[i-1] == ';')) {
                 fprintf(stdout, "\n");
                 break;
             }
@@ -238,169 +536,6584 @@ int k_GetQueryFromCommandLine(char* query, char* arg, size_t max_query_len)
 //
 //--------------------------------------------------------------------------//
 
-//--------------------------- DATABASE CALLBACKS ---------------------------//
+//--------------------------------- OUTPUT ---------------------------------//
 //
-/* Callback function for query execution in REPL*/
-int k_QueryCallbackREPL(void *NotUsed, int argc, char **argv, char **azColName) 
+/* Query results are formatted straight from typed columns into a large
+ * buffer, flushed with write, instead of going through stdio field by field */
+#define WRITER_BUF_SIZE (64 * 1024)
+
+typedef struct k_Writer {
+    int fd;       // Flushed to fd when full, or -1 to keep everything in buf
+    char* buf;
+    size_t len;
+    size_t cap;
+    int error;    // Set once a write or allocation fails
+    void* state;  // Owned by the output format while a statement is written
+    struct k_Writer* copy;  // Also gets everything flushed, if not NULL
+    size_t copy_limit;      // Bytes copy may hold before its error is set
+} k_Writer;
+
+/* Writer for query results on standard output */
+k_Writer stdout_writer = {STDOUT_FILENO};
+
+/* Write out everything buffered */
+int k_WriterFlush(k_Writer* w)
 {
-    int i;
-    for (i = 0; i < argc; i++) {
-        fprintf(stdout, "%s", argv[i] ? argv[i] : "NULL");
-        if (i != argc-1)
-            fprintf(stdout, "|");
+    size_t done = 0;
+
+    if (w->fd == -1 || w->len == 0)
+        return w->error ? -1 : 0;
+
+    if (w->fd == STDOUT_FILENO)
+        fflush(stdout);  // Keep order with anything printed through stdio
+
+    if (w->copy != NULL && !w->copy->error) {
+        k_Writer* copy = w->copy;
+        char* buf = NULL;
+
+        if (copy->len + w->len <= w->copy_limit)
+            buf = realloc(copy->buf, copy->len + w->len);
+        if (buf == NULL) {
+            copy->error = 1;
+        } else {
+            memcpy(buf + copy->len, w->buf, w->len);
+            copy->buf = buf;
+            copy->len = copy->cap = copy->len + w->len;
+        }
+    }
+
+    while (done < w->len && !w->error) {
+        ssize_t n = write(w->fd, w->buf + done, w->len - done);
+        if (n == -1 && errno != EINTR)
+            w->error = 1;
+        else if (n > 0)
+            done += n;
     }
-    fprintf(stdout, "\n");
+    w->len = 0;
+
+    return w->error ? -1 : 0;
+}
+
+/* Make room for n more bytes, 0 on success */
+int k_WriterReserve(k_Writer* w, size_t n)
+{
+    size_t cap;
+    char* buf;
+
+    if (w->len + n <= w->cap)
+        return 0;
+    if (w->error)
+        return -1;
+    if (w->fd != -1 && k_WriterFlush(w) == -1)
+        return -1;
+    if (w->len + n <= w->cap)
+        return 0;
 
+    cap = w->cap ? w->cap : WRITER_BUF_SIZE;
+    while (cap < w->len + n)
+        cap *= 2;
+    buf = realloc(w->buf, cap);
+    if (buf == NULL) {
+        w->error = 1;
+        return -1;
+    }
+    w->buf = buf;
+    w->cap = cap;
     return 0;
 }
 
-/* Callback function for query execution in pipeline */
-int k_QueryCallbackPipeline(void *NotUsed, int argc, char **argv, char **azColName)
+void k_WriteBytes(k_Writer* w, const char* s, size_t n)
 {
-    int i;
-    for (i = 0; i < argc; i++) {
-        fprintf(stdout, "%s", argv[i] ? argv[i] : "NULL");
-        if (i != argc-1)
-            fprintf(stdout, "__");
+    if (n > 0 && k_WriterReserve(w, n) == 0) {
+        memcpy(w->buf + w->len, s, n);
+        w->len += n;
+    }
+}
+
+void k_WriteStr(k_Writer* w, const char* s)
+{
+    k_WriteBytes(w, s, strlen(s));
+}
+
+/* "00".."99", for formatting two digits at a time */
+const char k_DigitPairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536"
+    "37383940414243444546474849505152535455565758596061626364656667686970717273"
+    "7475767778798081828384858687888990919293949596979899";
+
+/* Write v in decimal, two digits at a time */
+void k_WriteInt(k_Writer* w, sqlite3_int64 v)
+{
+    char digits[20];
+    char* p = digits + sizeof(digits);
+    sqlite3_uint64 u = v < 0 ? -(sqlite3_uint64) v : (sqlite3_uint64) v;
+
+    while (u >= 100) {
+        int pair = (int) (u % 100) * 2;
+        u /= 100;
+        *--p = k_DigitPairs[pair + 1];
+        *--p = k_DigitPairs[pair];
+    }
+    if (u >= 10) {
+        *--p = k_DigitPairs[u * 2 + 1];
+        *--p = k_DigitPairs[u * 2];
+    } else {
+        *--p = '0' + u;
+    }
+
+    if (k_WriterReserve(w, 21) == 0) {
+        if (v < 0)
+            w->buf[w->len++] = '-';
+        memcpy(w->buf + w->len, p, digits + sizeof(digits) - p);
+        w->len += digits + sizeof(digits) - p;
+    }
+}
+
+/* Write column col of the current row of stmt. Integers are formatted here,
+ * everything else as SQLite renders it as text. The column is fetched once as
+ * a value, since every sqlite3_column_* call checks the statement and row
+ * again (and, on connections not opened with SQLITE_OPEN_NOMUTEX, takes the
+ * connection mutex). */
+void k_WriteColumn(k_Writer* w, sqlite3_stmt* stmt, int col)
+{
+    sqlite3_value* value = sqlite3_column_value(stmt, col);
+
+    switch (sqlite3_value_type(value)) {
+    case SQLITE_INTEGER:
+        k_WriteInt(w, sqlite3_value_int64(value));
+        break;
+    case SQLITE_NULL:
+        k_WriteBytes(w, "NULL", 4);
+        break;
+    default: {
+        const char* text = (const char*) sqlite3_value_text(value);
+        k_WriteBytes(w, text, sqlite3_value_bytes(value));
+        break;
+    }
+    }
+}
+
+/* Write n zero bytes */
+void k_WriteZeros(k_Writer* w, size_t n)
+{
+    if (n > 0 && k_WriterReserve(w, n) == 0) {
+        memset(w->buf + w->len, 0, n);
+        w->len += n;
     }
-    fprintf(stdout, "\n");
+}
+
+/* Pad with zeros to a multiple of align bytes */
+void k_WritePadding(k_Writer* w, size_t align)
+{
+    k_WriteZeros(w, (align - w->len % align) % align);
+}
 
-    return 0;   
+/* Release the buffer of a writer */
+void k_WriterFree(k_Writer* w)
+{
+    free(w->buf);
+    w->buf = NULL;
+    w->len = w->cap = 0;
 }
 //
 //--------------------------------------------------------------------------//
 
-//------------------------------ SQLITE WRAPPERS ---------------------------//
+//------------------------------- ARROW IPC --------------------------------//
 //
-/* Open database */
-sqlite3* k_SQLiteOpen()
+/* --format arrow writes each statement's result as an Arrow IPC stream: a
+ * Schema message, a RecordBatch message every ARROW_BATCH_ROWS rows and an
+ * end-of-stream marker. Columns are Int64, Float64 or Utf8, all nullable,
+ * chosen from the declared column type, or for expressions the type of the
+ * first value. Later values of another type are converted like SQLite's
+ * sqlite3_value_* accessors do. Assumes a little-endian host. */
+#define ARROW_BATCH_ROWS 65536
+
+/* Values of the Type and MessageHeader unions in Schema.fbs and Message.fbs */
+#define ARROW_INT64    2  // Type.Int
+#define ARROW_FLOAT64  3  // Type.FloatingPoint
+#define ARROW_UTF8     5  // Type.Utf8
+
+#define ARROW_SCHEMA       1
+#define ARROW_RECORD_BATCH 3
+
+typedef struct {
+    int type;
+    int null_count;
+    k_Writer validity;
+    k_Writer values;   // Utf8 data, or 8 byte values
+    k_Writer offsets;  // Utf8 only
+} k_ArrowColumn;
+
+typedef struct {
+    int num_cols;
+    int num_rows;      // In the batch being built
+    int schema_written;
+    k_ArrowColumn* cols;
+} k_ArrowStream;
+
+/* Flatbuffers are written front to back here: every table comes after the
+ * objects that refer to it, so references are patched in once it's placed.
+ * Each table is preceded by its vtable and starts 8-byte aligned. */
+
+/* Write a table whose field i is sizes[i] bytes (0 if absent), zeroed. Sets
+ * pos[i] to where field i is, returning where the table starts. */
+size_t k_FbTable(k_Writer* fb, int num_fields, const int* sizes, size_t* pos)
 {
-    sqlite3* db = NULL;
-    int rc = sqlite3_open(NULL, &db);   // NULL filepath for in-memory database
-    if (rc) {
-        fprintf(stderr, MAKE_RED "Can't open kquery database: %s\n" RESET_COLOR, sqlite3_errmsg(db));
-        sqlite3_close(db);
-        close(fp);
-        exit(-1);
+    uint16_t vtable[2 + 8];
+    size_t vtable_pos, table_pos, table_size = 4;
+    int32_t soffset;
+    int i;
+
+    for (i = 0; i < num_fields; i++) {
+        vtable[2 + i] = 0;
+        if (sizes[i] == 0)
+            continue;
+        table_size = (table_size + sizes[i] - 1) / sizes[i] * sizes[i];
+        vtable[2 + i] = table_size;
+        table_size += sizes[i];
     }
-    return db;
+    vtable[0] = (2 + num_fields) * sizeof(uint16_t);
+    vtable[1] = table_size;
+
+    k_WritePadding(fb, 2);
+    vtable_pos = fb->len;
+    k_WriteBytes(fb, (char*) vtable, vtable[0]);
+
+    k_WritePadding(fb, 8);
+    table_pos = fb->len;
+    soffset = table_pos - vtable_pos;
+    k_WriteBytes(fb, (char*) &soffset, 4);
+    k_WriteZeros(fb, table_size - 4);
+
+    for (i = 0; i < num_fields; i++)
+        pos[i] = vtable[2 + i] ? table_pos + vtable[2 + i] : 0;
+    return table_pos;
 }
 
-/* Create Process table */
-int k_CreateProcessTable(sqlite3* db)
+/* Set the size bytes of the scalar at pos */
+void k_FbSet(k_Writer* fb, size_t pos, const void* value, size_t size)
 {
-    char* error_msg = NULL;
-    char* create_stmt  = "CREATE TABLE IF NOT EXISTS process ("
-                         "  pid        INT PRIMARY KEY,"
-                         "  name       TEXT,"
-                         "  parent_pid INT,"
-                         "  state      BIGINT,"
-                         "  flags      BIGINT,"
-                         "  priority   INT,"
-                         "  num_vmas   INT,"
-                         "  total_vm   BIGINT"
-                         ")";
-    int rc = sqlite3_exec(db, create_stmt, NULL, 0, &error_msg);
-    if (rc != SQLITE_OK) {
-        fprintf(stdout, MAKE_RED "SQL error: %s\n" RESET_COLOR, error_msg);
-        sqlite3_free(error_msg);
-    }
-    return rc;
+    if (!fb->error)
+        memcpy(fb->buf + pos, value, size);
 }
 
-/* Populate Process table */
-int k_PopulateProcessTable(sqlite3* db)
+/* Point the reference at pos to the object at target, written after it */
+void k_FbRef(k_Writer* fb, size_t pos, size_t target)
 {
-    char* error_msg = NULL;
-    int rc = k_DoSyscall("process_get_row");  // First call returns number of rows
-    if (rc == -1)
-        return rc;
+    uint32_t offset = target - pos;
+    k_FbSet(fb, pos, &offset, 4);
+}
 
-    while (strcmp(respbuf, "")) {
-        /* Fetch row */
-        rc = k_DoSyscall("process_get_row");  // Subsequent calls fetch rows
-        if (rc == -1)
-            break;
-        
-        /* Insert row into table */
-        rc = sqlite3_exec(db, respbuf, NULL, 0, &error_msg);
-        if (rc != SQLITE_OK) {
-            fprintf(stdout, MAKE_RED "SQL error: %s\n" RESET_COLOR, error_msg);
-            sqlite3_free(error_msg);
-        }
-    }
+size_t k_FbString(k_Writer* fb, const char* s)
+{
+    uint32_t len = strlen(s);
+    size_t pos;
 
-    return rc;
+    k_WritePadding(fb, 4);
+    pos = fb->len;
+    k_WriteBytes(fb, (char*) &len, 4);
+    k_WriteBytes(fb, s, len + 1);
+    return pos;
 }
 
-/* Reset Process table */
-int k_ResetProcessTable(sqlite3* db)
+/* Write a vector of n zeroed elements of size bytes, aligned to align. The
+ * elements start 4 bytes after the returned position. */
+size_t k_FbVector(k_Writer* fb, uint32_t n, size_t size, size_t align)
 {
-    char* error_msg = NULL;
-    int rc = sqlite3_exec(db, "DELETE FROM process;", NULL, 0, &error_msg);
-    if (rc != SQLITE_OK) {
-        fprintf(stdout, MAKE_RED "SQL error: %s\n" RESET_COLOR, error_msg);
-        sqlite3_free(error_msg);
-    }
-    return rc;
+    size_t pos;
+
+    k_WritePadding(fb, 4);
+    if ((fb->len + 4) % align != 0)
+        k_WriteZeros(fb, 4);
+    pos = fb->len;
+    k_WriteBytes(fb, (char*) &n, 4);
+    k_WriteZeros(fb, n * size);
+    return pos;
 }
 
-/* Execute query */
-int k_ExecuteQuery(sqlite3* db, char* query, int(*callback)(void*, int, char**, char**))
+/* Start a Message of header_type into fb, returning where to reference the
+ * header table from */
+size_t k_ArrowMessage(k_Writer* fb, uint8_t header_type, int64_t body_len)
 {
-    char* error_msg = NULL;
-    int rc = sqlite3_exec(db, query, callback, 0, &error_msg);
-    if (rc != SQLITE_OK) {
-        fprintf(stdout, MAKE_RED "SQL error: %s\n" RESET_COLOR, error_msg);
-        sqlite3_free(error_msg);
+    int sizes[] = {2, 1, 4, 8};  // version, header_type, header, bodyLength
+    uint16_t version = 4;        // MetadataVersion.V5
+    size_t pos[4];
+
+    k_WriteZeros(fb, 4);         // Root reference
+    k_FbRef(fb, 0, k_FbTable(fb, 4, sizes, pos));
+    k_FbSet(fb, pos[0], &version, 2);
+    k_FbSet(fb, pos[1], &header_type, 1);
+    k_FbSet(fb, pos[3], &body_len, 8);
+    return pos[2];
+}
+
+/* Write the message with metadata fb and body (NULL if none) to out */
+void k_ArrowWriteMessage(k_Writer* out, k_Writer* fb, k_Writer* body)
+{
+    int32_t continuation = -1, len;
+
+    k_WritePadding(fb, 8);
+    len = fb->len;
+    k_WriteBytes(out, (char*) &continuation, 4);
+    k_WriteBytes(out, (char*) &len, 4);
+    k_WriteBytes(out, fb->buf, fb->len);
+    if (body != NULL)
+        k_WriteBytes(out, body->buf, body->len);
+}
+
+void k_ArrowWriteSchema(k_Writer* out, k_ArrowStream* stream, sqlite3_stmt* stmt)
+{
+    int schema_sizes[] = {0, 4};  // endianness (little), fields
+    int field_sizes[]  = {4, 1, 1, 4, 0, 4};  // name, nullable, type_type, type,
+                                              // dictionary, children
+    k_Writer fb = {-1};
+    size_t pos[6], header, fields;
+    int i;
+
+    header = k_ArrowMessage(&fb, ARROW_SCHEMA, 0);
+    k_FbRef(&fb, header, k_FbTable(&fb, 2, schema_sizes, pos));
+    fields = k_FbVector(&fb, stream->num_cols, 4, 4);
+    k_FbRef(&fb, pos[1], fields);
+
+    for (i = 0; i < stream->num_cols; i++) {
+        uint8_t nullable = 1, type = stream->cols[i].type;
+        size_t type_pos[2];
+
+        k_FbRef(&fb, fields + 4 + 4 * i, k_FbTable(&fb, 6, field_sizes, pos));
+        k_FbSet(&fb, pos[1], &nullable, 1);
+        k_FbSet(&fb, pos[2], &type, 1);
+        k_FbRef(&fb, pos[0], k_FbString(&fb, sqlite3_column_name(stmt, i)));
+        k_FbRef(&fb, pos[5], k_FbVector(&fb, 0, 4, 4));
+
+        if (type == ARROW_INT64) {
+            int sizes[] = {4, 1};  // bitWidth, is_signed
+            int32_t bit_width = 64;
+            uint8_t is_signed = 1;
+            k_FbRef(&fb, pos[3], k_FbTable(&fb, 2, sizes, type_pos));
+            k_FbSet(&fb, type_pos[0], &bit_width, 4);
+            k_FbSet(&fb, type_pos[1], &is_signed, 1);
+        } else if (type == ARROW_FLOAT64) {
+            int sizes[] = {2};     // precision
+            int16_t precision = 2; // Precision.DOUBLE
+            k_FbRef(&fb, pos[3], k_FbTable(&fb, 1, sizes, type_pos));
+            k_FbSet(&fb, type_pos[0], &precision, 2);
+        } else {
+            k_FbRef(&fb, pos[3], k_FbTable(&fb, 0, NULL, type_pos));
+        }
     }
-    return rc;
+
+    k_ArrowWriteMessage(out, &fb, NULL);
+    k_WriterFree(&fb);
 }
-//
-//--------------------------------------------------------------------------//
 
-int main(int argc, char* argv[])
+/* Write the rows collected so far as a RecordBatch and start a new batch */
+void k_ArrowWriteBatch(k_Writer* out, k_ArrowStream* stream)
 {
-    char query[MAX_QUERY_LEN];
+    int batch_sizes[] = {8, 4, 4};  // length, nodes, buffers
+    k_Writer fb = {-1}, body = {-1};
+    int64_t num_rows = stream->num_rows;
+    size_t pos[3], header, nodes, buffers;
+    int i, num_buffers = 0;
 
-    /* Open the file (module) */
-    strcat(the_file, dir_name);
-    strcat(the_file, "/");
-    strcat(the_file, file_name);
-    if ((fp = open(the_file, O_RDWR)) == -1) {
-        fprintf(stderr, MAKE_RED "Error opening %s\n" RESET_COLOR, the_file);
-        close(fp);
-        exit(-1);
+    for (i = 0; i < stream->num_cols; i++)
+        num_buffers += stream->cols[i].type == ARROW_UTF8 ? 3 : 2;
+
+    /* Body first, since the metadata records its buffers */
+    for (i = 0; i < stream->num_cols; i++) {
+        k_ArrowColumn* col = &stream->cols[i];
+        k_WriteBytes(&body, col->validity.buf, col->validity.len);
+        k_WritePadding(&body, 8);
+        if (col->type == ARROW_UTF8) {
+            k_WriteBytes(&body, col->offsets.buf, col->offsets.len);
+            k_WritePadding(&body, 8);
+        }
+        k_WriteBytes(&body, col->values.buf, col->values.len);
+        k_WritePadding(&body, 8);
     }
 
-    sqlite3* db = k_SQLiteOpen();
+    header = k_ArrowMessage(&fb, ARROW_RECORD_BATCH, body.len);
+    k_FbRef(&fb, header, k_FbTable(&fb, 3, batch_sizes, pos));
+    k_FbSet(&fb, pos[0], &num_rows, 8);
+    nodes = k_FbVector(&fb, stream->num_cols, 16, 8);
+    k_FbRef(&fb, pos[1], nodes);
+    buffers = k_FbVector(&fb, num_buffers, 16, 8);
+    k_FbRef(&fb, pos[2], buffers);
 
-    if (argc == 2) {
-        k_GetQueryFromCommandLine(query, argv[1], MAX_QUERY_LEN);
+    /* FieldNode {length, null_count} and Buffer {offset, length} structs */
+    {
+        int64_t offset = 0, b = 0;
+        for (i = 0; i < stream->num_cols; i++) {
+            k_ArrowColumn* col = &stream->cols[i];
+            k_Writer* bufs[] = {&col->validity, &col->offsets, &col->values};
+            int64_t null_count = col->null_count;
+            int j;
 
-        k_CreateProcessTable(db);
-        if (k_PopulateProcessTable(db) == SQLITE_OK)
-            k_ExecuteQuery(db, query, k_QueryCallbackPipeline);
-    } else if (argc == 1) {
-        /* Enter REPL */
-        while (1) {
-            fprintf(stdout, "kquery> ");
+            k_FbSet(&fb, nodes + 4 + 16 * i, &num_rows, 8);
+            k_FbSet(&fb, nodes + 12 + 16 * i, &null_count, 8);
 
-            if (k_GetQueryFromStdin(query, MAX_QUERY_LEN) == -1)
-                break;
+            for (j = 0; j < 3; j++) {
+                int64_t len = bufs[j]->len;
+                if (j == 1 && col->type != ARROW_UTF8)
+                    continue;
+                k_FbSet(&fb, buffers + 4 + 16 * b, &offset, 8);
+                k_FbSet(&fb, buffers + 12 + 16 * b, &len, 8);
+                offset += (len + 7) & ~7;
+                b++;
+            }
 
-            k_CreateProcessTable(db);
-            if (k_PopulateProcessTable(db) == SQLITE_OK);
-                k_ExecuteQuery(db, query, k_QueryCallbackREPL);
-            k_ResetProcessTable(db);
+            col->validity.len = col->values.len = col->offsets.len = 0;
+            col->null_count = 0;
+            if (col->type == ARROW_UTF8)
+                k_WriteZeros(&col->offsets, 4);
         }
-    } else {
-        printf("Incorrect number of arguments\n");
     }
 
-	/* Cleanup */
-    sqlite3_close(db);
-    close(fp);
+    k_ArrowWriteMessage(out, &fb, &body);
+    k_WriterFree(&fb);
+    k_WriterFree(&body);
+    stream->num_rows = 0;
+}
 
-    return 0;
+/* Arrow type for column col of stmt, from its declared type or else value */
+int k_ArrowType(sqlite3_stmt* stmt, int col, sqlite3_value* value)
+{
+    const char* decltype = sqlite3_column_decltype(stmt, col);
+
+    if (decltype != NULL) {
+        if (strcasestr(decltype, "INT"))
+            return ARROW_INT64;
+        if (strcasestr(decltype, "REAL") || strcasestr(decltype, "FLOA") ||
+            strcasestr(decltype, "DOUB"))
+            return ARROW_FLOAT64;
+        return ARROW_UTF8;
+    }
+
+    switch (value ? sqlite3_value_type(value) : SQLITE_NULL) {
+    case SQLITE_INTEGER: return ARROW_INT64;
+    case SQLITE_FLOAT:   return ARROW_FLOAT64;
+    default:             return ARROW_UTF8;
+    }
+}
+
+/* Start the stream for stmt, typing columns from the current row if any */
+k_ArrowStream* k_ArrowStart(sqlite3_stmt* stmt, int has_row)
+{
+    k_ArrowStream* stream = calloc(1, sizeof(k_ArrowStream));
+    int i;
+
+    if (stream == NULL)
+        return NULL;
+    stream->num_cols = sqlite3_column_count(stmt);
+    stream->cols = calloc(stream->num_cols, sizeof(k_ArrowColumn));
+    if (stream->cols == NULL) {
+        free(stream);
+        return NULL;
+    }
+
+    for (i = 0; i < stream->num_cols; i++) {
+        k_ArrowColumn* col = &stream->cols[i];
+        col->type = k_ArrowType(stmt, i, has_row ? sqlite3_column_value(stmt, i) : NULL);
+        col->validity.fd = col->values.fd = col->offsets.fd = -1;
+        if (col->type == ARROW_UTF8)
+            k_WriteZeros(&col->offsets, 4);
+    }
+    return stream;
+}
+
+/* Callback function for Arrow output, adding the row to the current batch */
+int k_QueryCallbackArrow(k_Writer* out, sqlite3_stmt* stmt)
+{
+    k_ArrowStream* stream = out->state;
+    int i;
+
+    if (stream == NULL && (stream = out->state = k_ArrowStart(stmt, 1)) == NULL)
+        return 1;
+
+    for (i = 0; i < stream->num_cols; i++) {
+        k_ArrowColumn* col = &stream->cols[i];
+        sqlite3_value* value = sqlite3_column_value(stmt, i);
+        int is_null = sqlite3_value_type(value) == SQLITE_NULL;
+
+        if (stream->num_rows % 8 == 0)
+            k_WriteZeros(&col->validity, 1);
+        if (col->validity.error)
+            return 1;
+        if (is_null)
+            col->null_count++;
+        else
+            col->validity.buf[col->validity.len - 1] |= 1 << (stream->num_rows % 8);
+
+        if (col->type == ARROW_INT64) {
+            int64_t v = sqlite3_value_int64(value);
+            k_WriteBytes(&col->values, (char*) &v, 8);
+        } else if (col->type == ARROW_FLOAT64) {
+            double v = sqlite3_value_double(value);
+            k_WriteBytes(&col->values, (char*) &v, 8);
+        } else {
+            int32_t end;
+            if (!is_null)
+                k_WriteBytes(&col->values, (const char*) sqlite3_value_text(value),
+                             sqlite3_value_bytes(value));
+            end = col->values.len;
+            k_WriteBytes(&col->offsets, (char*) &end, 4);
+        }
+
+        if (col->values.error || col->offsets.error)
+            return 1;
+    }
+
+    if (++stream->num_rows == ARROW_BATCH_ROWS) {
+        if (!stream->schema_written)
+            k_ArrowWriteSchema(out, stream, stmt);
+        stream->schema_written = 1;
+        k_ArrowWriteBatch(out, stream);
+    }
+
+    return out->error;
+}
+
+/* Finish the stream of stmt: schema if no batch was written yet, the last
+ * batch and the end-of-stream marker */
+void k_ArrowFooter(k_Writer* out, sqlite3_stmt* stmt)
+{
+    int32_t eos[] = {-1, 0};
+    k_ArrowStream* stream = out->state;
+    int i;
+
+    if (stream == NULL && (stream = k_ArrowStart(stmt, 0)) == NULL)
+        return;
+
+    if (!stream->schema_written)
+        k_ArrowWriteSchema(out, stream, stmt);
+    if (stream->num_rows > 0)
+        k_ArrowWriteBatch(out, stream);
+    k_WriteBytes(out, (char*) eos, sizeof(eos));
+
+    for (i = 0; i < stream->num_cols; i++) {
+        k_WriterFree(&stream->cols[i].validity);
+        k_WriterFree(&stream->cols[i].values);
+        k_WriterFree(&stream->cols[i].offsets);
+    }
+    free(stream->cols);
+    free(stream);
+    out->state = NULL;
+}
+//
+//--------------------------------------------------------------------------//
+
+//--------------------------- DATABASE CALLBACKS ---------------------------//
+//
+/* Output format: an optional header written before the rows of each
+ * statement, a callback writing each row and an optional footer */
+typedef struct {
+    char* name;
+    void (*header)(k_Writer*, sqlite3_stmt*);
+    int (*row)(k_Writer*, sqlite3_stmt*);
+    void (*footer)(k_Writer*, sqlite3_stmt*);  // After the last row
+} k_Format;
+
+/* Write the current row of stmt to out, columns separated by separator */
+int k_WriteRow(k_Writer* out, sqlite3_stmt* stmt, const char* separator, size_t len)
+{
+    int i, num_cols = sqlite3_column_count(stmt);
+    for (i = 0; i < num_cols; i++) {
+        if (i != 0)
+            k_WriteBytes(out, separator, len);
+        k_WriteColumn(out, stmt, i);
+    }
+    k_WriteBytes(out, "\n", 1);
+
+    return out->error;
+}
+
+/* Callback function for query execution in REPL */
+int k_QueryCallbackREPL(k_Writer* out, sqlite3_stmt* stmt)
+{
+    return k_WriteRow(out, stmt, "|", 1);
+}
+
+/* Callback function for query execution in pipeline */
+int k_QueryCallbackPipeline(k_Writer* out, sqlite3_stmt* stmt)
+{
+    return k_WriteRow(out, stmt, "__", 2);
+}
+
+/* Write s as a CSV field, quoted (with quotes doubled) only if it contains a
+ * comma, quote or line break */
+void k_WriteCSVField(k_Writer* out, const char* s, size_t n)
+{
+    size_t i, start = 0;
+
+    for (i = 0; i < n; i++)
+        if (s[i] == ',' || s[i] == '"' || s[i] == '\n' || s[i] == '\r')
+            break;
+    if (i == n) {
+        k_WriteBytes(out, s, n);
+        return;
+    }
+
+    k_WriteBytes(out, "\"", 1);
+    for (; i < n; i++) {
+        if (s[i] == '"') {
+            k_WriteBytes(out, s + start, i + 1 - start);  // Includes the quote
+            start = i;                                    // and repeats it
+        }
+    }
+    k_WriteBytes(out, s + start, n - start);
+    k_WriteBytes(out, "\"", 1);
+}
+
+/* CSV header, with column names */
+void k_CSVHeader(k_Writer* out, sqlite3_stmt* stmt)
+{
+    int i, num_cols = sqlite3_column_count(stmt);
+    for (i = 0; i < num_cols; i++) {
+        const char* name = sqlite3_column_name(stmt, i);
+        if (i != 0)
+            k_WriteBytes(out, ",", 1);
+        k_WriteCSVField(out, name, strlen(name));
+    }
+    k_WriteBytes(out, "\n", 1);
+}
+
+/* Callback function for CSV output (RFC 4180), NULL as an empty field */
+int k_QueryCallbackCSV(k_Writer* out, sqlite3_stmt* stmt)
+{
+    int i, num_cols = sqlite3_column_count(stmt);
+    for (i = 0; i < num_cols; i++) {
+        sqlite3_value* value = sqlite3_column_value(stmt, i);
+        if (i != 0)
+            k_WriteBytes(out, ",", 1);
+
+        switch (sqlite3_value_type(value)) {
+        case SQLITE_INTEGER:
+            k_WriteInt(out, sqlite3_value_int64(value));
+            break;
+        case SQLITE_NULL:
+            break;
+        default:
+            k_WriteCSVField(out, (const char*) sqlite3_value_text(value),
+                            sqlite3_value_bytes(value));
+            break;
+        }
+    }
+    k_WriteBytes(out, "\n", 1);
+
+    return out->error;
+}
+
+/* Write s as a TSV field, escaping tabs, line breaks and backslashes */
+void k_WriteTSVField(k_Writer* out, const char* s, size_t n)
+{
+    size_t i, start = 0;
+
+    for (i = 0; i < n; i++) {
+        const char* escape;
+        switch (s[i]) {
+        case '\t': escape = "\\t";  break;
+        case '\n': escape = "\\n";  break;
+        case '\r': escape = "\\r";  break;
+        case '\\': escape = "\\\\"; break;
+        default:   continue;
+        }
+        k_WriteBytes(out, s + start, i - start);
+        k_WriteBytes(out, escape, 2);
+        start = i + 1;
+    }
+    k_WriteBytes(out, s + start, n - start);
+}
+
+/* TSV header, with column names */
+void k_TSVHeader(k_Writer* out, sqlite3_stmt* stmt)
+{
+    int i, num_cols = sqlite3_column_count(stmt);
+    for (i = 0; i < num_cols; i++) {
+        const char* name = sqlite3_column_name(stmt, i);
+        if (i != 0)
+            k_WriteBytes(out, "\t", 1);
+        k_WriteTSVField(out, name, strlen(name));
+    }
+    k_WriteBytes(out, "\n", 1);
+}
+
+/* Callback function for TSV output, NULL as \N */
+int k_QueryCallbackTSV(k_Writer* out, sqlite3_stmt* stmt)
+{
+    int i, num_cols = sqlite3_column_count(stmt);
+    for (i = 0; i < num_cols; i++) {
+        sqlite3_value* value = sqlite3_column_value(stmt, i);
+        if (i != 0)
+            k_WriteBytes(out, "\t", 1);
+
+        switch (sqlite3_value_type(value)) {
+        case SQLITE_INTEGER:
+            k_WriteInt(out, sqlite3_value_int64(value));
+            break;
+        case SQLITE_NULL:
+            k_WriteBytes(out, "\\N", 2);
+            break;
+        default:
+            k_WriteTSVField(out, (const char*) sqlite3_value_text(value),
+                            sqlite3_value_bytes(value));
+            break;
+        }
+    }
+    k_WriteBytes(out, "\n", 1);
+
+    return out->error;
+}
+
+/* Write s as a JSON string */
+void k_WriteJSONString(k_Writer* out, const char* s, size_t n)
+{
+    size_t i, start = 0;
+
+    k_WriteBytes(out, "\"", 1);
+    for (i = 0; i < n; i++) {
+        unsigned char c = s[i];
+        char escape[8];
+
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+
+        switch (c) {
+        case '"':  strcpy(escape, "\\\""); break;
+        case '\\': strcpy(escape, "\\\\"); break;
+        case '\n': strcpy(escape, "\\n");  break;
+        case '\r': strcpy(escape, "\\r");  break;
+        case '\t': strcpy(escape, "\\t");  break;
+        default:
+            escape[0] = '\\';
+            escape[1] = 'u';
+            escape[2] = '0';
+            escape[3] = '0';
+            escape[4] = "0123456789abcdef"[c >> 4];
+            escape[5] = "0123456789abcdef"[c & 15];
+            escape[6] = '\0';
+            break;
+        }
+        k_WriteBytes(out, s + start, i - start);
+        k_WriteStr(out, escape);
+        start = i + 1;
+    }
+    k_WriteBytes(out, s + start, n - start);
+    k_WriteBytes(out, "\"", 1);
+}
+
+/* Write the n bytes of blob as a JSON string of hex digits */
+void k_WriteJSONHex(k_Writer* out, const unsigned char* blob, size_t n)
+{
+    size_t i;
+
+    k_WriteBytes(out, "\"", 1);
+    if (k_WriterReserve(out, 2 * n) == 0) {
+        for (i = 0; i < n; i++) {
+            out->buf[out->len++] = "0123456789abcdef"[blob[i] >> 4];
+            out->buf[out->len++] = "0123456789abcdef"[blob[i] & 15];
+        }
+    }
+    k_WriteBytes(out, "\"", 1);
+}
+
+/* Callback function for JSON lines output, one object per row keyed by
+ * column name. Non-finite reals are written as null, and BLOBs, which needn't
+ * be valid UTF-8, as strings of hex digits. */
+int k_QueryCallbackJSONL(k_Writer* out, sqlite3_stmt* stmt)
+{
+    int i, num_cols = sqlite3_column_count(stmt);
+
+    k_WriteBytes(out, "{", 1);
+    for (i = 0; i < num_cols; i++) {
+        sqlite3_value* value = sqlite3_column_value(stmt, i);
+        const char* name = sqlite3_column_name(stmt, i);
+
+        if (i != 0)
+            k_WriteBytes(out, ",", 1);
+        k_WriteJSONString(out, name, strlen(name));
+        k_WriteBytes(out, ":", 1);
+
+        switch (sqlite3_value_type(value)) {
+        case SQLITE_INTEGER:
+            k_WriteInt(out, sqlite3_value_int64(value));
+            break;
+        case SQLITE_FLOAT:
+            if (isfinite(sqlite3_value_double(value)))
+                k_WriteBytes(out, (const char*) sqlite3_value_text(value),
+                             sqlite3_value_bytes(value));
+            else
+                k_WriteBytes(out, "null", 4);
+            break;
+        case SQLITE_NULL:
+            k_WriteBytes(out, "null", 4);
+            break;
+        case SQLITE_BLOB:
+            k_WriteJSONHex(out, sqlite3_value_blob(value), sqlite3_value_bytes(value));
+            break;
+        default:
+            k_WriteJSONString(out, (const char*) sqlite3_value_text(value),
+                              sqlite3_value_bytes(value));
+            break;
+        }
+    }
+    k_WriteBytes(out, "}\n", 2);
+
+    return out->error;
+}
+
+k_Format k_Formats[] = {
+    {"list",     NULL,         k_QueryCallbackREPL},
+    {"pipeline", NULL,         k_QueryCallbackPipeline},
+    {"csv",      k_CSVHeader,  k_QueryCallbackCSV},
+    {"tsv",      k_TSVHeader,  k_QueryCallbackTSV},
+    {"jsonl",    NULL,         k_QueryCallbackJSONL},
+    {"arrow",    NULL,         k_QueryCallbackArrow, k_ArrowFooter},
+};
+
+#define NUM_FORMATS (sizeof(k_Formats) / sizeof(k_Formats[0]))
+
+/* Format named name, NULL if there is none */
+k_Format* k_FindFormat(const char* name)
+{
+    int i;
+    for (i = 0; i < NUM_FORMATS; i++)
+        if (strcmp(k_Formats[i].name, name) == 0)
+            return &k_Formats[i];
+    return NULL;
+}
+
+/* Format query results are written in. Defaults to list in the REPL and
+ * pipeline for queries given on the command line. */
+k_Format* output_format = NULL;
+//
+//--------------------------------------------------------------------------//
+
+//-------------------------- PROCESS VIRTUAL TABLE -------------------------//
+//
+/* Virtual table streaming the Process table from the module, so queries only
+ * pay for the rows they consume. Each cursor has its own module connection,
+ * which lets self-joins scan the table independently. */
+typedef struct {
+    sqlite3_vtab base;
+} k_ProcessVTab;
+
+typedef struct {
+    sqlite3_vtab_cursor base;
+    int fd;
+    struct process_batch* batch;
+    struct process_row* rows;
+    int row;
+    int fetch_rows;  // Size of the next batch
+} k_ProcessCursor;
+
+/* Rows in the first batch of a scan. Batches double from there, so a scan cut
+ * short by LIMIT or an aborted query only has the module fill a few rows more
+ * than it consumed, while full scans still reach full batches quickly. */
+#define FIRST_FETCH_ROWS 16
+
+/* Bits of idxNum describing which pid bounds xFilter receives */
+#define PID_MIN 1
+#define PID_MAX 2
+
+/* Columns of the Process table, in order */
+enum {
+    PROCESS_COLUMN_PID, PROCESS_COLUMN_NAME, PROCESS_COLUMN_PARENT_PID,
+    PROCESS_COLUMN_STATE, PROCESS_COLUMN_FLAGS, PROCESS_COLUMN_PRIORITY,
+    PROCESS_COLUMN_NUM_VMAS, PROCESS_COLUMN_TOTAL_VM, NUM_PROCESS_COLUMNS
+};
+
+char* k_ProcessColumnNames[] = {
+    "pid", "name", "parent_pid", "state", "flags", "priority", "num_vmas", "total_vm",
+};
+
+int k_ProcessConnect(sqlite3* db, void* aux, int argc, const char* const* argv,
+                     sqlite3_vtab** vtab, char** error_msg)
+{
+    int rc = sqlite3_declare_vtab(db, "CREATE TABLE x ("
+                                      "  pid        INT,"
+                                      "  name       TEXT,"
+                                      "  parent_pid INT,"
+                                      "  state      BIGINT,"
+                                      "  flags      BIGINT,"
+                                      "  priority   INT,"
+                                      "  num_vmas   INT,"
+                                      "  total_vm   BIGINT"
+                                      ")");
+    if (rc != SQLITE_OK)
+        return rc;
+
+    *vtab = sqlite3_malloc(sizeof(k_ProcessVTab));
+    if (*vtab == NULL)
+        return SQLITE_NOMEM;
+    memset(*vtab, 0, sizeof(k_ProcessVTab));
+
+    return SQLITE_OK;
+}
+
+int k_ProcessDisconnect(sqlite3_vtab* vtab)
+{
+    sqlite3_free(vtab);
+    return SQLITE_OK;
+}
+
+/* Turn pid constraints into bounds for the module, which returns rows sorted
+ * by pid. SQLite still checks every constraint, so bounds may be loose. */
+int k_ProcessBestIndex(sqlite3_vtab* vtab, sqlite3_index_info* info)
+{
+    int i, min = -1, max = -1, argc = 0;
+    double cost = 1000000.0;
+
+    for (i = 0; i < info->nConstraint; i++) {
+        const struct sqlite3_index_constraint* c = &info->aConstraint[i];
+        if (!c->usable || c->iColumn != PROCESS_COLUMN_PID)
+            continue;
+
+        switch (c->op) {
+        case SQLITE_INDEX_CONSTRAINT_EQ:
+            if (min == -1) min = i;
+            if (max == -1) max = i;
+            break;
+        case SQLITE_INDEX_CONSTRAINT_GT:
+        case SQLITE_INDEX_CONSTRAINT_GE:
+            if (min == -1) min = i;
+            break;
+        case SQLITE_INDEX_CONSTRAINT_LT:
+        case SQLITE_INDEX_CONSTRAINT_LE:
+            if (max == -1) max = i;
+            break;
+        }
+    }
+
+    info->idxNum = 0;
+    if (min != -1) {
+        info->idxNum |= PID_MIN;
+        info->aConstraintUsage[min].argvIndex = ++argc;
+        cost /= 100;
+    }
+    if (max != -1) {
+        info->idxNum |= PID_MAX;
+        if (max != min)
+            info->aConstraintUsage[max].argvIndex = ++argc;
+        cost /= 100;
+    }
+    if (min != -1 && min == max)
+        cost = 1.0;  // Module looks up a single pid directly
+
+    if (info->nOrderBy == 1 &&
+        info->aOrderBy[0].iColumn == PROCESS_COLUMN_PID &&
+        !info->aOrderBy[0].desc)
+        info->orderByConsumed = 1;
+
+    info->estimatedCost = cost;
+
+    return SQLITE_OK;
+}
+
+int k_ProcessOpen(sqlite3_vtab* vtab, sqlite3_vtab_cursor** cursor)
+{
+    k_ProcessCursor* cur = sqlite3_malloc(sizeof(k_ProcessCursor));
+    if (cur == NULL)
+        return SQLITE_NOMEM;
+    memset(cur, 0, sizeof(k_ProcessCursor));
+
+    cur->batch = k_ArenaAlloc(&query_arena, MAX_RESP);
+    if (cur->batch == NULL) {
+        sqlite3_free(cur);
+        return SQLITE_NOMEM;
+    }
+    cur->batch->num_rows = 0;
+    cur->batch->done = 1;
+    cur->rows = (struct process_row*) (cur->batch + 1);
+
+    cur->fd = k_OpenModule();
+    if (cur->fd == -1) {
+        sqlite3_free(cur);
+        return SQLITE_CANTOPEN;
+    }
+
+    *cursor = &cur->base;
+    return SQLITE_OK;
+}
+
+int k_ProcessClose(sqlite3_vtab_cursor* cursor)
+{
+    k_ProcessCursor* cur = (k_ProcessCursor*) cursor;
+    close(cur->fd);
+    sqlite3_free(cur);
+    return SQLITE_OK;
+}
+
+/* Pull the next batch of rows from the module */
+int k_ProcessFetch(k_ProcessCursor* cur)
+{
+    cur->row = 0;
+    if (k_FetchProcessBatch(cur->fd, cur->batch, cur->fetch_rows) == -1)
+        return SQLITE_IOERR;
+    if (cur->fetch_rows < MAX_RESP / sizeof(struct process_row))
+        cur->fetch_rows *= 2;
+    return SQLITE_OK;
+}
+
+/* Clamp a pid bound to the range of pid_t, rounding outwards */
+int k_PidBound(sqlite3_value* value, int is_min)
+{
+    sqlite3_int64 bound;
+    double d;
+
+    switch (sqlite3_value_numeric_type(value)) {
+    case SQLITE_INTEGER:
+        bound = sqlite3_value_int64(value);
+        break;
+    case SQLITE_FLOAT:
+        d = sqlite3_value_double(value);
+        if (d < 0)       return 0;
+        if (d > INT_MAX) return INT_MAX;
+        bound = (sqlite3_int64) d;
+        if (!is_min && bound < d)
+            bound++;
+        break;
+    default:
+        return is_min ? 0 : INT_MAX;
+    }
+
+    if (bound < 0)       return 0;
+    if (bound > INT_MAX) return INT_MAX;
+    return (int) bound;
+}
+
+int k_ProcessFilter(sqlite3_vtab_cursor* cursor, int idxNum, const char* idxStr,
+                    int argc, sqlite3_value** argv)
+{
+    k_ProcessCursor* cur = (k_ProcessCursor*) cursor;
+    int min_pid = 0, max_pid = INT_MAX, i = 0;
+
+    if (idxNum & PID_MIN)
+        min_pid = k_PidBound(argv[i++], 1);
+    if (idxNum & PID_MAX)
+        max_pid = k_PidBound(argv[i < argc ? i : 0], 0);
+
+    if (k_OpenProcessScan(cur->fd, min_pid, max_pid) == -1)
+        return SQLITE_IOERR;
+
+    cur->fetch_rows = FIRST_FETCH_ROWS;
+    return k_ProcessFetch(cur);
+}
+
+int k_ProcessEof(sqlite3_vtab_cursor* cursor)
+{
+    k_ProcessCursor* cur = (k_ProcessCursor*) cursor;
+    return cur->row >= cur->batch->num_rows && cur->batch->done;
+}
+
+int k_ProcessNext(sqlite3_vtab_cursor* cursor)
+{
+    k_ProcessCursor* cur = (k_ProcessCursor*) cursor;
+
+    cur->row++;
+    while (cur->row >= cur->batch->num_rows && !cur->batch->done)
+        if (k_ProcessFetch(cur) != SQLITE_OK)
+            return SQLITE_IOERR;
+
+    return SQLITE_OK;
+}
+
+int k_ProcessColumn(sqlite3_vtab_cursor* cursor, sqlite3_context* ctx, int col)
+{
+    k_ProcessCursor* cur = (k_ProcessCursor*) cursor;
+    struct process_row* row = &cur->rows[cur->row];
+
+    switch (col) {
+    case 0: sqlite3_result_int(ctx, row->pid);                          break;
+    case 1: sqlite3_result_text(ctx, row->name, -1, SQLITE_TRANSIENT);  break;
+    case 2: sqlite3_result_int(ctx, row->parent_pid);                   break;
+    case 3: sqlite3_result_int64(ctx, row->state);                      break;
+    case 4: sqlite3_result_int64(ctx, row->flags);                      break;
+    case 5: sqlite3_result_int(ctx, row->priority);                     break;
+    case 6: sqlite3_result_int(ctx, row->num_vmas);                     break;
+    case 7: sqlite3_result_int64(ctx, row->total_vm);                   break;
+    }
+    return SQLITE_OK;
+}
+
+int k_ProcessRowid(sqlite3_vtab_cursor* cursor, sqlite3_int64* rowid)
+{
+    k_ProcessCursor* cur = (k_ProcessCursor*) cursor;
+    *rowid = cur->rows[cur->row].pid;
+    return SQLITE_OK;
+}
+
+sqlite3_module k_ProcessModule = {
+    0,                      // iVersion
+    k_ProcessConnect,       // xCreate
+    k_ProcessConnect,       // xConnect
+    k_ProcessBestIndex,     // xBestIndex
+    k_ProcessDisconnect,    // xDisconnect
+    k_ProcessDisconnect,    // xDestroy
+    k_ProcessOpen,          // xOpen
+    k_ProcessClose,         // xClose
+    k_ProcessFilter,        // xFilter
+    k_ProcessNext,          // xNext
+    k_ProcessEof,           // xEof
+    k_ProcessColumn,        // xColumn
+    k_ProcessRowid,         // xRowid
+};
+//
+//--------------------------------------------------------------------------//
+
+//------------------------------ SQL FUNCTIONS -----------------------------//
+//
+/* sample_rate(): fraction of the processes the last scan kept, so
+ * count(*) / sample_rate() estimates the full count */
+void k_SampleRateFunc(sqlite3_context* ctx, int argc, sqlite3_value** argv)
+{
+    double rate;
+
+    pthread_mutex_lock(&sample_mutex);
+    rate = scan_sample_rate;
+    pthread_mutex_unlock(&sample_mutex);
+
+    sqlite3_result_double(ctx, rate);
+}
+
+/* approx_count_distinct(x [, p]) estimates the number of distinct non-NULL
+ * values of x with a HyperLogLog sketch of 2^p one-byte registers (p from 4
+ * to 16, 12 by default for a standard error of about 1.6%), so memory per
+ * group is fixed whatever the input. hll_sketch(x [, p]) returns the sketch
+ * itself as a BLOB (the precision byte, then the registers), hll_merge(s)
+ * combines sketches as an aggregate and hll_count(s) estimates from one, so
+ * sketches stored per time bucket can be merged over any window. */
+#define HLL_MIN_PRECISION     4
+#define HLL_MAX_PRECISION     16
+#define HLL_DEFAULT_PRECISION 12
+
+typedef struct {
+    uint8_t precision;  // 0 before the first row
+    uint8_t registers[];
+} k_Hll;
+
+/* Finalizer of MurmurHash3 */
+uint64_t k_Mix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* Hash of value, equal for values SQL considers equal (like 1 and 1.0) */
+uint64_t k_HashValue(sqlite3_value* value)
+{
+    const unsigned char* p;
+    uint64_t h = 0xcbf29ce484222325ULL;  // FNV-1a
+    double d;
+    int i, n, type = sqlite3_value_type(value);
+
+    switch (type) {
+    case SQLITE_INTEGER:
+        return k_Mix64(sqlite3_value_int64(value));
+    case SQLITE_FLOAT:
+        d = sqlite3_value_double(value);
+        if (d >= -9.2e18 && d <= 9.2e18 && d == (double) (sqlite3_int64) d)
+            return k_Mix64((sqlite3_int64) d);
+        memcpy(&h, &d, sizeof(h));
+        return k_Mix64(h ^ SQLITE_FLOAT);
+    default:
+        p = type == SQLITE_BLOB ? sqlite3_value_blob(value) : sqlite3_value_text(value);
+        n = sqlite3_value_bytes(value);
+        for (i = 0; i < n; i++)
+            h = (h ^ p[i]) * 0x100000001b3ULL;
+        return k_Mix64(h ^ type);
+    }
+}
+
+/* Fold registers src of precision from into dst of precision to <= from,
+ * keeping the larger of each register if dst holds a sketch (and isn't src).
+ * The index bits dropped become the leading bits of the rest of the hash. */
+void k_HllFold(uint8_t* dst, int to, const uint8_t* src, int from)
+{
+    int d = from - to, j, low;
+
+    for (j = 0; j < 1 << to; j++) {
+        uint8_t max = dst != src ? dst[j] : 0;
+        for (low = 0; low < 1 << d; low++) {
+            int rank = src[(j << d) | low];
+            if (rank == 0)
+                continue;
+            rank = low ? d - (32 - __builtin_clz(low)) + 1 : d + rank;
+            if (rank > max)
+                max = rank;
+        }
+        dst[j] = max;
+    }
+}
+
+/* Cardinality estimate of a sketch, with linear counting for small ones */
+double k_HllEstimate(const uint8_t* registers, int precision)
+{
+    int j, m = 1 << precision, zeros = 0;
+    double sum = 0, alpha, estimate;
+
+    for (j = 0; j < m; j++) {
+        sum += 1.0 / (double) (1ULL << registers[j]);
+        zeros += registers[j] == 0;
+    }
+
+    alpha = m == 16 ? 0.673 : m == 32 ? 0.697 : m == 64 ? 0.709 : 0.7213 / (1 + 1.079 / m);
+    estimate = alpha * m * m / sum;
+    if (estimate <= 2.5 * m && zeros > 0)
+        estimate = m * log((double) m / zeros);
+    return estimate;
+}
+
+/* Precision of the sketch in value, or 0 if it isn't one */
+int k_HllPrecision(sqlite3_value* value)
+{
+    const uint8_t* blob = sqlite3_value_blob(value);
+    int n = sqlite3_value_bytes(value);
+
+    if (sqlite3_value_type(value) != SQLITE_BLOB || n < 1 ||
+        blob[0] < HLL_MIN_PRECISION || blob[0] > HLL_MAX_PRECISION ||
+        n != 1 + (1 << blob[0]))
+        return 0;
+    return blob[0];
+}
+
+void k_HllStep(sqlite3_context* ctx, int argc, sqlite3_value** argv)
+{
+    int rank, precision = argc > 1 ? sqlite3_value_int(argv[1]) : HLL_DEFAULT_PRECISION;
+    uint64_t hash, rest;
+    k_Hll* hll;
+
+    if (precision < HLL_MIN_PRECISION || precision > HLL_MAX_PRECISION) {
+        sqlite3_result_error(ctx, "HyperLogLog precision must be between 4 and 16", -1);
+        return;
+    }
+
+    hll = sqlite3_aggregate_context(ctx, sizeof(k_Hll) + (1 << precision));
+    if (hll == NULL) {
+        sqlite3_result_error_nomem(ctx);
+        return;
+    }
+    if (hll->precision == 0)
+        hll->precision = precision;  // Later rows can't resize the sketch
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL)
+        return;
+
+    /* The leading bits pick a register, which keeps the longest run of
+     * zeros (plus one) seen at the start of the rest */
+    hash = k_HashValue(argv[0]);
+    precision = hll->precision;
+    rest = hash << precision;
+    rank = rest ? __builtin_clzll(rest) + 1 : 64 - precision + 1;
+    if (rank > hll->registers[hash >> (64 - precision)])
+        hll->registers[hash >> (64 - precision)] = rank;
+}
+
+void k_HllMergeStep(sqlite3_context* ctx, int argc, sqlite3_value** argv)
+{
+    int precision = k_HllPrecision(argv[0]);
+    const uint8_t* sketch;
+    k_Hll* hll;
+
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL)
+        return;
+    if (precision == 0) {
+        sqlite3_result_error(ctx, "Invalid HyperLogLog sketch", -1);
+        return;
+    }
+    sketch = (const uint8_t*) sqlite3_value_blob(argv[0]) + 1;
+
+    hll = sqlite3_aggregate_context(ctx, sizeof(k_Hll) + (1 << precision));
+    if (hll == NULL) {
+        sqlite3_result_error_nomem(ctx);
+        return;
+    }
+
+    /* Sketches of different precisions merge at the lowest one */
+    if (hll->precision == 0) {
+        hll->precision = precision;
+    } else if (precision < hll->precision) {
+        k_HllFold(hll->registers, precision, hll->registers, hll->precision);
+        hll->precision = precision;
+    }
+    k_HllFold(hll->registers, hll->precision, sketch, precision);
+}
+
+void k_HllCountFinal(sqlite3_context* ctx)
+{
+    k_Hll* hll = sqlite3_aggregate_context(ctx, 0);
+    double estimate = hll && hll->precision ? k_HllEstimate(hll->registers, hll->precision) : 0;
+    sqlite3_result_int64(ctx, (sqlite3_int64) (estimate + 0.5));
+}
+
+void k_HllSketchFinal(sqlite3_context* ctx)
+{
+    k_Hll* hll = sqlite3_aggregate_context(ctx, 0);
+    if (hll == NULL || hll->precision == 0)
+        sqlite3_result_null(ctx);
+    else
+        sqlite3_result_blob(ctx, hll, sizeof(k_Hll) + (1 << hll->precision),
+                            SQLITE_TRANSIENT);
+}
+
+void k_HllCountFunc(sqlite3_context* ctx, int argc, sqlite3_value** argv)
+{
+    int precision = k_HllPrecision(argv[0]);
+
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL)
+        sqlite3_result_null(ctx);
+    else if (precision == 0)
+        sqlite3_result_error(ctx, "Invalid HyperLogLog sketch", -1);
+    else
+        sqlite3_result_int64(ctx, (sqlite3_int64) (k_HllEstimate(
+            (const uint8_t*) sqlite3_value_blob(argv[0]) + 1, precision) + 0.5));
+}
+
+/* approx_quantile(x, q) estimates the q-quantile (0 <= q <= 1) of the
+ * non-NULL numbers x, and quantiles(x) its p50, p90, p95 and p99 as a JSON
+ * object, without sorting the column. Both keep a merging t-digest: values
+ * are buffered, then sorted and merged into centroids that stay small near
+ * the tails, so memory per group is fixed and extreme quantiles stay
+ * accurate. tdigest_sketch(x), tdigest_merge(s) and tdigest_quantile(s, q)
+ * expose the digest as a BLOB (min and max, then the mean and weight of
+ * each centroid), like the HyperLogLog sketches above. */
+#define TDIGEST_COMPRESSION 100
+
+/* Room for the at most TDIGEST_COMPRESSION + 1 centroids left by merging,
+ * with the rest buffering new values */
+#define TDIGEST_CAPACITY (5 * TDIGEST_COMPRESSION)
+
+typedef struct {
+    double mean;
+    double weight;
+} k_Centroid;
+
+typedef struct {
+    double q;  // Of approx_quantile, from the first row
+    double min;
+    double max;
+    double total;          // Weight of every centroid
+    int num_centroids;     // Merged centroids, followed by buffered ones
+    int num_buffered;
+    k_Centroid centroids[TDIGEST_CAPACITY];
+} k_TDigest;
+
+int k_CompareCentroids(const void* a, const void* b)
+{
+    double x = ((const k_Centroid*) a)->mean, y = ((const k_Centroid*) b)->mean;
+    return x < y ? -1 : x > y;
+}
+
+/* Position of quantile q on the k1 scale, on which each centroid spans at
+ * most 1 */
+double k_TDigestScale(double q)
+{
+    return TDIGEST_COMPRESSION / (2 * M_PI) * asin(2 * q - 1);
+}
+
+/* Merge buffered centroids into the others, in place */
+void k_TDigestCompress(k_TDigest* td)
+{
+    k_Centroid* c = td->centroids;
+    int i, n = td->num_centroids + td->num_buffered, out = 0;
+    double merged = 0;  // Weight of the centroids before c[out]
+
+    if (td->num_buffered == 0)
+        return;
+
+    qsort(c, n, sizeof(k_Centroid), k_CompareCentroids);
+    for (i = 1; i < n; i++) {
+        double right = (merged + c[out].weight + c[i].weight) / td->total;
+        if (k_TDigestScale(right > 1 ? 1 : right) -
+            k_TDigestScale(merged / td->total) <= 1) {
+            c[out].mean += (c[i].mean - c[out].mean) * c[i].weight /
+                           (c[out].weight + c[i].weight);
+            c[out].weight += c[i].weight;
+        } else {
+            merged += c[out].weight;
+            c[++out] = c[i];
+        }
+    }
+
+    td->num_centroids = out + 1;
+    td->num_buffered = 0;
+}
+
+void k_TDigestAdd(k_TDigest* td, double mean, double weight)
+{
+    k_Centroid* c;
+
+    if (td->num_centroids + td->num_buffered == TDIGEST_CAPACITY)
+        k_TDigestCompress(td);
+
+    if (td->total == 0 || mean < td->min)
+        td->min = mean;
+    if (td->total == 0 || mean > td->max)
+        td->max = mean;
+    td->total += weight;
+
+    c = &td->centroids[td->num_centroids + td->num_buffered++];
+    c->mean = mean;
+    c->weight = weight;
+}
+
+/* Estimate quantile q of a compressed digest, interpolating between the
+ * centres of neighbouring centroids, and towards min and max at the ends */
+double k_TDigestQuantile(k_TDigest* td, double q)
+{
+    k_Centroid* c = td->centroids;
+    double index = q * td->total, before = c[0].weight / 2;
+    int i, n = td->num_centroids;
+
+    if (index < before)
+        return td->min + (c[0].mean - td->min) * index / before;
+
+    for (i = 0; i + 1 < n; i++) {
+        double between = (c[i].weight + c[i + 1].weight) / 2;
+        if (index < before + between)
+            return c[i].mean + (c[i + 1].mean - c[i].mean) * (index - before) / between;
+        before += between;
+    }
+
+    if (c[n - 1].weight / 2 == 0)
+        return td->max;
+    return c[n - 1].mean + (td->max - c[n - 1].mean) *
+           (index - before) / (c[n - 1].weight / 2);
+}
+
+/* Digest of an aggregate, NULL if it has no rows yet and allocate is 0 */
+k_TDigest* k_TDigestContext(sqlite3_context* ctx, int allocate)
+{
+    k_TDigest* td = sqlite3_aggregate_context(ctx, allocate ? sizeof(k_TDigest) : 0);
+    if (td == NULL && allocate)
+        sqlite3_result_error_nomem(ctx);
+    return td;
+}
+
+/* Quantile argument, or -1 (reporting an error) if out of range */
+double k_QuantileArg(sqlite3_context* ctx, sqlite3_value* value)
+{
+    double q = sqlite3_value_double(value);
+    if (sqlite3_value_numeric_type(value) == SQLITE_NULL || !(q >= 0 && q <= 1)) {
+        sqlite3_result_error(ctx, "Quantile must be between 0 and 1", -1);
+        return -1;
+    }
+    return q;
+}
+
+void k_TDigestStep(sqlite3_context* ctx, int argc, sqlite3_value** argv)
+{
+    double q = argc > 1 ? k_QuantileArg(ctx, argv[1]) : 0;
+    int type = sqlite3_value_numeric_type(argv[0]);
+    k_TDigest* td;
+
+    if (q < 0 || (td = k_TDigestContext(ctx, 1)) == NULL)
+        return;
+    if (td->total == 0)
+        td->q = q;
+
+    if ((type == SQLITE_INTEGER || type == SQLITE_FLOAT) &&
+        !isnan(sqlite3_value_double(argv[0])))
+        k_TDigestAdd(td, sqlite3_value_double(argv[0]), 1);
+}
+
+/* Digest in value, as min and max in the mean and weight of its first
+ * element followed by n centroids, NULL (reporting an error) if it isn't one */
+const k_Centroid* k_TDigestBlob(sqlite3_context* ctx, sqlite3_value* value, int* n)
+{
+    int bytes = sqlite3_value_bytes(value);
+    const k_Centroid* blob = sqlite3_value_blob(value);
+
+    *n = bytes / (int) sizeof(k_Centroid) - 1;
+    if (sqlite3_value_type(value) != SQLITE_BLOB || bytes % sizeof(k_Centroid) != 0 ||
+        *n < 1 || *n > TDIGEST_CAPACITY) {
+        sqlite3_result_error(ctx, "Invalid t-digest", -1);
+        return NULL;
+    }
+    return blob;
+}
+
+void k_TDigestMergeStep(sqlite3_context* ctx, int argc, sqlite3_value** argv)
+{
+    const k_Centroid* blob;
+    k_TDigest* td;
+    int i, n;
+
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL)
+        return;
+    if ((blob = k_TDigestBlob(ctx, argv[0], &n)) == NULL ||
+        (td = k_TDigestContext(ctx, 1)) == NULL)
+        return;
+
+    for (i = 1; i <= n; i++)
+        k_TDigestAdd(td, blob[i].mean, blob[i].weight);
+    if (blob[0].mean < td->min)
+        td->min = blob[0].mean;
+    if (blob[0].weight > td->max)
+        td->max = blob[0].weight;
+}
+
+void k_TDigestQuantileFinal(sqlite3_context* ctx)
+{
+    k_TDigest* td = k_TDigestContext(ctx, 0);
+
+    if (td == NULL || td->total == 0) {
+        sqlite3_result_null(ctx);
+        return;
+    }
+    k_TDigestCompress(td);
+    sqlite3_result_double(ctx, k_TDigestQuantile(td, td->q));
+}
+
+void k_TDigestQuantilesFinal(sqlite3_context* ctx)
+{
+    k_TDigest* td = k_TDigestContext(ctx, 0);
+    char* json;
+
+    if (td == NULL || td->total == 0) {
+        sqlite3_result_null(ctx);
+        return;
+    }
+    k_TDigestCompress(td);
+
+    json = sqlite3_mprintf("{\"p50\":%!.15g,\"p90\":%!.15g,\"p95\":%!.15g,\"p99\":%!.15g}",
+                           k_TDigestQuantile(td, 0.50), k_TDigestQuantile(td, 0.90),
+                           k_TDigestQuantile(td, 0.95), k_TDigestQuantile(td, 0.99));
+    if (json == NULL)
+        sqlite3_result_error_nomem(ctx);
+    else
+        sqlite3_result_text(ctx, json, -1, sqlite3_free);
+}
+
+void k_TDigestSketchFinal(sqlite3_context* ctx)
+{
+    k_TDigest* td = k_TDigestContext(ctx, 0);
+    k_Centroid* blob;
+    int n;
+
+    if (td == NULL || td->total == 0) {
+        sqlite3_result_null(ctx);
+        return;
+    }
+    k_TDigestCompress(td);
+
+    n = td->num_centroids;
+    blob = sqlite3_malloc((n + 1) * sizeof(k_Centroid));
+    if (blob == NULL) {
+        sqlite3_result_error_nomem(ctx);
+        return;
+    }
+    blob[0].mean = td->min;
+    blob[0].weight = td->max;
+    memcpy(blob + 1, td->centroids, n * sizeof(k_Centroid));
+    sqlite3_result_blob(ctx, blob, (n + 1) * sizeof(k_Centroid), sqlite3_free);
+}
+
+void k_TDigestQuantileFunc(sqlite3_context* ctx, int argc, sqlite3_value** argv)
+{
+    double q = k_QuantileArg(ctx, argv[1]);
+    const k_Centroid* blob;
+    k_TDigest* td;
+    int n;
+
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        sqlite3_result_null(ctx);
+        return;
+    }
+    if (q < 0 || (blob = k_TDigestBlob(ctx, argv[0], &n)) == NULL)
+        return;
+
+    td = sqlite3_malloc(sizeof(k_TDigest));
+    if (td == NULL) {
+        sqlite3_result_error_nomem(ctx);
+        return;
+    }
+    td->min = blob[0].mean;
+    td->max = blob[0].weight;
+    td->total = 0;
+    td->num_centroids = n;
+    td->num_buffered = 0;
+    memcpy(td->centroids, blob + 1, n * sizeof(k_Centroid));
+    while (n-- > 0)
+        td->total += td->centroids[n].weight;
+
+    sqlite3_result_double(ctx, k_TDigestQuantile(td, q));
+    sqlite3_free(td);
+}
+
+/* state_name(state), has_flag(bits, name) and flag_names(bits) decode the
+ * state and flags columns with the bit names the module is built against */
+typedef struct {
+    char* name;
+    sqlite3_int64 bit;
+} k_BitName;
+
+#define BIT_NAME(name, value) {#name, value},
+
+k_BitName k_TaskStates[] = {KQUERY_TASK_STATES(BIT_NAME)};
+k_BitName k_ProcessFlags[] = {KQUERY_PROCESS_FLAGS(BIT_NAME)};
+
+#define NUM_TASK_STATES   (sizeof(k_TaskStates) / sizeof(k_TaskStates[0]))
+#define NUM_PROCESS_FLAGS (sizeof(k_ProcessFlags) / sizeof(k_ProcessFlags[0]))
+
+/* Names the kernel reports for the lowest of the first seven state bits (see
+ * fs/proc/array.c). The module includes exit_state, so zombies have
+ * EXIT_ZOMBIE set next to TASK_DEAD. */
+char* k_StateNames[] = {
+    "running", "sleeping", "disk sleep", "stopped", "tracing stop", "dead",
+    "zombie", "parked",
+};
+
+#define TASK_IDLE_STATE 0x0402  // TASK_UNINTERRUPTIBLE | TASK_NOLOAD
+
+void k_StateNameFunc(sqlite3_context* ctx, int argc, sqlite3_value** argv)
+{
+    sqlite3_int64 state = sqlite3_value_int64(argv[0]);
+    int i;
+
+    if (sqlite3_value_numeric_type(argv[0]) != SQLITE_INTEGER) {
+        sqlite3_result_null(ctx);
+        return;
+    }
+
+    if (state == TASK_IDLE_STATE) {
+        sqlite3_result_text(ctx, "idle", -1, SQLITE_STATIC);
+        return;
+    }
+    for (i = 0; i < 7 && !((state >> i) & 1); i++)
+        ;
+    if (i == 7 && (state & 0x80))
+        i = 4;  // TASK_DEAD without an exit state, as recorded by older modules
+    sqlite3_result_text(ctx, k_StateNames[(state & 0xff) ? i + 1 : 0], -1, SQLITE_STATIC);
+}
+
+/* Bit called name among the task states or process flags, 0 if unknown */
+sqlite3_int64 k_FindBit(const char* name)
+{
+    int i;
+    for (i = 0; i < NUM_TASK_STATES; i++)
+        if (strcmp(k_TaskStates[i].name, name) == 0)
+            return k_TaskStates[i].bit;
+    for (i = 0; i < NUM_PROCESS_FLAGS; i++)
+        if (strcmp(k_ProcessFlags[i].name, name) == 0)
+            return k_ProcessFlags[i].bit;
+    return 0;
+}
+
+void k_HasFlagFunc(sqlite3_context* ctx, int argc, sqlite3_value** argv)
+{
+    const char* name = (const char*) sqlite3_value_text(argv[1]);
+    sqlite3_int64* cached = sqlite3_get_auxdata(ctx, 1);
+    sqlite3_int64 bit;
+
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL || name == NULL) {
+        sqlite3_result_null(ctx);
+        return;
+    }
+
+    /* A constant name is only looked up once per statement. SQLite may free
+     * the auxdata as soon as it is set, so only the local copy is read. */
+    if (cached != NULL) {
+        bit = *cached;
+    } else {
+        bit = k_FindBit(name);
+        if (bit == 0) {
+            char* error = sqlite3_mprintf("Unknown flag: %s", name);
+            sqlite3_result_error(ctx, error, -1);
+            sqlite3_free(error);
+            return;
+        }
+        cached = sqlite3_malloc(sizeof(*cached));
+        if (cached == NULL) {
+            sqlite3_result_error_nomem(ctx);
+            return;
+        }
+        *cached = bit;
+        sqlite3_set_auxdata(ctx, 1, cached, sqlite3_free);
+    }
+
+    sqlite3_result_int(ctx, (sqlite3_value_int64(argv[0]) & bit) != 0);
+}
+
+void k_FlagNamesFunc(sqlite3_context* ctx, int argc, sqlite3_value** argv)
+{
+    sqlite3_int64 flags = sqlite3_value_int64(argv[0]);
+    char names[512];
+    size_t len = 0;
+    int i;
+
+    if (sqlite3_value_numeric_type(argv[0]) != SQLITE_INTEGER) {
+        sqlite3_result_null(ctx);
+        return;
+    }
+
+    names[0] = '\0';
+    for (i = 0; i < NUM_PROCESS_FLAGS; i++) {
+        if (!(flags & k_ProcessFlags[i].bit))
+            continue;
+        len += snprintf(names + len, sizeof(names) - len, "%s%s",
+                        len ? "|" : "", k_ProcessFlags[i].name);
+        flags &= ~k_ProcessFlags[i].bit;
+    }
+    if (flags)  // Bits without a name
+        snprintf(names + len, sizeof(names) - len, "%s0x%llx",
+                 len ? "|" : "", (unsigned long long) flags);
+
+    sqlite3_result_text(ctx, names, -1, SQLITE_TRANSIENT);
+}
+
+/* Scalar function if func is set, aggregate otherwise */
+typedef struct {
+    char* name;
+    int num_args;
+    void (*func)(sqlite3_context*, int, sqlite3_value**);
+    void (*step)(sqlite3_context*, int, sqlite3_value**);
+    void (*final)(sqlite3_context*);
+} k_Function;
+
+k_Function k_Functions[] = {
+    {"sample_rate",           0, k_SampleRateFunc,      NULL,               NULL},
+    {"approx_count_distinct", 1, NULL,                  k_HllStep,          k_HllCountFinal},
+    {"approx_count_distinct", 2, NULL,                  k_HllStep,          k_HllCountFinal},
+    {"hll_sketch",            1, NULL,                  k_HllStep,          k_HllSketchFinal},
+    {"hll_sketch",            2, NULL,                  k_HllStep,          k_HllSketchFinal},
+    {"hll_merge",             1, NULL,                  k_HllMergeStep,     k_HllSketchFinal},
+    {"hll_count",             1, k_HllCountFunc,        NULL,               NULL},
+    {"approx_quantile",       2, NULL,                  k_TDigestStep,      k_TDigestQuantileFinal},
+    {"quantiles",             1, NULL,                  k_TDigestStep,      k_TDigestQuantilesFinal},
+    {"tdigest_sketch",        1, NULL,                  k_TDigestStep,      k_TDigestSketchFinal},
+    {"tdigest_merge",         1, NULL,                  k_TDigestMergeStep, k_TDigestSketchFinal},
+    {"tdigest_quantile",      2, k_TDigestQuantileFunc, NULL,               NULL},
+    {"state_name",            1, k_StateNameFunc,       NULL,               NULL},
+    {"has_flag",              2, k_HasFlagFunc,         NULL,               NULL},
+    {"flag_names",            1, k_FlagNamesFunc,       NULL,               NULL},
+};
+
+#define NUM_FUNCTIONS (sizeof(k_Functions) / sizeof(k_Functions[0]))
+
+/* Register kquery's SQL functions on db */
+int k_RegisterFunctions(sqlite3* db)
+{
+    int i, rc = SQLITE_OK;
+    for (i = 0; i < NUM_FUNCTIONS && rc == SQLITE_OK; i++)
+        rc = sqlite3_create_function(db, k_Functions[i].name, k_Functions[i].num_args,
+                                     SQLITE_UTF8, NULL, k_Functions[i].func,
+                                     k_Functions[i].step, k_Functions[i].final);
+    return rc;
+}
+//
+//--------------------------------------------------------------------------//
+
+//------------------------------ SQLITE WRAPPERS ---------------------------//
+//
+/* Open database. The connection is only used by one thread at a time, so it
+ * skips the per-call mutex SQLite takes on every step and column access. */
+sqlite3* k_SQLiteOpen()
+{
+    sqlite3* db = NULL;
+    int rc = sqlite3_open_v2(NULL, &db,  // NULL filepath for in-memory database
+                             SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE |
+                             SQLITE_OPEN_NOMUTEX, NULL);
+    if (rc == SQLITE_OK)
+        rc = k_RegisterFunctions(db);
+    if (rc) {
+        fprintf(stderr, MAKE_RED "Can't open kquery database: %s\n" RESET_COLOR, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        close(fp);
+        exit(-1);
+    }
+    return db;
+}
+
+/* Create Process virtual table */
+int k_CreateProcessVTab(sqlite3* db)
+{
+    char* error_msg = NULL;
+    int rc = sqlite3_create_module(db, "kquery_process", &k_ProcessModule, NULL);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_exec(db, "CREATE VIRTUAL TABLE IF NOT EXISTS process "
+                              "USING kquery_process", NULL, 0, &error_msg);
+    if (rc != SQLITE_OK) {
+        fprintf(stdout, MAKE_RED "SQL error: %s\n" RESET_COLOR,
+                error_msg ? error_msg : sqlite3_errmsg(db));
+        sqlite3_free(error_msg);
+    }
+    return rc;
+}
+
+/* Create Process table */
+int k_CreateProcessTable(sqlite3* db)
+{
+    char* error_msg = NULL;
+    char* create_stmt  = "CREATE TABLE IF NOT EXISTS process ("
+                         "  pid        INT PRIMARY KEY,"
+                         "  name       TEXT,"
+                         "  parent_pid INT,"
+                         "  state      BIGINT,"
+                         "  flags      BIGINT,"
+                         "  priority   INT,"
+                         "  num_vmas   INT,"
+                         "  total_vm   BIGINT"
+                         ")";
+    int rc = sqlite3_exec(db, create_stmt, NULL, 0, &error_msg);
+    if (rc != SQLITE_OK) {
+        fprintf(stdout, MAKE_RED "SQL error: %s\n" RESET_COLOR, error_msg);
+        sqlite3_free(error_msg);
+    }
+    return rc;
+}
+
+/* Secondary index on a snapshot table */
+typedef struct {
+    char* name;
+    char* table;
+    char* columns;
+} k_Index;
+
+/* Indexes on the Process table. Recursive CTEs walking the process tree join
+ * on parent_pid, which is a full scan per step without an index. */
+k_Index k_ProcessIndexes[] = {
+    {"process_parent_pid", "process", "parent_pid"},
+};
+
+#define NUM_PROCESS_INDEXES (sizeof(k_ProcessIndexes) / sizeof(k_ProcessIndexes[0]))
+
+/* Database holding the snapshot tables on db: "snap" when background
+ * snapshots are attached to it, "main" otherwise */
+const char* k_SnapshotSchema(sqlite3* db)
+{
+    sqlite3_stmt* probe = NULL;
+    int rc = sqlite3_prepare_v2(db, "SELECT 1 FROM snap.sqlite_master", -1,
+                                &probe, NULL);
+    sqlite3_finalize(probe);
+    return rc == SQLITE_OK ? "snap" : "main";
+}
+
+/* Build indexes over the loaded rows if they don't exist yet. The first load
+ * builds each in one pass over the sorted rows; later loads keep them and
+ * update them per row. Dropping and rebuilding them on every load would be
+ * cheaper for very large tables, but changes the schema, which makes every
+ * prepared statement (the shell's, cached results', watches') re-prepare. At
+ * a few thousand processes both cost about the same (bench/bench_tree.c). */
+int k_BuildIndexes(sqlite3* db, k_Index* indexes, int num_indexes)
+{
+    const char* schema = k_SnapshotSchema(db);
+    char create[256];
+    int i, rc = SQLITE_OK;
+
+    for (i = 0; i < num_indexes && rc == SQLITE_OK; i++) {
+        snprintf(create, sizeof(create), "CREATE INDEX IF NOT EXISTS %s.%s ON %s(%s)",
+                 schema, indexes[i].name, indexes[i].table, indexes[i].columns);
+        rc = sqlite3_exec(db, create, NULL, 0, NULL);
+    }
+    return rc;
+}
+
+/* Insert decoded rows into the Process table through a prepared INSERT */
+int k_InsertProcessRows(sqlite3_stmt* insert, struct process_row* rows, int num_rows)
+{
+    int i, rc = SQLITE_OK;
+
+    for (i = 0; i < num_rows && rc == SQLITE_OK; i++) {
+        struct process_row* row = &rows[i];
+
+        sqlite3_bind_int(insert, 1, row->pid);
+        sqlite3_bind_text(insert, 2, row->name, strnlen(row->name, PROCESS_NAME_LEN),
+                          SQLITE_STATIC);
+        sqlite3_bind_int(insert, 3, row->parent_pid);
+        sqlite3_bind_int64(insert, 4, row->state);
+        sqlite3_bind_int64(insert, 5, row->flags);
+        sqlite3_bind_int(insert, 6, row->priority);
+        sqlite3_bind_int(insert, 7, row->num_vmas);
+        sqlite3_bind_int64(insert, 8, row->total_vm);
+
+        rc = sqlite3_step(insert);
+        if (rc == SQLITE_DONE)
+            rc = SQLITE_OK;
+        sqlite3_reset(insert);
+    }
+
+    return rc;
+}
+
+/* Populate Process table in a single transaction, reading rows through the
+ * module connection fd into scratch memory from arena. A savepoint rather
+ * than BEGIN, so loading inside a transaction the user opened in the shell
+ * neither fails nor rolls theirs back. */
+int k_PopulateProcessTable(sqlite3* db, int fd, k_Arena* arena)
+{
+    struct process_batch* batch = NULL;
+    sqlite3_stmt* insert = NULL;
+    int rc;
+
+    rc = sqlite3_exec(db, "SAVEPOINT k_load", NULL, 0, NULL);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_prepare_v2(db, "INSERT INTO process VALUES (?,?,?,?,?,?,?,?)",
+                                -1, &insert, NULL);
+    if (rc != SQLITE_OK)
+        goto done;
+
+    batch = k_ArenaAlloc(arena, MAX_RESP);
+    if (batch == NULL) {
+        rc = SQLITE_NOMEM;
+        goto done;
+    }
+
+    if (k_OpenProcessScan(fd, 0, INT_MAX) == -1) {
+        rc = SQLITE_IOERR;
+        goto done;
+    }
+
+    do {
+        if (k_FetchProcessBatch(fd, batch, 0) == -1) {
+            rc = SQLITE_IOERR;
+            break;
+        }
+        rc = k_InsertProcessRows(insert, (struct process_row*) (batch + 1),
+                                 batch->num_rows);
+    } while (rc == SQLITE_OK && !batch->done);
+
+    if (rc == SQLITE_OK)
+        rc = k_BuildIndexes(db, k_ProcessIndexes, NUM_PROCESS_INDEXES);
+
+done:
+    if (rc != SQLITE_OK && rc != SQLITE_IOERR)
+        fprintf(stdout, MAKE_RED "SQL error: %s\n" RESET_COLOR, sqlite3_errmsg(db));
+
+    sqlite3_finalize(insert);
+    sqlite3_exec(db, rc == SQLITE_OK ? "RELEASE k_load" : "ROLLBACK TO k_load; RELEASE k_load",
+                 NULL, 0, NULL);
+
+    return rc;
+}
+
+/* Reset Process table */
+int k_ResetProcessTable(sqlite3* db)
+{
+    char* error_msg = NULL;
+    int rc = sqlite3_exec(db, "DELETE FROM process;", NULL, 0, &error_msg);
+    if (rc != SQLITE_OK) {
+        fprintf(stdout, MAKE_RED "SQL error: %s\n" RESET_COLOR, error_msg);
+        sqlite3_free(error_msg);
+    }
+    return rc;
+}
+
+
+/* Indexes on the Process ancestry table, for subtree (ancestor_pid) and
+ * ancestor (pid) lookups */
+k_Index k_AncestryIndexes[] = {
+    {"process_ancestry_ancestor", "process_ancestry", "ancestor_pid"},
+    {"process_ancestry_pid",      "process_ancestry", "pid"},
+};
+
+#define NUM_ANCESTRY_INDEXES (sizeof(k_AncestryIndexes) / sizeof(k_AncestryIndexes[0]))
+
+/* Create Process ancestry table, the transitive closure of parent_pid (every
+ * process is its own ancestor at depth 0), and the subtree view aggregating
+ * it per ancestor */
+int k_CreateProcessAncestryTable(sqlite3* db)
+{
+    char* error_msg = NULL;
+    char* create_stmt  = "CREATE TABLE IF NOT EXISTS process_ancestry ("
+                         "  ancestor_pid INT,"
+                         "  pid          INT,"
+                         "  depth        INT"
+                         ");"
+                         "CREATE VIEW IF NOT EXISTS subtree AS"
+                         "  SELECT a.ancestor_pid AS pid,"
+                         "         count(*)        AS num_processes,"
+                         "         max(a.depth)    AS height,"
+                         "         sum(p.num_vmas) AS num_vmas,"
+                         "         sum(p.total_vm) AS total_vm"
+                         "  FROM process_ancestry a JOIN process p ON p.pid = a.pid"
+                         "  GROUP BY a.ancestor_pid";
+    int rc = sqlite3_exec(db, create_stmt, NULL, 0, &error_msg);
+    if (rc != SQLITE_OK) {
+        fprintf(stdout, MAKE_RED "SQL error: %s\n" RESET_COLOR, error_msg);
+        sqlite3_free(error_msg);
+    }
+    return rc;
+}
+
+/* Index of pid in the sorted pids, -1 if absent */
+int k_FindPid(int* pids, int num_pids, int pid)
+{
+    int lo = 0, hi = num_pids - 1;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (pids[mid] == pid)
+            return mid;
+        if (pids[mid] < pid)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return -1;
+}
+
+/* Populate Process ancestry table from the Process table in one pass: the
+ * tree is read once into arena, then every process inserts its chain of
+ * ancestors. Indexes are built after the first load, as for Process. */
+int k_PopulateProcessAncestryTable(sqlite3* db, int NotUsed, k_Arena* arena)
+{
+    sqlite3_stmt *select = NULL, *insert = NULL;
+    int *pids, *parents, i, num_pids = 0, max_pids = 0, rc;
+
+    rc = sqlite3_exec(db, "SAVEPOINT k_load", NULL, 0, NULL);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_prepare_v2(db, "SELECT count(*) FROM process", -1, &select, NULL);
+    if (rc == SQLITE_OK && sqlite3_step(select) == SQLITE_ROW)
+        max_pids = sqlite3_column_int(select, 0);
+    sqlite3_finalize(select);
+    select = NULL;
+
+    if (rc == SQLITE_OK)
+        rc = sqlite3_prepare_v2(db, "SELECT pid, parent_pid FROM process ORDER BY pid",
+                                -1, &select, NULL);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_prepare_v2(db, "INSERT INTO process_ancestry VALUES (?,?,?)",
+                                -1, &insert, NULL);
+    if (rc != SQLITE_OK)
+        goto done;
+
+    pids    = k_ArenaAlloc(arena, (max_pids + 1) * sizeof(int));
+    parents = k_ArenaAlloc(arena, (max_pids + 1) * sizeof(int));
+    if (pids == NULL || parents == NULL) {
+        rc = SQLITE_NOMEM;
+        goto done;
+    }
+
+    /* Parent pids first, then resolved to indexes into pids */
+    while (num_pids < max_pids && sqlite3_step(select) == SQLITE_ROW) {
+        pids[num_pids]    = sqlite3_column_int(select, 0);
+        parents[num_pids] = sqlite3_column_int(select, 1);
+        num_pids++;
+    }
+    for (i = 0; i < num_pids; i++)
+        parents[i] = parents[i] == pids[i] ? -1 : k_FindPid(pids, num_pids, parents[i]);
+
+    for (i = 0; i < num_pids && rc == SQLITE_OK; i++) {
+        int ancestor = i, depth = 0;
+
+        /* depth bounds the walk should parent_pid ever form a cycle */
+        while (ancestor != -1 && depth < num_pids && rc == SQLITE_OK) {
+            sqlite3_bind_int(insert, 1, pids[ancestor]);
+            sqlite3_bind_int(insert, 2, pids[i]);
+            sqlite3_bind_int(insert, 3, depth);
+
+            rc = sqlite3_step(insert);
+            if (rc == SQLITE_DONE)
+                rc = SQLITE_OK;
+            sqlite3_reset(insert);
+
+            ancestor = parents[ancestor];
+            depth++;
+        }
+    }
+
+    if (rc == SQLITE_OK)
+        rc = k_BuildIndexes(db, k_AncestryIndexes, NUM_ANCESTRY_INDEXES);
+
+done:
+    if (rc != SQLITE_OK)
+        fprintf(stdout, MAKE_RED "SQL error: %s\n" RESET_COLOR, sqlite3_errmsg(db));
+
+    sqlite3_finalize(select);
+    sqlite3_finalize(insert);
+    sqlite3_exec(db, rc == SQLITE_OK ? "RELEASE k_load" : "ROLLBACK TO k_load; RELEASE k_load",
+                 NULL, 0, NULL);
+
+    return rc;
+}
+
+/* Reset Process ancestry table */
+int k_ResetProcessAncestryTable(sqlite3* db)
+{
+    char* error_msg = NULL;
+    int rc = sqlite3_exec(db, "DELETE FROM process_ancestry;", NULL, 0, &error_msg);
+    if (rc != SQLITE_OK) {
+        fprintf(stdout, MAKE_RED "SQL error: %s\n" RESET_COLOR, error_msg);
+        sqlite3_free(error_msg);
+    }
+    return rc;
+}
+//
+//--------------------------------------------------------------------------//
+
+//----------------------------- SNAPSHOT TABLES ----------------------------//
+//
+/* Columnar copy of the Process table, for queries the columnar path runs
+ * (see COLUMNAR EXECUTION): an array per integer column and zero-padded
+ * names. It is the collection the SQLite table is loaded from, so both hold
+ * the same rows, and is invalidated by statements that write. */
+typedef struct {
+    int num_rows;
+    int cap;
+    int64_t* ints[NUM_PROCESS_COLUMNS];  // NULL for name
+    char (*names)[PROCESS_NAME_LEN];
+    int populated;
+    int generation;
+    long long populated_at;
+} k_Columns;
+
+k_Columns process_columns;
+
+/* Tables copied into SQLite in snapshot mode. Only the tables a statement
+ * reads are populated before it runs, so cheap tables never pay for
+ * collecting expensive ones. */
+typedef struct {
+    char* name;
+    int (*create)(sqlite3*);
+    int (*populate)(sqlite3*, int, k_Arena*);
+    int (*reset)(sqlite3*);
+    unsigned int sources;  // Bit i set if computed from k_Tables[i], i < this
+    char* view;      // View over the table (and its sources) it creates, or NULL
+    k_Columns* columns;  // Columnar copy it is loaded from in the foreground, or NULL
+    int referenced;  // Read by the statement being prepared
+    int populated;   // Populated since the last reset
+    int generation;  // Snapshot generation of the current contents
+    long long populated_at;
+} k_Table;
+
+k_Table k_Tables[] = {
+    {"process", k_CreateProcessTable, k_PopulateProcessTable, k_ResetProcessTable,
+     0, NULL, &process_columns},
+    {"process_ancestry", k_CreateProcessAncestryTable, k_PopulateProcessAncestryTable,
+     k_ResetProcessAncestryTable, 1u << 0, "subtree"},
+};
+
+#define NUM_TABLES (sizeof(k_Tables) / sizeof(k_Tables[0]))
+
+/* Copy tables into SQLite before each query instead of streaming them */
+int snapshot_mode = 0;
+
+/* How long (ms) a populated table is reused by later queries */
+long long staleness_ms = 0;
+
+/* Incremented every time a table is populated */
+int snapshot_generation = 0;
+
+/* Guards state shared with the background refresher */
+pthread_mutex_t refresh_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Bit i set once a query has read k_Tables[i] */
+unsigned int wanted_tables;
+
+/* Oldest generation and largest age (ms) of the tables the last query read */
+int query_generation;
+long long query_age_ms;
+
+/* Milliseconds on a monotonic clock */
+long long k_NowMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* Create every snapshot table, empty */
+int k_CreateSnapshotTables(sqlite3* db)
+{
+    int i, rc = SQLITE_OK;
+    for (i = 0; i < NUM_TABLES && rc == SQLITE_OK; i++)
+        rc = k_Tables[i].create(db);
+    return rc;
+}
+
+/* Set by the last prepare if the statement's result can change while the
+ * snapshot tables it reads don't: it reads another table or calls a function
+ * like random() */
+int outside_snapshot;
+
+/* Functions whose results vary between calls with the same arguments */
+const char* k_VolatileFunctions[] = {
+    "random", "randomblob", "changes", "total_changes", "last_insert_rowid",
+    "date", "time", "datetime", "julianday", "strftime", "unixepoch",
+    "current_timestamp", "current_date", "current_time",
+};
+
+#define NUM_VOLATILE_FUNCTIONS \
+    (sizeof(k_VolatileFunctions) / sizeof(k_VolatileFunctions[0]))
+
+/* Authorizer recording the tables read by the statement being prepared */
+int k_RecordTableRead(void* NotUsed, int action, const char* table,
+                      const char* column, const char* schema, const char* view)
+{
+    int i;
+
+    if (action == SQLITE_FUNCTION) {
+        for (i = 0; i < NUM_VOLATILE_FUNCTIONS; i++)
+            if (sqlite3_stricmp(k_VolatileFunctions[i], column) == 0)
+                outside_snapshot = 1;
+        return SQLITE_OK;
+    }
+
+    if (action != SQLITE_READ || table == NULL)
+        return SQLITE_OK;
+
+    for (i = 0; i < NUM_TABLES; i++) {
+        if (strcmp(k_Tables[i].name, table) == 0)
+            break;
+        if (k_Tables[i].view != NULL && strcmp(k_Tables[i].view, table) == 0)
+            break;  // The tables under it are reported too
+    }
+    if (i < NUM_TABLES)
+        k_Tables[i].referenced = 1;
+    else
+        outside_snapshot = 1;
+
+    return SQLITE_OK;
+}
+
+/* Mark the tables referenced tables are computed from as referenced too, so
+ * they are populated first */
+void k_ReferenceSources()
+{
+    int i, j;
+    for (i = NUM_TABLES - 1; i >= 0; i--)
+        for (j = 0; j < i; j++)
+            if (k_Tables[i].referenced && ((k_Tables[i].sources >> j) & 1))
+                k_Tables[j].referenced = 1;
+}
+
+/* Mark the named tables as referenced, with their sources, instead of those
+ * of the last prepared statement. SQLITE_ERROR if one isn't a snapshot table. */
+int k_ReferenceTables(char** tables, int num_tables)
+{
+    int i, j;
+
+    for (i = 0; i < NUM_TABLES; i++)
+        k_Tables[i].referenced = 0;
+    for (i = 0; i < num_tables; i++) {
+        for (j = 0; j < NUM_TABLES; j++)
+            if (strcmp(tables[i], k_Tables[j].name) == 0)
+                break;
+        if (j == NUM_TABLES) {
+            fprintf(stderr, MAKE_RED "No such table: %s\n" RESET_COLOR, tables[i]);
+            return SQLITE_ERROR;
+        }
+        k_Tables[j].referenced = 1;
+    }
+
+    k_ReferenceSources();
+    return SQLITE_OK;
+}
+
+/* Prepare the next statement of query, recording the tables it reads */
+int k_PrepareRecordingTables(sqlite3* db, const char* query, sqlite3_stmt** stmt,
+                             const char** tail)
+{
+    int i, rc;
+
+    for (i = 0; i < NUM_TABLES; i++)
+        k_Tables[i].referenced = 0;
+    outside_snapshot = 0;
+
+    sqlite3_set_authorizer(db, k_RecordTableRead, NULL);
+    rc = sqlite3_prepare_v2(db, query, -1, stmt, tail);
+    sqlite3_set_authorizer(db, NULL, NULL);
+
+    k_ReferenceSources();
+
+    return rc;
+}
+
+/* Make room for num_rows more rows in cols, 0 on success */
+int k_ReserveColumns(k_Columns* cols, int num_rows)
+{
+    int c, cap = cols->cap ? cols->cap : 1024;
+
+    if (cols->num_rows + num_rows <= cols->cap)
+        return 0;
+
+    while (cap < cols->num_rows + num_rows)
+        cap *= 2;
+    for (c = 0; c < NUM_PROCESS_COLUMNS; c++) {
+        void* grown;
+        if (c == PROCESS_COLUMN_NAME)
+            grown = cols->names = realloc(cols->names, cap * sizeof(*cols->names));
+        else
+            grown = cols->ints[c] = realloc(cols->ints[c], cap * sizeof(int64_t));
+        if (grown == NULL)
+            return -1;
+    }
+    cols->cap = cap;
+    return 0;
+}
+
+/* Append rows to cols, 0 on success */
+int k_AppendColumns(k_Columns* cols, struct process_row* rows, int num_rows)
+{
+    int i;
+
+    if (k_ReserveColumns(cols, num_rows))
+        return -1;
+
+    for (i = 0; i < num_rows; i++) {
+        struct process_row* row = &rows[i];
+        int n = cols->num_rows++;
+
+        cols->ints[PROCESS_COLUMN_PID][n]        = row->pid;
+        cols->ints[PROCESS_COLUMN_PARENT_PID][n] = row->parent_pid;
+        cols->ints[PROCESS_COLUMN_STATE][n]      = row->state;
+        cols->ints[PROCESS_COLUMN_FLAGS][n]      = row->flags;
+        cols->ints[PROCESS_COLUMN_PRIORITY][n]   = row->priority;
+        cols->ints[PROCESS_COLUMN_NUM_VMAS][n]   = row->num_vmas;
+        cols->ints[PROCESS_COLUMN_TOTAL_VM][n]   = row->total_vm;
+        memset(cols->names[n], 0, PROCESS_NAME_LEN);
+        memcpy(cols->names[n], row->name, strnlen(row->name, PROCESS_NAME_LEN - 1));
+    }
+    return 0;
+}
+
+/* Append row of src to dst, 0 on success */
+int k_CopyColumnsRow(k_Columns* dst, k_Columns* src, int row)
+{
+    int c;
+
+    if (k_ReserveColumns(dst, 1))
+        return -1;
+    for (c = 0; c < NUM_PROCESS_COLUMNS; c++)
+        if (c != PROCESS_COLUMN_NAME)
+            dst->ints[c][dst->num_rows] = src->ints[c][row];
+    memcpy(dst->names[dst->num_rows], src->names[row], PROCESS_NAME_LEN);
+    dst->num_rows++;
+    return 0;
+}
+
+void k_FreeColumns(k_Columns* cols)
+{
+    int c;
+    for (c = 0; c < NUM_PROCESS_COLUMNS; c++)
+        free(cols->ints[c]);
+    free(cols->names);
+    memset(cols, 0, sizeof(*cols));
+}
+
+/* Collect the columnar copy of the Process table unless it is already
+ * populated */
+int k_PopulateColumns(k_Columns* cols, int fd, k_Arena* arena)
+{
+    struct process_batch* batch;
+
+    if (!cols->populated) {
+        batch = k_ArenaAlloc(arena, MAX_RESP);
+        if (batch == NULL)
+            return SQLITE_NOMEM;
+        if (k_OpenProcessScan(fd, 0, INT_MAX) == -1)
+            return SQLITE_IOERR;
+
+        cols->num_rows = 0;
+        do {
+            if (k_FetchProcessBatch(fd, batch, 0) == -1)
+                return SQLITE_IOERR;
+            if (k_AppendColumns(cols, (struct process_row*) (batch + 1), batch->num_rows))
+                return SQLITE_NOMEM;
+        } while (!batch->done);
+
+        cols->populated = 1;
+        cols->populated_at = k_NowMs();
+        pthread_mutex_lock(&refresh_mutex);
+        cols->generation = ++snapshot_generation;
+        pthread_mutex_unlock(&refresh_mutex);
+    }
+
+    return SQLITE_OK;
+}
+
+/* Populate Process table from cols in a single transaction */
+int k_LoadProcessColumns(sqlite3* db, k_Columns* cols)
+{
+    sqlite3_stmt* insert = NULL;
+    int c, i, rc;
+
+    rc = sqlite3_exec(db, "SAVEPOINT k_load", NULL, 0, NULL);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_prepare_v2(db, "INSERT INTO process VALUES (?,?,?,?,?,?,?,?)",
+                                -1, &insert, NULL);
+
+    for (i = 0; i < cols->num_rows && rc == SQLITE_OK; i++) {
+        for (c = 0; c < NUM_PROCESS_COLUMNS; c++) {
+            if (c == PROCESS_COLUMN_NAME)
+                sqlite3_bind_text(insert, c + 1, cols->names[i],
+                                  strnlen(cols->names[i], PROCESS_NAME_LEN), SQLITE_STATIC);
+            else
+                sqlite3_bind_int64(insert, c + 1, cols->ints[c][i]);
+        }
+
+        rc = sqlite3_step(insert);
+        if (rc == SQLITE_DONE)
+            rc = SQLITE_OK;
+        sqlite3_reset(insert);
+    }
+
+    if (rc == SQLITE_OK)
+        rc = k_BuildIndexes(db, k_ProcessIndexes, NUM_PROCESS_INDEXES);
+    if (rc != SQLITE_OK)
+        fprintf(stdout, MAKE_RED "SQL error: %s\n" RESET_COLOR, sqlite3_errmsg(db));
+
+    sqlite3_finalize(insert);
+    sqlite3_exec(db, rc == SQLITE_OK ? "RELEASE k_load" : "ROLLBACK TO k_load; RELEASE k_load",
+                 NULL, 0, NULL);
+
+    return rc;
+}
+
+/* Populate the tables recorded by the last prepare that aren't populated yet,
+ * noting the generation and age of every table read */
+int k_PopulateReferencedTables(sqlite3* db)
+{
+    int i, j, rc = SQLITE_OK;
+    long long now = k_NowMs();
+
+    for (i = 0; i < NUM_TABLES && rc == SQLITE_OK; i++) {
+        k_Table* table = &k_Tables[i];
+        if (!table->referenced)
+            continue;
+
+        /* Recompute tables whose sources were repopulated since, whether by
+         * this call or by an earlier query that didn't read this table */
+        for (j = 0; j < i && table->populated; j++) {
+            if (((table->sources >> j) & 1) &&
+                k_Tables[j].generation > table->generation) {
+                table->reset(db);
+                table->populated = 0;
+            }
+        }
+
+        /* A table with a columnar copy is loaded from it, collecting it first
+         * if needed, so the columnar path and SQLite see the same rows */
+        if (!table->populated && table->columns != NULL) {
+            rc = k_PopulateColumns(table->columns, fp, &query_arena);
+            if (rc == SQLITE_OK)
+                rc = k_LoadProcessColumns(db, table->columns);
+            if (rc != SQLITE_OK)
+                break;
+            table->populated = 1;
+            table->populated_at = table->columns->populated_at;
+            table->generation = table->columns->generation;
+
+            pthread_mutex_lock(&refresh_mutex);
+            wanted_tables |= 1u << i;
+            pthread_mutex_unlock(&refresh_mutex);
+        } else if (!table->populated) {
+            rc = table->populate(db, fp, &query_arena);
+            if (rc != SQLITE_OK)
+                break;
+            table->populated = 1;
+            table->populated_at = now = k_NowMs();
+
+            pthread_mutex_lock(&refresh_mutex);
+            table->generation = ++snapshot_generation;
+            wanted_tables |= 1u << i;
+            pthread_mutex_unlock(&refresh_mutex);
+        }
+
+        if (query_generation == 0 || table->generation < query_generation)
+            query_generation = table->generation;
+        if (now - table->populated_at > query_age_ms)
+            query_age_ms = now - table->populated_at;
+    }
+
+    return rc;
+}
+
+
+/* Empty the tables populated more than max_age_ms ago */
+int k_ExpireSnapshotTables(sqlite3* db, long long max_age_ms)
+{
+    int i, rc = SQLITE_OK;
+    long long now = k_NowMs();
+
+    for (i = 0; i < NUM_TABLES; i++) {
+        if (!k_Tables[i].populated)
+            continue;
+        if (now - k_Tables[i].populated_at <= max_age_ms && max_age_ms > 0)
+            continue;
+        if (k_Tables[i].reset(db) != SQLITE_OK)
+            rc = SQLITE_ERROR;
+        k_Tables[i].populated = 0;
+    }
+
+    if (process_columns.populated &&
+        (now - process_columns.populated_at > max_age_ms || max_age_ms <= 0))
+        process_columns.populated = 0;
+
+    return rc;
+}
+
+/* Empty every populated table, so the next query collects a new snapshot */
+int k_ResetSnapshotTables(sqlite3* db)
+{
+    return k_ExpireSnapshotTables(db, 0);
+}
+
+/* Record the snapshot the last query used in its output */
+void k_PrintSnapshotInfo()
+{
+    if (query_generation != 0)
+        fprintf(stdout, MAKE_GREEN "(snapshot %d, %lld ms old)\n" RESET_COLOR,
+                query_generation, query_age_ms);
+}
+//
+//--------------------------------------------------------------------------//
+
+//--------------------------- BACKGROUND REFRESH ---------------------------//
+//
+/* With --background MS, a refresher thread builds the next snapshot into a
+ * separate in-memory database every MS milliseconds while queries run against
+ * the current one, so queries don't wait for collection. Snapshots are
+ * shared-cache memory databases attached to the query connection as "snap".
+ * They are swapped between queries by re-attaching, so user tables and
+ * cached statements in the main database survive swaps. */
+typedef struct {
+    sqlite3* db;  // Keeps the memory database alive until it is attached
+    int id;       // Names the database, see k_SnapshotURI
+    int generation;
+    int populated[NUM_TABLES];
+    long long populated_at[NUM_TABLES];
+} k_Snapshot;
+
+/* Rebuild snapshots in the background every background_ms, 0 if disabled */
+long long background_ms = 0;
+
+pthread_t refresher;
+pthread_cond_t refresh_cond = PTHREAD_COND_INITIALIZER;
+int refresh_stop;
+
+/* Snapshot built by the refresher but not attached yet, db NULL if none */
+k_Snapshot ready_snapshot;
+
+void k_SnapshotURI(char* uri, size_t len, int id)
+{
+    snprintf(uri, len, "file:kquery_snap%d?mode=memory&cache=shared", id);
+}
+
+/* Open snapshot database id, with every snapshot table created empty */
+sqlite3* k_OpenSnapshot(int id)
+{
+    sqlite3* db = NULL;
+    char uri[64];
+
+    k_SnapshotURI(uri, sizeof(uri), id);
+    if (sqlite3_open_v2(uri, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE |
+                                  SQLITE_OPEN_URI, NULL) != SQLITE_OK ||
+        k_CreateSnapshotTables(db) != SQLITE_OK) {
+        fprintf(stderr, MAKE_RED "Can't open snapshot: %s\n" RESET_COLOR,
+                sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return NULL;
+    }
+    return db;
+}
+
+/* Attach snapshot database id to db as "snap", replacing the previous one */
+int k_AttachSnapshot(sqlite3* db, int id)
+{
+    char uri[64], attach[128];
+
+    k_SnapshotURI(uri, sizeof(uri), id);
+    snprintf(attach, sizeof(attach), "ATTACH '%s' AS snap", uri);
+
+    sqlite3_exec(db, "DETACH snap", NULL, 0, NULL);
+    return sqlite3_exec(db, attach, NULL, 0, NULL);
+}
+
+/* Switch db over to the snapshot built by the refresher, if one is ready */
+void k_SwapSnapshot(sqlite3* db)
+{
+    k_Snapshot next;
+    int i;
+
+    pthread_mutex_lock(&refresh_mutex);
+    next = ready_snapshot;
+    ready_snapshot.db = NULL;
+    pthread_mutex_unlock(&refresh_mutex);
+
+    if (next.db == NULL)
+        return;
+
+    if (k_AttachSnapshot(db, next.id) != SQLITE_OK) {
+        fprintf(stderr, MAKE_RED "Can't attach snapshot: %s\n" RESET_COLOR,
+                sqlite3_errmsg(db));
+        sqlite3_close(next.db);
+        return;
+    }
+    sqlite3_close(next.db);  // The attachment now keeps it alive
+
+    for (i = 0; i < NUM_TABLES; i++) {
+        k_Tables[i].populated    = next.populated[i];
+        k_Tables[i].generation   = next.generation;
+        k_Tables[i].populated_at = next.populated_at[i];
+    }
+    process_columns.populated = 0;  // Tables loaded from it were replaced
+}
+
+/* Refresher thread, building a snapshot of the tables queries have read every
+ * background_ms */
+void* k_RefreshSnapshots(void* NotUsed)
+{
+    k_Arena arena = {0};
+    long long next_build = k_NowMs();
+    int fd = k_OpenModule(), id = 0;
+
+    pthread_mutex_lock(&refresh_mutex);
+    while (!refresh_stop) {
+        k_Snapshot snap = {0};
+        unsigned int tables;
+        struct timespec deadline;
+        long long wait_ms = next_build - k_NowMs();
+        int i;
+
+        if (wait_ms > 0 || wanted_tables == 0) {
+            if (wait_ms <= 0)
+                wait_ms = background_ms;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec  += wait_ms / 1000;
+            deadline.tv_nsec += wait_ms % 1000 * 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&refresh_cond, &refresh_mutex, &deadline);
+            continue;
+        }
+
+        tables = wanted_tables;
+        next_build = k_NowMs() + background_ms;
+        pthread_mutex_unlock(&refresh_mutex);
+
+        snap.id = ++id;
+        snap.db = k_OpenSnapshot(snap.id);
+        for (i = 0; i < NUM_TABLES && snap.db != NULL; i++) {
+            if (!((tables >> i) & 1))
+                continue;
+            if (k_Tables[i].populate(snap.db, fd, &arena) != SQLITE_OK) {
+                sqlite3_close(snap.db);
+                snap.db = NULL;
+            }
+            snap.populated[i] = 1;
+            snap.populated_at[i] = k_NowMs();
+            k_ArenaReset(&arena);
+        }
+
+        pthread_mutex_lock(&refresh_mutex);
+        if (snap.db == NULL)
+            continue;
+        if (ready_snapshot.db != NULL)
+            sqlite3_close(ready_snapshot.db);  // Superseded before being used
+        snap.generation = ++snapshot_generation;
+        ready_snapshot = snap;
+    }
+    pthread_mutex_unlock(&refresh_mutex);
+
+    k_ArenaFree(&arena);
+    close(fd);
+    return NULL;
+}
+
+/* Attach an empty first snapshot to db and start the refresher */
+int k_StartRefresher(sqlite3* db)
+{
+    sqlite3* first = k_OpenSnapshot(0);
+    int rc;
+
+    if (first == NULL)
+        return SQLITE_ERROR;
+    rc = k_AttachSnapshot(db, 0);
+    sqlite3_close(first);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    return pthread_create(&refresher, NULL, k_RefreshSnapshots, NULL) == 0 ?
+           SQLITE_OK : SQLITE_ERROR;
+}
+
+/* Stop the refresher and drop the snapshot it had ready */
+void k_StopRefresher()
+{
+    pthread_mutex_lock(&refresh_mutex);
+    refresh_stop = 1;
+    pthread_cond_signal(&refresh_cond);
+    pthread_mutex_unlock(&refresh_mutex);
+
+    pthread_join(refresher, NULL);
+
+    if (ready_snapshot.db != NULL)
+        sqlite3_close(ready_snapshot.db);
+    ready_snapshot.db = NULL;
+}
+//
+//--------------------------------------------------------------------------//
+
+//----------------------------- STATEMENT CACHE ----------------------------//
+//
+/* LRU of prepared statements keyed by normalized statement text, so repeated
+ * queries skip parsing and planning. Only read-only statements are cached,
+ * and the cache is emptied after any other statement since it may have
+ * changed the schema. */
+typedef struct {
+    char* sql;               // Normalized text, NULL if the entry is unused
+    sqlite3_stmt* stmt;
+    unsigned int tables;     // Bit i set if the statement reads k_Tables[i]
+    int outside_snapshot;    // See outside_snapshot
+    unsigned long last_used;
+} k_CachedStmt;
+
+#define STMT_CACHE_SIZE 32
+
+k_CachedStmt stmt_cache[STMT_CACHE_SIZE];
+unsigned long stmt_cache_clock, stmt_cache_hits, stmt_cache_misses;
+
+/* Copy query with comments removed and whitespace outside quotes collapsed to
+ * single spaces. The result lives in the query arena. */
+char* k_NormalizeQuery(const char* query)
+{
+    char* sql = k_ArenaAlloc(&query_arena, strlen(query) + 1);
+    char quote = 0;
+    int len = 0;
+
+    if (sql == NULL)
+        return NULL;
+
+    while (*query != '\0') {
+        char ch = *query++;
+
+        if (quote) {
+            sql[len++] = ch;
+            if (ch == quote)
+                quote = 0;
+            continue;
+        }
+
+        if (ch == '-' && *query == '-') {
+            while (*query != '\0' && *query != '\n')
+                query++;
+            ch = ' ';
+        } else if (ch == '/' && *query == '*') {
+            query++;
+            while (*query != '\0' && !(query[0] == '*' && query[1] == '/'))
+                query++;
+            if (*query != '\0')
+                query += 2;
+            ch = ' ';
+        }
+
+        if (ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r') {
+            if (len != 0 && sql[len-1] != ' ')
+                sql[len++] = ' ';
+            continue;
+        }
+
+        if (ch == '\'' || ch == '"' || ch == '`')
+            quote = ch;
+        else if (ch == '[')
+            quote = ']';
+        sql[len++] = ch;
+    }
+
+    if (len != 0 && sql[len-1] == ' ')
+        len--;
+    sql[len] = '\0';
+
+    return sql;
+}
+
+/* Length of the first statement of normalized sql, up to and including the
+ * first ';' outside quotes */
+int k_StatementLength(const char* sql)
+{
+    char quote = 0;
+    int i;
+
+    for (i = 0; sql[i] != '\0'; i++) {
+        if (quote) {
+            if (sql[i] == quote)
+                quote = 0;
+        } else if (sql[i] == '\'' || sql[i] == '"' || sql[i] == '`') {
+            quote = sql[i];
+        } else if (sql[i] == '[') {
+            quote = ']';
+        } else if (sql[i] == ';') {
+            return i + 1;
+        }
+    }
+
+    return i;
+}
+
+/* Finalize every cached statement */
+void k_ClearStatementCache()
+{
+    int i;
+    for (i = 0; i < STMT_CACHE_SIZE; i++) {
+        if (stmt_cache[i].sql == NULL)
+            continue;
+        sqlite3_finalize(stmt_cache[i].stmt);
+        free(stmt_cache[i].sql);
+        stmt_cache[i].sql = NULL;
+    }
+}
+
+/* Prepare the first statement of normalized sql, reusing a cached statement
+ * when possible. Sets *cached if stmt belongs to the cache, in which case it
+ * must be released with sqlite3_reset instead of finalized. */
+int k_PrepareCached(sqlite3* db, const char* sql, sqlite3_stmt** stmt,
+                    const char** tail, int* cached)
+{
+    int i, rc, len = k_StatementLength(sql);
+    k_CachedStmt* entry = &stmt_cache[0];
+
+    *cached = 0;
+
+    for (i = 0; i < STMT_CACHE_SIZE; i++) {
+        k_CachedStmt* e = &stmt_cache[i];
+        if (e->sql != NULL && strncmp(e->sql, sql, len) == 0 && e->sql[len] == '\0') {
+            e->last_used = ++stmt_cache_clock;
+            stmt_cache_hits++;
+            for (i = 0; i < NUM_TABLES; i++)
+                k_Tables[i].referenced = (e->tables >> i) & 1;
+            outside_snapshot = e->outside_snapshot;
+            *stmt = e->stmt;
+            *tail = sql + len;
+            *cached = 1;
+            return SQLITE_OK;
+        }
+        if (e->sql == NULL || (entry->sql != NULL && e->last_used < entry->last_used))
+            entry = e;
+    }
+
+    stmt_cache_misses++;
+
+    if (snapshot_mode)
+        rc = k_PrepareRecordingTables(db, sql, stmt, tail);
+    else
+        rc = sqlite3_prepare_v2(db, sql, -1, stmt, tail);
+
+    /* Statements spanning several ';' (triggers) aren't cached */
+    if (rc != SQLITE_OK || *stmt == NULL || *tail != sql + len ||
+        !sqlite3_stmt_readonly(*stmt))
+        return rc;
+
+    /* Evict the least recently used entry */
+    if (entry->sql != NULL) {
+        sqlite3_finalize(entry->stmt);
+        free(entry->sql);
+    }
+
+    entry->sql = strndup(sql, len);
+    if (entry->sql == NULL)
+        return rc;
+    entry->stmt = *stmt;
+    entry->tables = 0;
+    for (i = 0; i < NUM_TABLES; i++)
+        if (k_Tables[i].referenced)
+            entry->tables |= 1u << i;
+    entry->outside_snapshot = outside_snapshot;
+    entry->last_used = ++stmt_cache_clock;
+    *cached = 1;
+
+    return rc;
+}
+
+/* Print statement cache statistics */
+void k_PrintCacheStats()
+{
+    int i, used = 0;
+    for (i = 0; i < STMT_CACHE_SIZE; i++)
+        if (stmt_cache[i].sql != NULL)
+            used++;
+
+    fprintf(stdout, "statements: %d cached (max %d), %lu hits, %lu misses\n",
+            used, STMT_CACHE_SIZE, stmt_cache_hits, stmt_cache_misses);
+}
+//
+//--------------------------------------------------------------------------//
+
+//------------------------------ RESULT CACHE ------------------------------//
+//
+/* In snapshot mode, the output of read-only queries is kept, keyed by the
+ * normalized query, the output format and the newest generation of the
+ * snapshot tables it read. Every collection gets a new generation, so until
+ * one of those tables is collected again (past --staleness, after .refresh or
+ * when a background snapshot is swapped in), repeating the query writes the
+ * stored bytes instead of running it. Queries reading anything else (see
+ * outside_snapshot) aren't cached, and any statement that writes empties the
+ * cache. */
+typedef struct {
+    char* sql;               // Normalized query, NULL if the entry is unused
+    k_Format* format;
+    unsigned int tables;     // Bit i set if the query read k_Tables[i]
+    int columnar;            // Ran on process_columns
+    int generation;          // Newest of the tables read, when it ran
+    char* result;
+    size_t len;
+    unsigned long last_used;
+} k_CachedResult;
+
+#define MAX_RESULT_CACHE_ENTRIES 1024
+
+k_CachedResult result_cache[MAX_RESULT_CACHE_ENTRIES];
+
+/* Limits on the number of results kept and their total size, set with
+ * --result-cache or .result_cache. 0 bytes disables the cache. */
+int result_cache_entries = 64;
+size_t result_cache_bytes = 16 << 20;
+
+size_t result_cache_used;
+unsigned long result_cache_clock, result_cache_hits, result_cache_misses,
+              result_cache_evictions;
+
+/* Newest generation of the snapshot tables in tables, and of process_columns
+ * if columnar, 0 if one isn't populated. Sets *oldest and *age_ms to the
+ * oldest generation and largest age among them. */
+int k_ResultGeneration(unsigned int tables, int columnar, int* oldest,
+                       long long* age_ms)
+{
+    long long now = k_NowMs();
+    int i, newest = 0;
+
+    *oldest = 0;
+    *age_ms = 0;
+
+    for (i = 0; i <= NUM_TABLES; i++) {
+        int populated, generation;
+        long long populated_at;
+
+        if (i < NUM_TABLES && (tables >> i) & 1) {
+            populated = k_Tables[i].populated;
+            generation = k_Tables[i].generation;
+            populated_at = k_Tables[i].populated_at;
+        } else if (i == NUM_TABLES && columnar) {
+            populated = process_columns.populated;
+            generation = process_columns.generation;
+            populated_at = process_columns.populated_at;
+        } else {
+            continue;
+        }
+
+        if (!populated)
+            return 0;
+        if (generation > newest)
+            newest = generation;
+        if (*oldest == 0 || generation < *oldest)
+            *oldest = generation;
+        if (now - populated_at > *age_ms)
+            *age_ms = now - populated_at;
+    }
+
+    return newest;
+}
+
+void k_FreeCachedResult(k_CachedResult* entry)
+{
+    result_cache_used -= entry->len;
+    free(entry->sql);
+    free(entry->result);
+    entry->sql = NULL;
+    entry->result = NULL;
+}
+
+/* Drop every cached result */
+void k_ClearResultCache()
+{
+    int i;
+    for (i = 0; i < MAX_RESULT_CACHE_ENTRIES; i++)
+        if (result_cache[i].sql != NULL)
+            k_FreeCachedResult(&result_cache[i]);
+}
+
+/* Evict least recently used results until at most max_entries are left,
+ * holding at most max_bytes */
+void k_EvictResults(int max_entries, size_t max_bytes)
+{
+    while (1) {
+        k_CachedResult* lru = NULL;
+        int i, used = 0;
+
+        for (i = 0; i < MAX_RESULT_CACHE_ENTRIES; i++) {
+            k_CachedResult* e = &result_cache[i];
+            if (e->sql == NULL)
+                continue;
+            used++;
+            if (lru == NULL || e->last_used < lru->last_used)
+                lru = e;
+        }
+
+        if (lru == NULL || (used <= max_entries && result_cache_used <= max_bytes))
+            return;
+        k_FreeCachedResult(lru);
+        result_cache_evictions++;
+    }
+}
+
+/* Write the cached result of normalized sql in format to out if the tables it
+ * read haven't changed since, noting their generation and age as the query's.
+ * 1 if it was written. */
+int k_WriteCachedResult(const char* sql, k_Format* format, k_Writer* out)
+{
+    int i;
+
+    for (i = 0; i < MAX_RESULT_CACHE_ENTRIES; i++) {
+        k_CachedResult* e = &result_cache[i];
+        int oldest;
+        long long age_ms;
+
+        if (e->sql == NULL || e->format != format || strcmp(e->sql, sql) != 0)
+            continue;
+
+        if (k_ResultGeneration(e->tables, e->columnar, &oldest, &age_ms) != e->generation) {
+            k_FreeCachedResult(e);  // Never valid again
+            break;
+        }
+
+        k_WriteBytes(out, e->result, e->len);
+        e->last_used = ++result_cache_clock;
+        result_cache_hits++;
+        query_generation = oldest;
+        query_age_ms = age_ms;
+        return 1;
+    }
+
+    result_cache_misses++;
+    return 0;
+}
+
+/* Cache result, the output of normalized sql in format, which read tables
+ * (and process_columns if columnar). Takes over result's buffer. */
+void k_StoreResult(const char* sql, k_Format* format, unsigned int tables,
+                   int columnar, k_Writer* result)
+{
+    k_CachedResult* entry = NULL;
+    int i, oldest;
+    long long age_ms;
+    int generation = k_ResultGeneration(tables, columnar, &oldest, &age_ms);
+
+    if (generation == 0 || result->error || result->len > result_cache_bytes)
+        return;
+
+    k_EvictResults(result_cache_entries - 1, result_cache_bytes - result->len);
+    for (i = 0; i < MAX_RESULT_CACHE_ENTRIES && entry == NULL; i++)
+        if (result_cache[i].sql == NULL)
+            entry = &result_cache[i];
+    if (entry == NULL || (entry->sql = strdup(sql)) == NULL)
+        return;
+
+    entry->format = format;
+    entry->tables = tables;
+    entry->columnar = columnar;
+    entry->generation = generation;
+    entry->result = result->buf;
+    entry->len = result->len;
+    entry->last_used = ++result_cache_clock;
+    result_cache_used += result->len;
+
+    result->buf = NULL;
+    result->len = result->cap = 0;
+}
+
+/* Set the result cache limits from "BYTES[,ENTRIES]", -1 if it's invalid */
+int k_ParseResultCache(char* arg)
+{
+    long long bytes;
+    int entries = result_cache_entries;
+    char* end;
+
+    bytes = strtoll(arg, &end, 10);
+    if (*end == ',')
+        entries = strtol(end + 1, &end, 10);
+    if (end == arg || *end != '\0' || bytes < 0 || entries <= 0 ||
+        entries > MAX_RESULT_CACHE_ENTRIES)
+        return -1;
+
+    result_cache_bytes = bytes;
+    result_cache_entries = entries;
+    if (result_cache_bytes == 0)
+        k_ClearResultCache();
+    else
+        k_EvictResults(result_cache_entries, result_cache_bytes);
+    return 0;
+}
+
+/* Print result cache statistics */
+void k_PrintResultCacheStats()
+{
+    unsigned long lookups = result_cache_hits + result_cache_misses;
+    int i, used = 0;
+
+    for (i = 0; i < MAX_RESULT_CACHE_ENTRIES; i++)
+        if (result_cache[i].sql != NULL)
+            used++;
+
+    fprintf(stdout, "results: %d cached (max %d), %zu bytes (max %zu), %lu hits, "
+                    "%lu misses (%.1f%% hit rate), %lu evicted\n",
+            used, result_cache_entries, result_cache_used, result_cache_bytes,
+            result_cache_hits, result_cache_misses,
+            lookups ? 100.0 * result_cache_hits / lookups : 0.0,
+            result_cache_evictions);
+}
+//
+//--------------------------------------------------------------------------//
+
+//--------------------------- COLUMNAR EXECUTION ---------------------------//
+//
+/* In snapshot mode, single-table queries over process of the form
+ *
+ *     SELECT items FROM process [WHERE col op literal [AND ...]]
+ *         [GROUP BY col] [ORDER BY key [ASC|DESC], ...] [LIMIT n]
+ *
+ * where items are columns, * or count/sum/min/max/avg of a column, skip
+ * SQLite. They run over a columnar copy of the table (an array per column),
+ * filled straight from the module, with predicates evaluated a column at a
+ * time into a selection vector and aggregates accumulated in flat loops.
+ * Only result rows go through SQLite, bound to a SELECT of parameters, so
+ * every output format writes them as usual. Anything else, or anything that
+ * could behave differently (like an integer overflow in sum), runs in SQLite
+ * instead. */
+#define FAST_FALLBACK -1  // Not a query the columnar path runs
+
+#define MAX_FAST_ITEMS 16
+#define MAX_FAST_PREDICATES 8
+#define MAX_FAST_ORDER 4
+
+enum { FAST_COLUMN, FAST_COUNT, FAST_SUM, FAST_MIN, FAST_MAX, FAST_AVG };
+enum { OP_EQ, OP_NE, OP_LT, OP_LE, OP_GT, OP_GE };
+
+char* k_AggregateNames[] = {NULL, "count", "sum", "min", "max", "avg"};
+char* k_OperatorNames[] = {"=", "!=", "<", "<=", ">", ">="};
+
+typedef struct {
+    int kind;
+    int col;           // -1 for count(*)
+    const char* name;  // Of the result column
+    int name_len;
+} k_FastItem;
+
+typedef struct {
+    int col;
+    int op;
+    int64_t value;
+    char text[PROCESS_NAME_LEN + 1];  // For name, zero padded
+    int text_len;
+} k_FastPredicate;
+
+typedef struct {
+    int item;  // Result column sorted on, or -1 for a table column
+    int col;
+    int desc;
+} k_FastOrder;
+
+typedef struct {
+    k_FastItem items[MAX_FAST_ITEMS];
+    int num_items;
+    k_FastPredicate predicates[MAX_FAST_PREDICATES];
+    int num_predicates;
+    int group_col;  // -1 without GROUP BY
+    int aggregate;  // Some item is an aggregate
+    k_FastOrder order[MAX_FAST_ORDER];
+    int num_order;
+    long long limit;  // -1 without LIMIT
+} k_FastQuery;
+
+/* Current token of a simple query */
+typedef struct {
+    const char* start;
+    int len;
+} k_Lexer;
+
+/* Advance to the next token, returning its first character (0 at the end) */
+char k_NextToken(k_Lexer* lex)
+{
+    const char* p = lex->start + lex->len;
+
+    while (*p == ' ')
+        p++;
+    lex->start = p;
+
+    if (isalpha((unsigned char) *p) || *p == '_') {
+        while (isalnum((unsigned char) *p) || *p == '_')
+            p++;
+    } else if (isdigit((unsigned char) *p)) {
+        while (isdigit((unsigned char) *p))
+            p++;
+    } else if (*p == '\'') {
+        for (p++; *p != '\0'; p++)
+            if (*p == '\'' && *++p != '\'')
+                break;
+    } else if ((p[0] == '<' && (p[1] == '=' || p[1] == '>')) ||
+               ((p[0] == '>' || p[0] == '=' || p[0] == '!') && p[1] == '=')) {
+        p += 2;
+    } else if (*p != '\0') {
+        p++;
+    }
+
+    lex->len = p - lex->start;
+    return *lex->start;
+}
+
+/* Whether the current token is keyword, ignoring case */
+int k_IsToken(k_Lexer* lex, const char* keyword)
+{
+    return lex->len == strlen(keyword) && strncasecmp(lex->start, keyword, lex->len) == 0;
+}
+
+/* Column of the current token, or -1 */
+int k_FastColumn(k_Lexer* lex)
+{
+    int i;
+    for (i = 0; i < NUM_PROCESS_COLUMNS; i++)
+        if (k_IsToken(lex, k_ProcessColumnNames[i]))
+            return i;
+    return -1;
+}
+
+/* Whether the current token ends an item or starts a clause */
+int k_IsClause(k_Lexer* lex)
+{
+    return k_IsToken(lex, "FROM") || k_IsToken(lex, "WHERE") || k_IsToken(lex, "GROUP") ||
+           k_IsToken(lex, "ORDER") || k_IsToken(lex, "LIMIT") || k_IsToken(lex, "ASC") ||
+           k_IsToken(lex, "DESC") || k_IsToken(lex, "AND");
+}
+
+/* Parse a column or aggregate at the current token into item, leaving the
+ * lexer on its last token. -1 if it is neither. */
+int k_ParseFastExpr(k_Lexer* lex, k_FastItem* item)
+{
+    const char* start = lex->start;
+    int i;
+
+    item->kind = FAST_COLUMN;
+    item->col = k_FastColumn(lex);
+    item->name = item->col >= 0 ? k_ProcessColumnNames[item->col] : NULL;
+    item->name_len = item->name ? strlen(item->name) : 0;
+
+    for (i = FAST_COUNT; i <= FAST_AVG && item->col == -1; i++) {
+        if (!k_IsToken(lex, k_AggregateNames[i]))
+            continue;
+        if (k_NextToken(lex) != '(')
+            return -1;
+        k_NextToken(lex);
+        item->kind = i;
+        if (i == FAST_COUNT && k_IsToken(lex, "*"))
+            item->col = -1;
+        else if ((item->col = k_FastColumn(lex)) == -1)
+            return -1;
+        if (k_NextToken(lex) != ')')
+            return -1;
+
+        /* Named after the expression as written, like SQLite does */
+        item->name = start;
+        item->name_len = lex->start + 1 - start;
+        return 0;
+    }
+
+    return item->col >= 0 ? 0 : -1;
+}
+
+/* Parse a literal at the current token for a predicate on pred->col */
+int k_ParseFastLiteral(k_Lexer* lex, k_FastPredicate* pred)
+{
+    int negative = 0;
+    const char* p;
+
+    if (pred->col == PROCESS_COLUMN_NAME) {
+        if (*lex->start != '\'' || lex->len < 2 || lex->start[lex->len - 1] != '\'' ||
+            (pred->op != OP_EQ && pred->op != OP_NE))
+            return -1;
+        memset(pred->text, 0, sizeof(pred->text));
+        pred->text_len = 0;
+        for (p = lex->start + 1; p < lex->start + lex->len - 1; p++) {
+            if (*p == '\'')
+                p++;  // Doubled quote
+            if (pred->text_len < PROCESS_NAME_LEN)
+                pred->text[pred->text_len] = *p;
+            pred->text_len++;
+        }
+        return 0;
+    }
+
+    if (*lex->start == '-') {
+        negative = 1;
+        k_NextToken(lex);
+    }
+    if (!isdigit((unsigned char) *lex->start) || lex->len > 18)
+        return -1;
+    pred->value = strtoll(lex->start, NULL, 10) * (negative ? -1 : 1);
+    return 0;
+}
+
+/* Parse sql into q, FAST_FALLBACK unless it is a simple query over process */
+int k_ParseFastQuery(const char* sql, k_FastQuery* q)
+{
+    k_Lexer lex = {sql, 0};
+    int i;
+
+    memset(q, 0, sizeof(*q));
+    q->group_col = -1;
+    q->limit = -1;
+
+    k_NextToken(&lex);
+    if (!k_IsToken(&lex, "SELECT"))
+        return FAST_FALLBACK;
+
+    do {
+        k_FastItem* item = &q->items[q->num_items];
+
+        k_NextToken(&lex);
+        if (k_IsToken(&lex, "*")) {
+            for (i = 0; i < NUM_PROCESS_COLUMNS; i++) {
+                if (q->num_items == MAX_FAST_ITEMS)
+                    return FAST_FALLBACK;
+                item = &q->items[q->num_items++];
+                item->kind = FAST_COLUMN;
+                item->col = i;
+                item->name = k_ProcessColumnNames[i];
+                item->name_len = strlen(item->name);
+            }
+            k_NextToken(&lex);
+            continue;
+        }
+
+        if (q->num_items == MAX_FAST_ITEMS || k_ParseFastExpr(&lex, item) == -1)
+            return FAST_FALLBACK;
+        q->num_items++;
+        q->aggregate |= item->kind != FAST_COLUMN;
+        if (item->kind == FAST_SUM || item->kind == FAST_AVG)
+            if (item->col == PROCESS_COLUMN_NAME)
+                return FAST_FALLBACK;
+
+        k_NextToken(&lex);
+        if (k_IsToken(&lex, "AS"))
+            k_NextToken(&lex);
+        if ((isalpha((unsigned char) *lex.start) || *lex.start == '_') && !k_IsClause(&lex)) {
+            item->name = lex.start;
+            item->name_len = lex.len;
+            k_NextToken(&lex);
+        }
+    } while (*lex.start == ',');
+
+    if (!k_IsToken(&lex, "FROM") || (k_NextToken(&lex), !k_IsToken(&lex, "process")))
+        return FAST_FALLBACK;
+    k_NextToken(&lex);
+
+    if (k_IsToken(&lex, "WHERE")) {
+        do {
+            k_FastPredicate* pred = &q->predicates[q->num_predicates];
+
+            k_NextToken(&lex);
+            if (q->num_predicates == MAX_FAST_PREDICATES || (pred->col = k_FastColumn(&lex)) == -1)
+                return FAST_FALLBACK;
+
+            k_NextToken(&lex);
+            if (k_IsToken(&lex, "==") || k_IsToken(&lex, "="))
+                pred->op = OP_EQ;
+            else if (k_IsToken(&lex, "!=") || k_IsToken(&lex, "<>"))
+                pred->op = OP_NE;
+            else {
+                for (pred->op = OP_LT; pred->op <= OP_GE; pred->op++)
+                    if (k_IsToken(&lex, k_OperatorNames[pred->op]))
+                        break;
+                if (pred->op > OP_GE)
+                    return FAST_FALLBACK;
+            }
+
+            k_NextToken(&lex);
+            if (k_ParseFastLiteral(&lex, pred) == -1)
+                return FAST_FALLBACK;
+            q->num_predicates++;
+            k_NextToken(&lex);
+        } while (k_IsToken(&lex, "AND"));
+    }
+
+    if (k_IsToken(&lex, "GROUP")) {
+        if (k_NextToken(&lex), !k_IsToken(&lex, "BY"))
+            return FAST_FALLBACK;
+        k_NextToken(&lex);
+        if ((q->group_col = k_FastColumn(&lex)) == -1)
+            return FAST_FALLBACK;
+        q->aggregate = 1;
+        k_NextToken(&lex);
+    }
+
+    /* Without a GROUP BY column to take them from, SQLite picks bare columns
+     * next to aggregates from an arbitrary row */
+    for (i = 0; i < q->num_items && q->aggregate; i++)
+        if (q->items[i].kind == FAST_COLUMN && q->items[i].col != q->group_col)
+            return FAST_FALLBACK;
+
+    if (k_IsToken(&lex, "ORDER")) {
+        if (k_NextToken(&lex), !k_IsToken(&lex, "BY"))
+            return FAST_FALLBACK;
+        do {
+            k_FastOrder* order = &q->order[q->num_order];
+            k_FastItem key;
+
+            k_NextToken(&lex);
+            if (q->num_order == MAX_FAST_ORDER)
+                return FAST_FALLBACK;
+            order->item = order->col = -1;
+
+            /* A result column by position, alias or expression, as in SQLite */
+            if (isdigit((unsigned char) *lex.start)) {
+                order->item = atoi(lex.start) - 1;
+                if (order->item < 0 || order->item >= q->num_items)
+                    return FAST_FALLBACK;
+            }
+            for (i = 0; i < q->num_items && order->item == -1; i++)
+                if (q->items[i].name_len == lex.len &&
+                    strncasecmp(q->items[i].name, lex.start, lex.len) == 0)
+                    order->item = i;
+            if (order->item == -1) {
+                if (k_ParseFastExpr(&lex, &key) == -1)
+                    return FAST_FALLBACK;
+                for (i = 0; i < q->num_items && order->item == -1; i++)
+                    if (q->items[i].kind == key.kind && q->items[i].col == key.col)
+                        order->item = i;
+                if (order->item == -1 && (q->aggregate || key.kind != FAST_COLUMN))
+                    return FAST_FALLBACK;
+                order->col = key.col;
+            }
+            if (order->item >= 0)
+                order->col = q->items[order->item].col;
+
+            k_NextToken(&lex);
+            if (k_IsToken(&lex, "DESC"))
+                order->desc = 1;
+            if (k_IsToken(&lex, "ASC") || k_IsToken(&lex, "DESC"))
+                k_NextToken(&lex);
+            q->num_order++;
+        } while (*lex.start == ',');
+    }
+
+    if (k_IsToken(&lex, "LIMIT")) {
+        k_FastPredicate limit = {PROCESS_COLUMN_PID};
+
+        k_NextToken(&lex);
+        if (k_ParseFastLiteral(&lex, &limit) == -1)
+            return FAST_FALLBACK;
+        q->limit = limit.value < 0 ? -1 : limit.value;  // Negative is no limit
+        k_NextToken(&lex);
+    }
+
+    if (*lex.start == ';')
+        k_NextToken(&lex);
+    return *lex.start == '\0' ? SQLITE_OK : FAST_FALLBACK;
+}
+
+/* Value of a result column of an aggregate query */
+typedef struct {
+    int type;  // SQLITE_INTEGER, SQLITE_FLOAT, SQLITE_TEXT (a name) or SQLITE_NULL
+    int64_t i;
+    double d;
+    int row;   // Whose name a text value is
+} k_Cell;
+
+/* State of an aggregate over one group */
+typedef struct {
+    int64_t value;
+    int64_t count;
+    int row;  // Of the min or max name
+} k_Accumulator;
+
+/* Filter rows into sel, the rows selected so far (every row if all), keeping
+ * those where test holds. The loops don't branch on test, so unpredictable
+ * predicates cost no mispredictions; they don't vectorize, as each store
+ * depends on the count kept so far. */
+#define FAST_FILTER(test)                       \
+    if (all) {                                  \
+        for (i = 0; i < num; i++) {             \
+            sel[k] = i;                         \
+            k += (test);                        \
+        }                                       \
+    } else {                                    \
+        for (j = 0; j < num; j++) {             \
+            i = sel[j];                         \
+            sel[k] = i;                         \
+            k += (test);                        \
+        }                                       \
+    }
+
+/* Apply pred to the num rows of sel (or the first num rows if all),
+ * returning how many are left at the start of sel */
+int k_FastFilter(k_Columns* cols, k_FastPredicate* pred, int* sel, int num, int all)
+{
+    int i, j, k = 0;
+
+    if (pred->col == PROCESS_COLUMN_NAME) {
+        char (*names)[PROCESS_NAME_LEN] = cols->names;
+        int eq = pred->op == OP_EQ;
+
+        if (pred->text_len >= PROCESS_NAME_LEN)  // Longer than any name
+            FAST_FILTER(!eq)
+        else
+            FAST_FILTER((memcmp(names[i], pred->text, PROCESS_NAME_LEN) == 0) == eq)
+        return k;
+    }
+
+    {
+        const int64_t* v = cols->ints[pred->col];
+        int64_t c = pred->value;
+
+        switch (pred->op) {
+        case OP_EQ: FAST_FILTER(v[i] == c) break;
+        case OP_NE: FAST_FILTER(v[i] != c) break;
+        case OP_LT: FAST_FILTER(v[i] <  c) break;
+        case OP_LE: FAST_FILTER(v[i] <= c) break;
+        case OP_GT: FAST_FILTER(v[i] >  c) break;
+        case OP_GE: FAST_FILTER(v[i] >= c) break;
+        }
+    }
+    return k;
+}
+
+/* Compare column col of rows a and b */
+int k_CompareRows(k_Columns* cols, int col, int a, int b)
+{
+    int64_t x, y;
+
+    if (col == PROCESS_COLUMN_NAME)
+        return memcmp(cols->names[a], cols->names[b], PROCESS_NAME_LEN);
+    x = cols->ints[col][a];
+    y = cols->ints[col][b];
+    return x < y ? -1 : x > y;
+}
+
+/* Compare cells in SQLite's order: NULL, then numbers, then text */
+int k_CompareCells(k_Columns* cols, k_Cell* a, k_Cell* b)
+{
+    int rank_a = a->type == SQLITE_NULL ? 0 : a->type == SQLITE_TEXT ? 2 : 1;
+    int rank_b = b->type == SQLITE_NULL ? 0 : b->type == SQLITE_TEXT ? 2 : 1;
+    double x, y;
+
+    if (rank_a != rank_b || rank_a == 0)
+        return rank_a - rank_b;
+    if (rank_a == 2)
+        return k_CompareRows(cols, PROCESS_COLUMN_NAME, a->row, b->row);
+    if (a->type == SQLITE_INTEGER && b->type == SQLITE_INTEGER)
+        return a->i < b->i ? -1 : a->i > b->i;
+    x = a->type == SQLITE_INTEGER ? a->i : a->d;
+    y = b->type == SQLITE_INTEGER ? b->i : b->d;
+    return x < y ? -1 : x > y;
+}
+
+/* What qsort_r compares result rows with */
+typedef struct {
+    k_FastQuery* q;
+    k_Columns* cols;
+    k_Cell* cells;  // Per group and item, for aggregate queries
+    int* rows;      // Representative row of each group
+} k_FastSort;
+
+/* Order rows (of the table, or groups of an aggregate query) by the ORDER BY
+ * keys, then by group key, then as scanned */
+int k_CompareResults(const void* pa, const void* pb, void* arg)
+{
+    k_FastSort* sort = arg;
+    k_FastQuery* q = sort->q;
+    int a = *(const int*) pa, b = *(const int*) pb;
+    int i, c = 0;
+
+    for (i = 0; i < q->num_order && c == 0; i++) {
+        k_FastOrder* order = &q->order[i];
+        if (!q->aggregate)
+            c = k_CompareRows(sort->cols, order->col, a, b);
+        else
+            c = k_CompareCells(sort->cols, &sort->cells[a * q->num_items + order->item],
+                               &sort->cells[b * q->num_items + order->item]);
+        if (order->desc)
+            c = -c;
+    }
+    if (c == 0 && q->aggregate && q->group_col != -1)
+        c = k_CompareRows(sort->cols, q->group_col, sort->rows[a], sort->rows[b]);
+    return c != 0 ? c : (a > b) - (a < b);
+}
+
+/* Move heap[i] down the heap of n results whose root sorts last */
+void k_SiftDown(int* heap, int n, int i, k_FastSort* sort)
+{
+    for (;;) {
+        int worst = i, child = 2 * i + 1, tmp;
+
+        if (child < n && k_CompareResults(&heap[child], &heap[worst], sort) > 0)
+            worst = child;
+        if (child + 1 < n && k_CompareResults(&heap[child + 1], &heap[worst], sort) > 0)
+            worst = child + 1;
+        if (worst == i)
+            return;
+        tmp = heap[i];
+        heap[i] = heap[worst];
+        heap[worst] = tmp;
+        i = worst;
+    }
+}
+
+/* Sort the first limit of the num results in order, keeping a heap of the
+ * best limit seen so far instead of sorting all of them */
+void k_FastTopN(int* order, int num, int limit, k_FastSort* sort)
+{
+    int i;
+
+    if (limit == 0)
+        return;
+    for (i = limit / 2 - 1; i >= 0; i--)
+        k_SiftDown(order, limit, i, sort);
+    for (i = limit; i < num; i++) {
+        if (k_CompareResults(&order[i], &order[0], sort) < 0) {
+            order[0] = order[i];
+            k_SiftDown(order, limit, 0, sort);
+        }
+    }
+    qsort_r(order, limit, sizeof(int), k_CompareResults, sort);
+}
+
+/* Hash of column col of row */
+uint64_t k_HashRow(k_Columns* cols, int col, int row)
+{
+    uint64_t halves[2];
+
+    if (col != PROCESS_COLUMN_NAME)
+        return k_Mix64(cols->ints[col][row]);
+    memcpy(halves, cols->names[row], sizeof(halves));
+    return k_Mix64(halves[0] ^ k_Mix64(halves[1]));
+}
+
+/* Assign each of the num rows in sel the index of its group in groups, with
+ * the first row of every group in rows. Returns the number of groups, or -1
+ * if out of memory. */
+int k_FastGroup(k_Columns* cols, int col, int* sel, int num, int* groups, int** rows)
+{
+    int num_groups = 0, cap = 16, j;
+    size_t mask = 15;
+    int* slots;  // Group + 1 per hash slot, 0 if empty
+
+    while (mask + 1 < (size_t) num * 2)
+        mask = mask * 2 + 1;
+    slots = calloc(mask + 1, sizeof(int));
+    *rows = malloc(cap * sizeof(int));
+    if (slots == NULL || *rows == NULL) {
+        free(slots);
+        return -1;
+    }
+
+    for (j = 0; j < num; j++) {
+        int row = sel[j];
+        size_t h = k_HashRow(cols, col, row) & mask;
+
+        while (slots[h] && k_CompareRows(cols, col, (*rows)[slots[h] - 1], row) != 0)
+            h = (h + 1) & mask;
+
+        if (!slots[h]) {
+            if (num_groups == cap) {
+                int* grown = realloc(*rows, 2 * cap * sizeof(int));
+                if (grown == NULL) {
+                    free(slots);
+                    return -1;
+                }
+                *rows = grown;
+                cap *= 2;
+            }
+            (*rows)[num_groups] = row;
+            slots[h] = ++num_groups;
+        }
+        groups[j] = slots[h] - 1;
+    }
+
+    free(slots);
+    return num_groups;
+}
+
+/* Accumulate item over the num rows of sel, into acc[group * stride] for the
+ * group of each row (all 0 if groups is NULL). -1 if a sum overflows. */
+int k_FastAccumulate(k_Columns* cols, k_FastItem* item, int* sel, int num, int* groups,
+                     k_Accumulator* acc, int stride)
+{
+    const int64_t* v = item->col >= 0 ? cols->ints[item->col] : NULL;
+    int j;
+
+    for (j = 0; j < num; j++) {
+        k_Accumulator* a = &acc[(groups ? groups[j] : 0) * stride];
+        int row = sel[j];
+
+        switch (item->kind) {
+        case FAST_SUM:
+        case FAST_AVG:
+            if (__builtin_add_overflow(a->value, v[row], &a->value))
+                return -1;
+            break;
+        case FAST_MIN:
+        case FAST_MAX:
+            if (item->col == PROCESS_COLUMN_NAME) {
+                int c = a->count ? k_CompareRows(cols, item->col, row, a->row) : 0;
+                if (!a->count || (item->kind == FAST_MIN ? c < 0 : c > 0))
+                    a->row = row;
+            } else if (!a->count || (item->kind == FAST_MIN ? v[row] < a->value :
+                                                              v[row] > a->value)) {
+                a->value = v[row];
+            }
+            break;
+        }
+        a->count++;
+    }
+    return 0;
+}
+
+/* Result of item for a group with accumulator acc and first row row */
+k_Cell k_FastCell(k_Columns* cols, k_FastItem* item, k_Accumulator* acc, int row)
+{
+    k_Cell cell = {SQLITE_NULL};
+
+    switch (item->kind) {
+    case FAST_COLUMN:
+        cell.type = item->col == PROCESS_COLUMN_NAME ? SQLITE_TEXT : SQLITE_INTEGER;
+        cell.i = item->col == PROCESS_COLUMN_NAME ? 0 : cols->ints[item->col][row];
+        cell.row = row;
+        break;
+    case FAST_COUNT:
+        cell.type = SQLITE_INTEGER;
+        cell.i = acc->count;
+        break;
+    case FAST_AVG:
+        if (acc->count > 0) {
+            cell.type = SQLITE_FLOAT;
+            cell.d = (double) acc->value / acc->count;
+        }
+        break;
+    default:
+        if (acc->count > 0) {
+            cell.type = item->col == PROCESS_COLUMN_NAME ? SQLITE_TEXT : SQLITE_INTEGER;
+            cell.i = acc->value;
+            cell.row = acc->row;
+        }
+        break;
+    }
+    return cell;
+}
+
+/* Bind column col of row to parameter i of stmt */
+void k_BindColumn(sqlite3_stmt* stmt, int i, k_Columns* cols, int col, int row)
+{
+    if (col == PROCESS_COLUMN_NAME)
+        sqlite3_bind_text(stmt, i, cols->names[row],
+                          strnlen(cols->names[row], PROCESS_NAME_LEN), SQLITE_STATIC);
+    else
+        sqlite3_bind_int64(stmt, i, cols->ints[col][row]);
+}
+
+/* Prepare a SELECT of one parameter per result column of q, named like
+ * SQLite would name them, for the output formats to read rows from */
+int k_PrepareFastOutput(sqlite3* db, k_FastQuery* q, sqlite3_stmt** stmt)
+{
+    k_Writer sql = {-1};
+    int i, j, rc;
+
+    k_WriteStr(&sql, "SELECT ");
+    for (i = 0; i < q->num_items; i++) {
+        k_WriteStr(&sql, i ? ", ?" : "?");
+        k_WriteInt(&sql, i + 1);
+        k_WriteStr(&sql, " AS \"");
+        for (j = 0; j < q->items[i].name_len; j++) {
+            if (q->items[i].name[j] == '"')
+                k_WriteBytes(&sql, "\"", 1);
+            k_WriteBytes(&sql, &q->items[i].name[j], 1);
+        }
+        k_WriteBytes(&sql, "\"", 1);
+    }
+    k_WriteZeros(&sql, 1);
+
+    rc = sql.error ? SQLITE_NOMEM : sqlite3_prepare_v2(db, sql.buf, -1, stmt, NULL);
+    k_WriterFree(&sql);
+    return rc;
+}
+
+/* Sort the num_results results in order (rows of sort->cols, or groups
+ * with their cells in sort->cells for aggregate queries), then write those
+ * within the LIMIT to out in format. FAST_FALLBACK if the query has to run in
+ * SQLite after all. */
+int k_WriteFastResults(sqlite3* db, k_FastSort* sort, int* order, int num_results,
+                       k_Format* format, k_Writer* out)
+{
+    k_FastQuery* q = sort->q;
+    k_Columns* cols = sort->cols;
+    sqlite3_stmt* stmt = NULL;
+    int i, j, rc;
+
+    /* Groups come out in key order, like SQLite's sorter-based GROUP BY.
+     * Under a LIMIT, only the results kept are sorted. */
+    if (q->limit >= 0 && q->limit < num_results) {
+        if (q->num_order > 0 || (q->aggregate && q->group_col != -1))
+            k_FastTopN(order, num_results, q->limit, sort);
+        num_results = q->limit;
+    } else if (q->num_order > 0 || (q->aggregate && q->group_col != -1)) {
+        qsort_r(order, num_results, sizeof(int), k_CompareResults, sort);
+    }
+
+    /* Footers (Arrow's schema) type empty results from declared column
+     * types, which only the SQLite table has */
+    if (num_results == 0 && format->footer != NULL)
+        return FAST_FALLBACK;
+
+    if ((rc = k_PrepareFastOutput(db, q, &stmt)) != SQLITE_OK)
+        return rc;
+
+    if (format->header != NULL)
+        format->header(out, stmt);
+
+    for (j = 0; j < num_results && rc == SQLITE_OK; j++) {
+        for (i = 0; i < q->num_items; i++) {
+            k_Cell* cell;
+
+            if (!q->aggregate) {
+                k_BindColumn(stmt, i + 1, cols, q->items[i].col, order[j]);
+                continue;
+            }
+
+            cell = &sort->cells[order[j] * q->num_items + i];
+            switch (cell->type) {
+            case SQLITE_INTEGER:
+                sqlite3_bind_int64(stmt, i + 1, cell->i);
+                break;
+            case SQLITE_FLOAT:
+                sqlite3_bind_double(stmt, i + 1, cell->d);
+                break;
+            case SQLITE_TEXT:
+                k_BindColumn(stmt, i + 1, cols, PROCESS_COLUMN_NAME, cell->row);
+                break;
+            default:
+                sqlite3_bind_null(stmt, i + 1);
+                break;
+            }
+        }
+
+        if (sqlite3_step(stmt) != SQLITE_ROW)
+            rc = sqlite3_errcode(db);
+        else if (format->row(out, stmt))
+            rc = SQLITE_ABORT;
+        sqlite3_reset(stmt);
+    }
+
+    if (format->footer != NULL)
+        format->footer(out, stmt);
+
+    sqlite3_finalize(stmt);
+    return rc;
+}
+
+/* Run q over cols, writing its rows to out in format. FAST_FALLBACK if it
+ * has to run in SQLite after all. */
+int k_RunFastQuery(sqlite3* db, k_FastQuery* q, k_Columns* cols, k_Format* format,
+                   k_Writer* out)
+{
+    int* sel = malloc((cols->num_rows + 1) * sizeof(int));
+    int* groups = NULL;
+    int* rows = NULL;
+    int* order = NULL;
+    k_Accumulator* acc = NULL;
+    k_Cell* cells = NULL;
+    k_FastSort sort = {q, cols};
+    int i, j, num = cols->num_rows, num_results, rc = SQLITE_NOMEM;
+
+    if (sel == NULL)
+        goto done;
+
+    /* Filter a column at a time; without predicates every row is selected */
+    if (q->num_predicates == 0)
+        for (i = 0; i < num; i++)
+            sel[i] = i;
+    for (i = 0; i < q->num_predicates; i++)
+        num = k_FastFilter(cols, &q->predicates[i], sel, num, i == 0);
+
+    if (!q->aggregate) {
+        order = sel;
+        num_results = num;
+    } else {
+        int num_groups = 1;
+
+        if (q->group_col != -1) {
+            if ((groups = malloc((num + 1) * sizeof(int))) == NULL)
+                goto done;
+            if ((num_groups = k_FastGroup(cols, q->group_col, sel, num, groups, &rows)) == -1)
+                goto done;
+        }
+
+        acc = calloc((size_t) num_groups * q->num_items, sizeof(k_Accumulator));
+        cells = malloc((size_t) num_groups * q->num_items * sizeof(k_Cell));
+        order = malloc((num_groups + 1) * sizeof(int));
+        if (acc == NULL || cells == NULL || order == NULL)
+            goto done;
+
+        for (i = 0; i < q->num_items; i++) {
+            if (k_FastAccumulate(cols, &q->items[i], sel, num, groups, acc + i,
+                                 q->num_items) == -1) {
+                rc = FAST_FALLBACK;  // Integer overflow, which SQLite reports
+                goto done;
+            }
+        }
+
+        for (j = 0; j < num_groups; j++) {
+            order[j] = j;
+            for (i = 0; i < q->num_items; i++)
+                cells[j * q->num_items + i] = k_FastCell(cols, &q->items[i],
+                    &acc[j * q->num_items + i], rows ? rows[j] : 0);
+        }
+        num_results = q->group_col == -1 || num > 0 ? num_groups : 0;
+        sort.cells = cells;
+        sort.rows = rows;
+    }
+
+    rc = k_WriteFastResults(db, &sort, order, num_results, format, out);
+
+done:
+    if (order != sel)
+        free(order);
+    free(sel);
+    free(groups);
+    free(rows);
+    free(acc);
+    free(cells);
+    return rc;
+}
+//
+//--------------------------------------------------------------------------//
+
+//---------------------------- QUERY EXECUTION -----------------------------//
+//
+/* Step stmt to completion, writing its rows to out in format */
+int k_StepQuery(sqlite3_stmt* stmt, k_Format* format, k_Writer* out)
+{
+    int rc;
+
+    if (format->header != NULL && sqlite3_column_count(stmt) > 0)
+        format->header(out, stmt);
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (format->row(out, stmt)) {
+            rc = SQLITE_ABORT;
+            break;
+        }
+    }
+
+    if (format->footer != NULL && sqlite3_column_count(stmt) > 0)
+        format->footer(out, stmt);
+
+    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+/* Execute query through the result and statement caches. In snapshot mode,
+ * the tables each statement reads are populated before it runs. */
+int k_ExecuteQuery(sqlite3* db, char* query, k_Format* format)
+{
+    sqlite3_stmt* stmt = NULL;
+    char* sql = k_NormalizeQuery(query);
+    const char* tail = sql;
+    int i, cached, columnar = 0, rc = SQLITE_OK;
+    int cache_result = snapshot_mode && result_cache_bytes > 0;
+    unsigned int tables = 0;  // Read by the query
+    k_Writer result = {-1};
+    k_FastQuery fast;
+
+    if (sql == NULL)
+        return SQLITE_NOMEM;
+
+    query_generation = 0;
+    query_age_ms = 0;
+
+    if (cache_result) {
+        if (k_WriteCachedResult(sql, format, &stdout_writer))
+            return k_WriterFlush(&stdout_writer) == 0 ? SQLITE_OK : SQLITE_IOERR;
+        stdout_writer.copy = &result;
+        stdout_writer.copy_limit = result_cache_bytes;
+    }
+
+    /* Simple queries over a snapshot of process run on the columnar copy,
+     * unless a write left the SQLite table different from it */
+    if (snapshot_mode && !background_ms && fp != -1 &&
+        (process_columns.populated || !k_Tables[0].populated) &&
+        k_ParseFastQuery(sql, &fast) == SQLITE_OK) {
+        rc = k_PopulateColumns(&process_columns, fp, &query_arena);
+        query_generation = process_columns.generation;
+        query_age_ms = k_NowMs() - process_columns.populated_at;
+        if (rc == SQLITE_OK)
+            rc = k_RunFastQuery(db, &fast, &process_columns, format, &stdout_writer);
+        k_WriterFlush(&stdout_writer);
+        if (rc == FAST_FALLBACK)
+            rc = SQLITE_OK;
+        else
+            columnar = 1;
+    }
+
+    while (rc == SQLITE_OK && !columnar && *tail != '\0') {
+        if (*tail == ' ') {
+            tail++;
+            continue;
+        }
+
+        rc = k_PrepareCached(db, tail, &stmt, &tail, &cached);
+        if (rc != SQLITE_OK)
+            break;
+        if (stmt == NULL)  // Whitespace or comment
+            continue;
+
+        for (i = 0; i < NUM_TABLES; i++)
+            if (k_Tables[i].referenced)
+                tables |= 1u << i;
+        if (outside_snapshot || !sqlite3_stmt_readonly(stmt))
+            cache_result = 0;
+
+        if (snapshot_mode)
+            rc = k_PopulateReferencedTables(db);
+        if (rc == SQLITE_OK)
+            rc = k_StepQuery(stmt, format, &stdout_writer);
+        k_WriterFlush(&stdout_writer);
+        if (!sqlite3_stmt_readonly(stmt))
+            process_columns.populated = 0;  // May no longer match the tables
+
+        if (!cached) {
+            if (!sqlite3_stmt_readonly(stmt)) {
+                k_ClearStatementCache();  // May have changed the schema
+                k_ClearResultCache();
+            }
+            sqlite3_finalize(stmt);
+        } else {
+            sqlite3_reset(stmt);
+        }
+    }
+
+    if (rc != SQLITE_OK && rc != SQLITE_IOERR)
+        fprintf(stdout, MAKE_RED "SQL error: %s\n" RESET_COLOR, sqlite3_errmsg(db));
+
+    stdout_writer.copy = NULL;
+    if (cache_result && rc == SQLITE_OK && (tables != 0 || columnar))
+        k_StoreResult(sql, format, tables, columnar, &result);
+    k_WriterFree(&result);
+
+    return rc;
+}
+//
+//--------------------------------------------------------------------------//
+
+//--------------------------- PARALLEL EXECUTION ---------------------------//
+//
+/* With --jobs N, the queries given on the command line run on N worker
+ * threads against one snapshot. The snapshot is collected once, then every
+ * worker copies it into a private in-memory database with the backup API
+ * (sqlite3_serialize needs SQLite 3.23), so workers never contend on a shared
+ * connection. Results are printed in query order. */
+typedef struct {
+    sqlite3* snapshot;  // Source database, read-only while workers run
+    char** queries;
+    char** results;     // Output of each query, NULL until it has run
+    size_t* result_lens;
+    int num_queries;
+    int next_query;     // Next query to hand out to a worker
+    pthread_mutex_t mutex;
+    pthread_cond_t result_ready;
+} k_Batch;
+
+/* Populate every snapshot table read by any of queries, in snapshot mode */
+int k_PopulateTablesForQueries(sqlite3* db, char** queries, int num_queries)
+{
+    int i, rc = SQLITE_OK;
+
+    for (i = 0; i < num_queries && rc == SQLITE_OK; i++) {
+        const char* tail = queries[i];
+        sqlite3_stmt* stmt;
+
+        while (rc == SQLITE_OK && *tail != '\0') {
+            if (k_PrepareRecordingTables(db, tail, &stmt, &tail) != SQLITE_OK)
+                break;  // Reported when the worker runs the query
+            sqlite3_finalize(stmt);
+            rc = k_PopulateReferencedTables(db);
+        }
+    }
+
+    return rc;
+}
+
+/* Run every statement of query on db, writing rows and errors to out */
+int k_RunStatements(sqlite3* db, const char* query, k_Writer* out)
+{
+    sqlite3_stmt* stmt = NULL;
+    const char* tail = query;
+    int rc = SQLITE_OK;
+
+    while (rc == SQLITE_OK && *tail != '\0') {
+        rc = sqlite3_prepare_v2(db, tail, -1, &stmt, &tail);
+        if (rc != SQLITE_OK || stmt == NULL)
+            continue;
+        rc = k_StepQuery(stmt, output_format, out);
+        sqlite3_finalize(stmt);
+    }
+
+    if (rc != SQLITE_OK) {
+        k_WriteStr(out, MAKE_RED "SQL error: ");
+        k_WriteStr(out, sqlite3_errmsg(db));
+        k_WriteStr(out, "\n" RESET_COLOR);
+    }
+
+    return rc;
+}
+
+/* Worker thread, copying the snapshot then running queries until none are
+ * left. If the copy failed, its error is every query's result. */
+void* k_BatchWorker(void* arg)
+{
+    k_Batch* batch = arg;
+    sqlite3* db = NULL;
+    sqlite3_backup* backup;
+    int rc;
+
+    /* The snapshot connection has no mutex of its own, so copies take turns */
+    rc = sqlite3_open_v2(":memory:", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE |
+                         SQLITE_OPEN_NOMUTEX, NULL);
+    if (rc == SQLITE_OK) {
+        k_RegisterFunctions(db);
+        pthread_mutex_lock(&batch->mutex);
+        backup = sqlite3_backup_init(db, "main", batch->snapshot, "main");
+        if (backup == NULL) {
+            rc = sqlite3_errcode(db);
+        } else {
+            sqlite3_backup_step(backup, -1);
+            rc = sqlite3_backup_finish(backup);
+        }
+        pthread_mutex_unlock(&batch->mutex);
+    }
+
+    while (1) {
+        k_Writer out = {-1};
+        int i;
+
+        pthread_mutex_lock(&batch->mutex);
+        i = batch->next_query++;
+        pthread_mutex_unlock(&batch->mutex);
+        if (i >= batch->num_queries)
+            break;
+
+        if (rc == SQLITE_OK) {
+            k_RunStatements(db, batch->queries[i], &out);
+        } else {
+            k_WriteStr(&out, MAKE_RED "Can't copy snapshot: ");
+            k_WriteStr(&out, sqlite3_errmsg(db));
+            k_WriteStr(&out, "\n" RESET_COLOR);
+        }
+
+        pthread_mutex_lock(&batch->mutex);
+        batch->results[i] = out.buf ? out.buf : strdup("");
+        batch->result_lens[i] = out.len;
+        pthread_cond_broadcast(&batch->result_ready);
+        pthread_mutex_unlock(&batch->mutex);
+    }
+
+    sqlite3_close(db);
+    return NULL;
+}
+
+/* Run queries on num_jobs workers against a single snapshot in db */
+int k_ExecuteBatch(sqlite3* db, char** queries, int num_queries, int num_jobs)
+{
+    k_Batch batch;
+    pthread_t* workers;
+    int i, num_started = 0, num_workers = num_jobs < num_queries ? num_jobs : num_queries;
+
+    if (snapshot_mode &&
+        k_PopulateTablesForQueries(db, queries, num_queries) != SQLITE_OK)
+        return SQLITE_ERROR;
+
+    memset(&batch, 0, sizeof(batch));
+    batch.snapshot = db;
+    batch.queries = queries;
+    batch.num_queries = num_queries;
+    batch.results = calloc(num_queries, sizeof(char*));
+    batch.result_lens = calloc(num_queries, sizeof(size_t));
+    workers = calloc(num_workers, sizeof(pthread_t));
+    if (batch.results == NULL || batch.result_lens == NULL || workers == NULL) {
+        fprintf(stderr, MAKE_RED "SQL error: %s\n" RESET_COLOR, sqlite3_errstr(SQLITE_NOMEM));
+        free(workers);
+        free(batch.result_lens);
+        free(batch.results);
+        return SQLITE_NOMEM;
+    }
+    pthread_mutex_init(&batch.mutex, NULL);
+    pthread_cond_init(&batch.result_ready, NULL);
+
+    for (i = 0; i < num_workers; i++) {
+        if (pthread_create(&workers[num_started], NULL, k_BatchWorker, &batch) != 0)
+            break;
+        num_started++;
+    }
+
+    /* Without any worker thread, run every query here before printing */
+    if (num_started == 0)
+        k_BatchWorker(&batch);
+
+    /* Print results in order as they become available */
+    for (i = 0; i < num_queries; i++) {
+        pthread_mutex_lock(&batch.mutex);
+        while (batch.results[i] == NULL)
+            pthread_cond_wait(&batch.result_ready, &batch.mutex);
+        pthread_mutex_unlock(&batch.mutex);
+
+        k_WriteBytes(&stdout_writer, batch.results[i], batch.result_lens[i]);
+        free(batch.results[i]);
+    }
+    k_WriterFlush(&stdout_writer);
+
+    for (i = 0; i < num_started; i++)
+        pthread_join(workers[i], NULL);
+
+    pthread_cond_destroy(&batch.result_ready);
+    pthread_mutex_destroy(&batch.mutex);
+    free(workers);
+    free(batch.result_lens);
+    free(batch.results);
+
+    return SQLITE_OK;
+}
+//
+//--------------------------------------------------------------------------//
+
+//---------------------------- SNAPSHOT SHARING ----------------------------//
+//
+/* With --publish PATH, kquery serves snapshots to other local processes over
+ * a Unix socket instead of running queries. Each snapshot is written once
+ * into a sealed memfd, whose descriptor is passed to every reader with
+ * SCM_RIGHTS. Readers (--connect PATH) open it read-only and memory-map it,
+ * so one collection serves any number of readers without copying. */
+
+/* VFS opening /proc/self/fd/N as given. Newer SQLite versions resolve
+ * symlinks, which turns it into the unopenable "/memfd:... (deleted)", and
+ * open files with O_NOFOLLOW. The system call table is shared by every unix
+ * VFS, copies included, so the open override is only installed around
+ * opening the descriptor and the original restored afterwards. */
+sqlite3_vfs fd_vfs;
+sqlite3_syscall_ptr vfs_open;
+
+int k_FdFullPathname(sqlite3_vfs* vfs, const char* name, int len, char* out)
+{
+    sqlite3_snprintf(len, out, "%s", name);
+    return SQLITE_OK;
+}
+
+int k_FdOpen(const char* path, int flags, int mode)
+{
+    if (strncmp(path, "/proc/self/fd/", 14) == 0)
+        flags &= ~O_NOFOLLOW;
+    return ((int (*)(const char*, int, int)) vfs_open)(path, flags, mode);
+}
+
+/* Open the file descriptor fd of this process as a database */
+int k_OpenFd(int fd, sqlite3** db, int flags)
+{
+    char path[64];
+    int rc;
+
+    if (fd_vfs.zName == NULL) {
+        fd_vfs = *sqlite3_vfs_find(NULL);
+        fd_vfs.zName = "kquery_fd";
+        fd_vfs.xFullPathname = k_FdFullPathname;
+        if (fd_vfs.iVersion >= 3)
+            vfs_open = fd_vfs.xGetSystemCall(&fd_vfs, "open");
+        sqlite3_vfs_register(&fd_vfs, 0);
+    }
+
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    if (vfs_open != NULL)
+        fd_vfs.xSetSystemCall(&fd_vfs, "open", (sqlite3_syscall_ptr) k_FdOpen);
+    rc = sqlite3_open_v2(path, db, flags, fd_vfs.zName);
+    if (vfs_open != NULL)
+        fd_vfs.xSetSystemCall(&fd_vfs, "open", vfs_open);
+    return rc;
+}
+
+/* Write the tables of db into a new sealed memfd, returning it or -1 */
+int k_ExportSnapshot(sqlite3* db)
+{
+    sqlite3* dest = NULL;
+    sqlite3_backup* backup;
+    int rc = SQLITE_ERROR;
+    int fd = memfd_create("kquery_snapshot", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+    if (fd == -1) {
+        fprintf(stderr, MAKE_RED "Can't create memfd: %s\n" RESET_COLOR, strerror(errno));
+        return -1;
+    }
+
+    /* SQLite can't create a journal next to /proc/self/fd/N, and doesn't
+     * need one for a file nobody else can see yet */
+    if (k_OpenFd(fd, &dest, SQLITE_OPEN_READWRITE) == SQLITE_OK &&
+        sqlite3_exec(dest, "PRAGMA journal_mode=OFF", NULL, 0, NULL) == SQLITE_OK) {
+        backup = sqlite3_backup_init(dest, "main", db, "main");
+        if (backup != NULL) {
+            sqlite3_backup_step(backup, -1);
+            rc = sqlite3_backup_finish(backup);
+        }
+    }
+    if (rc != SQLITE_OK)
+        fprintf(stderr, MAKE_RED "Can't export snapshot: %s\n" RESET_COLOR,
+                sqlite3_errmsg(dest));
+    sqlite3_close(dest);
+
+    if (rc == SQLITE_OK &&
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1) {
+        fprintf(stderr, MAKE_RED "Can't seal memfd: %s\n" RESET_COLOR, strerror(errno));
+        rc = SQLITE_ERROR;
+    }
+
+    if (rc != SQLITE_OK) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Pass fd over the Unix socket sock */
+int k_SendFd(int sock, int fd)
+{
+    char byte = 0, control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == -1 ? -1 : 0;
+}
+
+/* Receive a file descriptor from the Unix socket sock, -1 on error */
+int k_RecvFd(int sock)
+{
+    char byte, control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+    int fd = -1;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) <= 0)
+        return -1;
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+    return fd;
+}
+
+/* Fill addr with the Unix socket address at path */
+int k_SocketAddress(struct sockaddr_un* addr, char* path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, MAKE_RED "Socket path too long: %s\n" RESET_COLOR, path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/* Serve snapshots of every table in db on the Unix socket at path. A new
+ * snapshot is collected when a reader connects and the current one is more
+ * than staleness_ms old. */
+int k_PublishSnapshots(sqlite3* db, char* path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    long long exported_at = 0;
+    int i, client, server, snapshot_fd = -1;
+
+    if (k_SocketAddress(&addr, path) == -1)
+        return -1;
+
+    /* Replace a socket left behind by an earlier publisher, but never
+     * anything else a mistyped path names */
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server == -1 ||
+        bind(server, (struct sockaddr*) &addr, sizeof(addr)) == -1 ||
+        chmod(path, 0666) == -1 ||  // Readers don't need to be root
+        listen(server, 16) == -1) {
+        fprintf(stderr, MAKE_RED "Can't listen on %s: %s\n" RESET_COLOR, path, strerror(errno));
+        close(server);
+        return -1;
+    }
+
+    while (1) {
+        client = accept(server, NULL, NULL);
+        if (client == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+
+        if (snapshot_fd == -1 || k_NowMs() - exported_at > staleness_ms) {
+            int fd = -1, rc;
+
+            k_ResetSnapshotTables(db);
+            for (i = 0; i < NUM_TABLES; i++)
+                k_Tables[i].referenced = 1;
+
+            /* Keep serving the last complete snapshot rather than a partial
+             * one, and try again for the next reader */
+            if ((rc = k_PopulateReferencedTables(db)) == SQLITE_OK)
+                fd = k_ExportSnapshot(db);
+            else
+                fprintf(stderr, MAKE_RED "Can't collect snapshot: %s\n" RESET_COLOR,
+                        sqlite3_errstr(rc));
+            k_ArenaReset(&query_arena);
+
+            if (fd != -1) {
+                if (snapshot_fd != -1)
+                    close(snapshot_fd);  // Readers hold their own copies
+                snapshot_fd = fd;
+                exported_at = k_NowMs();
+            }
+        }
+
+        if (snapshot_fd != -1)
+            k_SendFd(client, snapshot_fd);
+        close(client);
+    }
+
+    fprintf(stderr, MAKE_RED "Can't accept on %s: %s\n" RESET_COLOR, path, strerror(errno));
+    close(server);
+    if (snapshot_fd != -1)
+        close(snapshot_fd);
+    unlink(path);
+    return -1;
+}
+
+/* Open the snapshot published on the Unix socket at path, read-only and
+ * memory-mapped */
+sqlite3* k_ConnectSnapshot(char* path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    sqlite3* db = NULL;
+    char pragma[64];
+    int sock, fd = -1;
+
+    if (k_SocketAddress(&addr, path) == -1)
+        return NULL;
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock != -1 && connect(sock, (struct sockaddr*) &addr, sizeof(addr)) == 0)
+        fd = k_RecvFd(sock);
+    close(sock);
+
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, MAKE_RED "Can't get snapshot from %s\n" RESET_COLOR, path);
+        if (fd != -1)
+            close(fd);
+        return NULL;
+    }
+
+    if (k_OpenFd(fd, &db, SQLITE_OPEN_READONLY) != SQLITE_OK) {
+        fprintf(stderr, MAKE_RED "Can't open snapshot: %s\n" RESET_COLOR, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        db = NULL;
+    } else {
+        snprintf(pragma, sizeof(pragma), "PRAGMA mmap_size=%lld", (long long) st.st_size);
+        sqlite3_exec(db, pragma, NULL, 0, NULL);
+        k_RegisterFunctions(db);
+    }
+
+    close(fd);  // SQLite opened its own descriptor
+    return db;
+}
+//
+//--------------------------------------------------------------------------//
+
+//----------------------------- PARQUET EXPORT -----------------------------//
+//
+/* --export-parquet FILE [tables...] writes full snapshot tables as Parquet
+ * files, one row group per PARQUET_ROW_GROUP_ROWS rows, uncompressed. Each
+ * column chunk is a single data page. Columns with few distinct values (like
+ * name, state and priority) are dictionary encoded, with indices in the
+ * RLE/bit-packed hybrid encoding, and every chunk carries min/max and null
+ * count statistics. Page headers and file metadata are written with a small
+ * Thrift compact protocol encoder, so there are no dependencies. */
+#define PARQUET_ROW_GROUP_ROWS (1 << 20)
+#define PARQUET_MAX_DICT       65536
+
+/* Values from parquet.thrift */
+#define PARQUET_INT64      2
+#define PARQUET_DOUBLE     5
+#define PARQUET_BYTE_ARRAY 6
+
+#define PARQUET_PLAIN          0
+#define PARQUET_RLE            3
+#define PARQUET_RLE_DICTIONARY 8
+
+#define PARQUET_DATA_PAGE       0
+#define PARQUET_DICTIONARY_PAGE 2
+
+#define THRIFT_BOOL_TRUE  1
+#define THRIFT_BOOL_FALSE 2
+#define THRIFT_I32        5
+#define THRIFT_I64        6
+#define THRIFT_BINARY     8
+#define THRIFT_LIST       9
+#define THRIFT_STRUCT     12
+
+/* Thrift compact protocol encoder */
+typedef struct {
+    k_Writer* w;
+    int last_field[8];  // Last field id written in each open struct
+    int depth;
+} k_Thrift;
+
+void k_ThriftVarint(k_Writer* w, uint64_t v)
+{
+    char bytes[10];
+    int n = 0;
+
+    while (v >= 0x80) {
+        bytes[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    bytes[n++] = v;
+    k_WriteBytes(w, bytes, n);
+}
+
+void k_ThriftZigzag(k_Writer* w, int64_t v)
+{
+    k_ThriftVarint(w, ((uint64_t) v << 1) ^ (uint64_t) (v >> 63));
+}
+
+void k_ThriftField(k_Thrift* t, int id, int type)
+{
+    int delta = id - t->last_field[t->depth];
+    char header;
+
+    if (delta > 0 && delta <= 15) {
+        header = delta << 4 | type;
+        k_WriteBytes(t->w, &header, 1);
+    } else {
+        header = type;
+        k_WriteBytes(t->w, &header, 1);
+        k_ThriftZigzag(t->w, id);
+    }
+    t->last_field[t->depth] = id;
+}
+
+void k_ThriftI32(k_Thrift* t, int id, int32_t v)
+{
+    k_ThriftField(t, id, THRIFT_I32);
+    k_ThriftZigzag(t->w, v);
+}
+
+void k_ThriftI64(k_Thrift* t, int id, int64_t v)
+{
+    k_ThriftField(t, id, THRIFT_I64);
+    k_ThriftZigzag(t->w, v);
+}
+
+void k_ThriftBinary(k_Thrift* t, int id, const char* s, size_t len)
+{
+    k_ThriftField(t, id, THRIFT_BINARY);
+    k_ThriftVarint(t->w, len);
+    k_WriteBytes(t->w, s, len);
+}
+
+/* Start a struct: a field of struct type, or an element of a list if id is 0 */
+void k_ThriftBegin(k_Thrift* t, int id)
+{
+    if (id != 0)
+        k_ThriftField(t, id, THRIFT_STRUCT);
+    t->last_field[++t->depth] = 0;
+}
+
+void k_ThriftEnd(k_Thrift* t)
+{
+    k_WriteZeros(t->w, 1);
+    t->depth--;
+}
+
+/* Start a list field of n elements of elem_type, written by the caller */
+void k_ThriftList(k_Thrift* t, int id, int elem_type, int n)
+{
+    char header;
+
+    k_ThriftField(t, id, THRIFT_LIST);
+    if (n < 15) {
+        header = n << 4 | elem_type;
+        k_WriteBytes(t->w, &header, 1);
+    } else {
+        header = 0xf0 | elem_type;
+        k_WriteBytes(t->w, &header, 1);
+        k_ThriftVarint(t->w, n);
+    }
+}
+
+/* Column of a row group being collected */
+typedef struct {
+    const char* name;
+    int type;
+    int num_values;      // Including nulls
+    int null_count;
+    uint8_t* defined;    // Per value, 0 if null
+    uint32_t* indices;   // Per non-null value, into the dictionary
+    k_Writer values;     // Non-null values, PLAIN encoded
+    size_t min, max;     // Offsets of the smallest and largest values
+    k_Writer dict;       // Distinct values, PLAIN encoded
+    int dict_size;       // -1 once there are too many distinct values
+    int max_dict;        // Distinct values the dictionary can hold
+    size_t* dict_offsets;
+    int32_t* dict_slots; // Hash table of dictionary indices (2 * max_dict), -1 if empty
+} k_ParquetColumn;
+
+/* Bytes of the PLAIN encoded value at p, and where its data starts */
+size_t k_ParquetValue(k_ParquetColumn* col, const char* p, const char** data)
+{
+    uint32_t len;
+
+    if (col->type != PARQUET_BYTE_ARRAY) {
+        *data = p;
+        return 8;
+    }
+    memcpy(&len, p, 4);
+    *data = p + 4;
+    return len;
+}
+
+/* Compare PLAIN encoded values a and b of col, ordered as Parquet does */
+int k_ParquetCompare(k_ParquetColumn* col, const char* a, const char* b)
+{
+    const char *da, *db;
+    size_t la = k_ParquetValue(col, a, &da), lb = k_ParquetValue(col, b, &db);
+    int c;
+
+    if (col->type == PARQUET_INT64) {
+        int64_t x, y;
+        memcpy(&x, da, 8);
+        memcpy(&y, db, 8);
+        return (x > y) - (x < y);
+    }
+    if (col->type == PARQUET_DOUBLE) {
+        double x, y;
+        memcpy(&x, da, 8);
+        memcpy(&y, db, 8);
+        return (x > y) - (x < y);
+    }
+    c = memcmp(da, db, la < lb ? la : lb);
+    return c != 0 ? c : (la > lb) - (la < lb);
+}
+
+/* Add the PLAIN encoded value at offset of col->values to the dictionary,
+ * giving up on the dictionary once it has max_dict values */
+void k_ParquetDictAdd(k_ParquetColumn* col, int index, size_t offset)
+{
+    const char* value = col->values.buf + offset;
+    size_t len = col->values.len - offset;
+    size_t num_slots = 2 * (size_t) col->max_dict;
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    if (col->dict_size == -1)
+        return;
+
+    for (i = 0; i < len; i++)
+        hash = (hash ^ (uint8_t) value[i]) * 16777619u;
+
+    for (i = hash % num_slots; ; i = (i + 1) % num_slots) {
+        int32_t slot = col->dict_slots[i];
+        if (slot == -1)
+            break;
+        if (col->dict_offsets[slot + 1] - col->dict_offsets[slot] == len &&
+            memcmp(col->dict.buf + col->dict_offsets[slot], value, len) == 0) {
+            col->indices[index] = slot;
+            return;
+        }
+    }
+
+    if (col->dict_size == col->max_dict) {
+        col->dict_size = -1;
+        return;
+    }
+
+    col->dict_slots[i] = col->dict_size;
+    col->indices[index] = col->dict_size++;
+    k_WriteBytes(&col->dict, value, len);
+    col->dict_offsets[col->dict_size] = col->dict.len;
+}
+
+/* Append the current value of column i of stmt to col */
+int k_ParquetAppend(k_ParquetColumn* col, sqlite3_stmt* stmt, int i)
+{
+    sqlite3_value* value = sqlite3_column_value(stmt, i);
+    size_t offset = col->values.len;
+    int index = col->num_values - col->null_count;
+
+    col->defined[col->num_values++] = sqlite3_value_type(value) != SQLITE_NULL;
+    if (sqlite3_value_type(value) == SQLITE_NULL) {
+        col->null_count++;
+        return 0;
+    }
+
+    if (col->type == PARQUET_INT64) {
+        int64_t v = sqlite3_value_int64(value);
+        k_WriteBytes(&col->values, (char*) &v, 8);
+    } else if (col->type == PARQUET_DOUBLE) {
+        double v = sqlite3_value_double(value);
+        k_WriteBytes(&col->values, (char*) &v, 8);
+    } else {
+        uint32_t len = sqlite3_value_bytes(value);
+        k_WriteBytes(&col->values, (char*) &len, 4);
+        k_WriteBytes(&col->values, (const char*) sqlite3_value_blob(value), len);
+    }
+    if (col->values.error)
+        return -1;
+
+    if (index == 0 ||
+        k_ParquetCompare(col, col->values.buf + offset, col->values.buf + col->min) < 0)
+        col->min = offset;
+    if (index == 0 ||
+        k_ParquetCompare(col, col->values.buf + offset, col->values.buf + col->max) > 0)
+        col->max = offset;
+
+    k_ParquetDictAdd(col, index, offset);
+    return col->dict.error ? -1 : 0;
+}
+
+/* Empty col for the next row group */
+void k_ParquetReset(k_ParquetColumn* col)
+{
+    col->num_values = col->null_count = 0;
+    col->values.len = col->dict.len = 0;
+    col->dict_size = 0;
+    col->dict_offsets[0] = 0;
+    memset(col->dict_slots, -1, 2 * col->max_dict * sizeof(int32_t));
+}
+
+/* Append v's low width bits to the bit-packed run being built in acc */
+void k_PackBits(k_Writer* w, uint64_t* acc, int* num_bits, uint32_t v, int width)
+{
+    *acc |= (uint64_t) v << *num_bits;
+    *num_bits += width;
+    while (*num_bits >= 8) {
+        char byte = *acc & 0xff;
+        k_WriteBytes(w, &byte, 1);
+        *acc >>= 8;
+        *num_bits -= 8;
+    }
+}
+
+/* Write values with the RLE/bit-packed hybrid encoding: runs of 8 or more
+ * repeats as RLE runs, everything else bit-packed in groups of 8 */
+void k_WriteHybrid(k_Writer* w, const uint32_t* values, int n, int width)
+{
+    int i = 0;
+
+    while (i < n) {
+        int run = 1;
+        while (i + run < n && values[i + run] == values[i])
+            run++;
+
+        if (run >= 8) {
+            k_ThriftVarint(w, (uint64_t) run << 1);
+            k_WriteBytes(w, (char*) &values[i], (width + 7) / 8);
+            i += run;
+        } else {
+            uint64_t acc = 0;
+            int start = i, groups = 0, num_bits = 0, j;
+
+            /* Groups until the next long run, which starts a new RLE run */
+            do {
+                i += 8;
+                groups++;
+                for (run = 1; i + run < n && values[i + run] == values[i]; run++)
+                    ;
+            } while (i < n && run < 8 && groups < 63);
+
+            k_ThriftVarint(w, (uint64_t) groups << 1 | 1);
+            for (j = start; j < start + groups * 8; j++)
+                k_PackBits(w, &acc, &num_bits, j < n ? values[j] : 0, width);
+            if (i > n)
+                i = n;
+        }
+    }
+}
+
+/* Write a page header and its data */
+void k_ParquetPage(k_Writer* out, int page_type, int num_values, int encoding,
+                   k_Writer* data)
+{
+    k_Thrift t = {out};
+
+    k_ThriftI32(&t, 1, page_type);
+    k_ThriftI32(&t, 2, data->len);  // Uncompressed
+    k_ThriftI32(&t, 3, data->len);  // Compressed
+    if (page_type == PARQUET_DATA_PAGE) {
+        k_ThriftBegin(&t, 5);
+        k_ThriftI32(&t, 1, num_values);
+        k_ThriftI32(&t, 2, encoding);
+        k_ThriftI32(&t, 3, PARQUET_RLE);  // Definition levels
+        k_ThriftI32(&t, 4, PARQUET_RLE);  // Repetition levels
+        k_ThriftEnd(&t);
+    } else {
+        k_ThriftBegin(&t, 7);
+        k_ThriftI32(&t, 1, num_values);
+        k_ThriftI32(&t, 2, PARQUET_PLAIN);
+        k_ThriftEnd(&t);
+    }
+    k_WriteZeros(out, 1);  // End of PageHeader
+    k_WriteBytes(out, data->buf, data->len);
+}
+
+/* Write the pages of col, starting at file offset, into chunk. Then append
+ * its ColumnChunk to meta. */
+void k_ParquetWriteChunk(k_ParquetColumn* col, int64_t offset, k_Writer* chunk,
+                         k_Thrift* meta)
+{
+    k_Writer page = {-1}, levels = {-1};
+    int64_t dict_offset = offset, data_offset = offset;
+    int use_dict = col->dict_size > 0 &&
+                   col->dict_size <= (col->num_values - col->null_count) / 2;
+    uint32_t* defined = malloc(col->num_values * sizeof(uint32_t));
+    int32_t levels_len;
+    int i, width = 1;
+
+    chunk->len = 0;
+
+    if (use_dict) {
+        k_ParquetPage(chunk, PARQUET_DICTIONARY_PAGE, col->dict_size, PARQUET_PLAIN,
+                      &col->dict);
+        data_offset = offset + chunk->len;
+    }
+
+    /* Definition levels, length prefixed, then the values */
+    for (i = 0; defined != NULL && i < col->num_values; i++)
+        defined[i] = col->defined[i];
+    if (defined != NULL)
+        k_WriteHybrid(&levels, defined, col->num_values, 1);
+    levels_len = levels.len;
+    k_WriteBytes(&page, (char*) &levels_len, 4);
+    k_WriteBytes(&page, levels.buf, levels.len);
+
+    if (use_dict) {
+        char bit_width;
+        while ((1u << width) < (unsigned) col->dict_size)
+            width++;
+        bit_width = width;
+        k_WriteBytes(&page, &bit_width, 1);
+        k_WriteHybrid(&page, col->indices, col->num_values - col->null_count, width);
+    } else {
+        k_WriteBytes(&page, col->values.buf, col->values.len);
+    }
+    k_ParquetPage(chunk, PARQUET_DATA_PAGE, col->num_values,
+                  use_dict ? PARQUET_RLE_DICTIONARY : PARQUET_PLAIN, &page);
+
+    /* ColumnChunk, with its ColumnMetaData */
+    k_ThriftBegin(meta, 0);
+    k_ThriftI64(meta, 2, offset);
+    k_ThriftBegin(meta, 3);
+    k_ThriftI32(meta, 1, col->type);
+    k_ThriftList(meta, 2, THRIFT_I32, use_dict ? 3 : 2);
+    k_ThriftZigzag(meta->w, PARQUET_PLAIN);
+    k_ThriftZigzag(meta->w, PARQUET_RLE);
+    if (use_dict)
+        k_ThriftZigzag(meta->w, PARQUET_RLE_DICTIONARY);
+    k_ThriftList(meta, 3, THRIFT_BINARY, 1);
+    k_ThriftVarint(meta->w, strlen(col->name));
+    k_WriteStr(meta->w, col->name);
+    k_ThriftI32(meta, 4, 0);  // Uncompressed
+    k_ThriftI64(meta, 5, col->num_values);
+    k_ThriftI64(meta, 6, chunk->len);
+    k_ThriftI64(meta, 7, chunk->len);
+    k_ThriftI64(meta, 9, data_offset);
+    if (use_dict)
+        k_ThriftI64(meta, 11, dict_offset);
+
+    k_ThriftBegin(meta, 12);
+    k_ThriftI64(meta, 3, col->null_count);
+    if (col->num_values > col->null_count) {
+        const char* data;
+        size_t len = k_ParquetValue(col, col->values.buf + col->max, &data);
+        k_ThriftBinary(meta, 5, data, len);
+        len = k_ParquetValue(col, col->values.buf + col->min, &data);
+        k_ThriftBinary(meta, 6, data, len);
+    }
+    k_ThriftEnd(meta);  // Statistics
+
+    k_ThriftEnd(meta);  // ColumnMetaData
+    k_ThriftEnd(meta);  // ColumnChunk
+
+    free(defined);
+    k_WriterFree(&page);
+    k_WriterFree(&levels);
+}
+
+/* Parquet type for column i of stmt, from its declared type */
+int k_ParquetType(sqlite3_stmt* stmt, int i)
+{
+    const char* decltype = sqlite3_column_decltype(stmt, i);
+
+    if (decltype != NULL && strcasestr(decltype, "INT"))
+        return PARQUET_INT64;
+    if (decltype != NULL && (strcasestr(decltype, "REAL") ||
+                             strcasestr(decltype, "FLOA") ||
+                             strcasestr(decltype, "DOUB")))
+        return PARQUET_DOUBLE;
+    return PARQUET_BYTE_ARRAY;
+}
+
+/* Write every row of table in db to the Parquet file path */
+int k_ExportParquetTable(sqlite3* db, const char* table, const char* path)
+{
+    k_Writer out = {-1}, chunk = {-1}, groups = {-1}, footer = {-1};
+    k_Thrift meta = {&groups};
+    k_ParquetColumn* cols = NULL;
+    sqlite3_stmt* stmt = NULL;
+    int64_t offset = 4, num_rows = 0;
+    int i, rc, num_cols, num_groups = 0, done = 0, group_cap = 1;
+    char select[128];
+    uint32_t footer_len;
+
+    /* Row group buffers are sized for the table, not PARQUET_ROW_GROUP_ROWS,
+     * so small tables don't allocate megabytes per column */
+    snprintf(select, sizeof(select), "SELECT count(*) FROM %s", table);
+    rc = sqlite3_prepare_v2(db, select, -1, &stmt, NULL);
+    if (rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+        int64_t count = sqlite3_column_int64(stmt, 0);
+        group_cap = count < 1 ? 1 : count < PARQUET_ROW_GROUP_ROWS ? count
+                                                                   : PARQUET_ROW_GROUP_ROWS;
+    }
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+
+    snprintf(select, sizeof(select), "SELECT * FROM %s", table);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_prepare_v2(db, select, -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, MAKE_RED "SQL error: %s\n" RESET_COLOR, sqlite3_errmsg(db));
+        return rc;
+    }
+
+    out.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out.fd == -1) {
+        fprintf(stderr, MAKE_RED "Can't create %s: %s\n" RESET_COLOR, path, strerror(errno));
+        sqlite3_finalize(stmt);
+        return SQLITE_CANTOPEN;
+    }
+    k_WriteStr(&out, "PAR1");
+
+    num_cols = sqlite3_column_count(stmt);
+    cols = calloc(num_cols, sizeof(k_ParquetColumn));
+    for (i = 0; cols != NULL && i < num_cols; i++) {
+        cols[i].name = sqlite3_column_name(stmt, i);
+        cols[i].type = k_ParquetType(stmt, i);
+        cols[i].values.fd = cols[i].dict.fd = -1;
+        cols[i].max_dict = group_cap < PARQUET_MAX_DICT ? group_cap : PARQUET_MAX_DICT;
+        cols[i].defined = malloc(group_cap);
+        cols[i].indices = malloc(group_cap * sizeof(uint32_t));
+        cols[i].dict_offsets = malloc((cols[i].max_dict + 1) * sizeof(size_t));
+        cols[i].dict_slots = malloc(2 * cols[i].max_dict * sizeof(int32_t));
+        if (cols[i].defined == NULL || cols[i].indices == NULL ||
+            cols[i].dict_offsets == NULL || cols[i].dict_slots == NULL)
+            rc = SQLITE_NOMEM;
+        else
+            k_ParquetReset(&cols[i]);
+    }
+    if (cols == NULL)
+        rc = SQLITE_NOMEM;
+
+    /* Row groups: collect up to group_cap rows, then write each column chunk */
+    while (rc == SQLITE_OK && !done) {
+        int64_t group_rows = 0, group_bytes = 0;
+
+        while (group_rows < group_cap && rc == SQLITE_OK) {
+            rc = sqlite3_step(stmt);
+            if (rc != SQLITE_ROW)
+                break;
+            rc = SQLITE_OK;
+            for (i = 0; i < num_cols && rc == SQLITE_OK; i++)
+                if (k_ParquetAppend(&cols[i], stmt, i) != 0)
+                    rc = SQLITE_NOMEM;
+            group_rows++;
+        }
+        if (rc == SQLITE_DONE) {
+            rc = SQLITE_OK;
+            done = 1;
+        }
+        if (rc != SQLITE_OK || group_rows == 0)
+            break;
+
+        /* RowGroup */
+        k_ThriftBegin(&meta, 0);
+        k_ThriftList(&meta, 1, THRIFT_STRUCT, num_cols);
+        for (i = 0; i < num_cols; i++) {
+            k_ParquetWriteChunk(&cols[i], offset, &chunk, &meta);
+            k_WriteBytes(&out, chunk.buf, chunk.len);
+            offset += chunk.len;
+            group_bytes += chunk.len;
+            k_ParquetReset(&cols[i]);
+        }
+        k_ThriftI64(&meta, 2, group_bytes);
+        k_ThriftI64(&meta, 3, group_rows);
+        k_ThriftEnd(&meta);
+
+        num_rows += group_rows;
+        num_groups++;
+    }
+
+    if (rc == SQLITE_OK) {
+        /* FileMetaData */
+        k_Thrift t = {&footer};
+
+        k_ThriftI32(&t, 1, 1);
+        k_ThriftList(&t, 2, THRIFT_STRUCT, num_cols + 1);
+        k_ThriftBegin(&t, 0);
+        k_ThriftBinary(&t, 4, table, strlen(table));
+        k_ThriftI32(&t, 5, num_cols);
+        k_ThriftEnd(&t);
+        for (i = 0; i < num_cols; i++) {
+            k_ThriftBegin(&t, 0);
+            k_ThriftI32(&t, 1, cols[i].type);
+            k_ThriftI32(&t, 3, 1);  // Optional
+            k_ThriftBinary(&t, 4, cols[i].name, strlen(cols[i].name));
+            if (cols[i].type == PARQUET_BYTE_ARRAY)
+                k_ThriftI32(&t, 6, 0);  // UTF8
+            k_ThriftEnd(&t);
+        }
+        k_ThriftI64(&t, 3, num_rows);
+        k_ThriftList(&t, 4, THRIFT_STRUCT, num_groups);
+        k_WriteBytes(&footer, groups.buf, groups.len);
+        k_ThriftBinary(&t, 6, "kquery", 6);
+
+        /* Without column orders, readers ignore min_value and max_value */
+        k_ThriftList(&t, 7, THRIFT_STRUCT, num_cols);
+        for (i = 0; i < num_cols; i++) {
+            k_ThriftBegin(&t, 0);  // ColumnOrder
+            k_ThriftBegin(&t, 1);  // TypeDefinedOrder
+            k_ThriftEnd(&t);
+            k_ThriftEnd(&t);
+        }
+        k_WriteZeros(&footer, 1);
+
+        footer_len = footer.len;
+        k_WriteBytes(&out, footer.buf, footer.len);
+        k_WriteBytes(&out, (char*) &footer_len, 4);
+        k_WriteStr(&out, "PAR1");
+    }
+
+    if (rc != SQLITE_OK)
+        fprintf(stderr, MAKE_RED "Can't export %s: %s\n" RESET_COLOR, table,
+                rc == SQLITE_NOMEM ? "out of memory" : sqlite3_errmsg(db));
+    if (k_WriterFlush(&out) == -1) {
+        fprintf(stderr, MAKE_RED "Can't write %s: %s\n" RESET_COLOR, path, strerror(errno));
+        rc = SQLITE_IOERR;
+    }
+    close(out.fd);
+
+    for (i = 0; cols != NULL && i < num_cols; i++) {
+        free(cols[i].defined);
+        free(cols[i].indices);
+        free(cols[i].dict_offsets);
+        free(cols[i].dict_slots);
+        k_WriterFree(&cols[i].values);
+        k_WriterFree(&cols[i].dict);
+    }
+    free(cols);
+    k_WriterFree(&out);
+    k_WriterFree(&chunk);
+    k_WriterFree(&groups);
+    k_WriterFree(&footer);
+    sqlite3_finalize(stmt);
+
+    return rc;
+}
+
+/* Export each of tables (every snapshot table if there are none) to path. With
+ * several tables, each goes to path with the table name before the extension,
+ * e.g. snap.process.parquet for snap.parquet. */
+int k_ExportParquet(sqlite3* db, const char* path, char** tables, int num_tables)
+{
+    char* all[NUM_TABLES];
+    int i, rc = SQLITE_OK;
+
+    if (num_tables == 0) {
+        for (i = 0; i < NUM_TABLES; i++)
+            all[i] = k_Tables[i].name;
+        tables = all;
+        num_tables = NUM_TABLES;
+    }
+
+    if (k_ReferenceTables(tables, num_tables) != SQLITE_OK)
+        return SQLITE_ERROR;
+    if (snapshot_mode)
+        rc = k_PopulateReferencedTables(db);
+
+    for (i = 0; i < num_tables && rc == SQLITE_OK; i++) {
+        char table_path[PATH_MAX];
+        const char* ext = strrchr(path, '.');
+
+        if (num_tables == 1)
+            snprintf(table_path, sizeof(table_path), "%s", path);
+        else if (ext == NULL || strchr(ext, '/') != NULL)
+            snprintf(table_path, sizeof(table_path), "%s.%s", path, tables[i]);
+        else
+            snprintf(table_path, sizeof(table_path), "%.*s.%s%s",
+                     (int) (ext - path), path, tables[i], ext);
+
+        rc = k_ExportParquetTable(db, tables[i], table_path);
+    }
+
+    return rc;
+}
+//
+//--------------------------------------------------------------------------//
+
+//-------------------------------- HISTORY ---------------------------------//
+//
+/* --history FILE attaches a file-backed history database as "history". With
+ * --record MS, kquery collects a snapshot of the given tables every MS
+ * milliseconds and appends it to the history of each table T, with a ts
+ * column holding the collection time in milliseconds since the epoch. The
+ * database is in WAL mode with synchronous=NORMAL, so readers don't block
+ * ingestion and each snapshot costs one transaction whose commit doesn't wait
+ * for fsync.
+ *
+ * History is kept in three tiers: raw snapshots, then per-minute and per-hour
+ * rollups (sample count and min/max/avg of numeric columns per pid). Each tier
+ * is split into time segments, one table per segment, listed in
+ * history.segments and combined by the views T_history, T_history_minute and
+ * T_history_hour. Once a segment falls out of its tier's retention it is
+ * rolled up into the next tier and dropped whole, so old ranges are never
+ * deleted row by row and storage stays bounded. Past MAX_SEGMENTS segments,
+ * adjacent ones of a tier are merged after each ingest. */
+typedef struct {
+    char* suffix;        // Of the view and segment tables
+    long long bucket_ms; // Rows are aggregated per pid over buckets of this
+    long long segment_ms;
+} k_HistoryTier;
+
+#define MINUTE_MS (60 * 1000LL)
+#define HOUR_MS   (60 * MINUTE_MS)
+#define DAY_MS    (24 * HOUR_MS)
+
+/* Segments of each tier nest inside those of the next one, so a segment
+ * usually rolls up into a single segment of complete buckets. Raw segments are
+ * widened with longer retention (see k_RawSegmentMs), so merging segments is
+ * only needed for tiers kept forever or for very long retention. */
+k_HistoryTier k_HistoryTiers[] = {
+    {"",        0,         10 * MINUTE_MS},
+    {"_minute", MINUTE_MS, DAY_MS},
+    {"_hour",   HOUR_MS,   30 * DAY_MS},
+};
+
+#define NUM_TIERS (sizeof(k_HistoryTiers) / sizeof(k_HistoryTiers[0]))
+
+/* Most segments a tier is kept in between ingests, well within SQLite's limit
+ * of 500 terms in the compound SELECT of a view to leave room for the ones an
+ * ingest adds before they are merged */
+#define MAX_SEGMENTS 256
+
+typedef struct {
+    char** tables;
+    int num_tables;
+    long long interval_ms;
+    long long retention_ms[NUM_TIERS];  // 0 keeps a tier forever
+} k_History;
+
+/* Milliseconds since the epoch */
+long long k_EpochMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* Length of raw segments: the shortest divisor of a day that keeps the raw
+ * tier within MAX_SEGMENTS segments, or a day if it is kept forever (or
+ * longer than MAX_SEGMENTS days, when k_MergeHistorySegments bounds it) */
+long long k_RawSegmentMs(long long retention_ms)
+{
+    long long lengths[] = {10, 30, 60, 120, 180, 240, 360, 720, 1440};
+    int i;
+
+    for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]) - 1; i++)
+        if (retention_ms > 0 && retention_ms / (lengths[i] * MINUTE_MS) < MAX_SEGMENTS)
+            break;
+    return lengths[i] * MINUTE_MS;
+}
+
+/* Run the SQL built with sqlite3_mprintf from format on db */
+int k_HistoryExec(sqlite3* db, const char* format, ...)
+{
+    va_list args;
+    char* sql;
+    int rc;
+
+    va_start(args, format);
+    sql = sqlite3_vmprintf(format, args);
+    va_end(args);
+
+    rc = sql ? sqlite3_exec(db, sql, NULL, 0, NULL) : SQLITE_NOMEM;
+    if (rc != SQLITE_OK)
+        fprintf(stderr, MAKE_RED "SQL error: %s\n" RESET_COLOR, sqlite3_errmsg(db));
+    sqlite3_free(sql);
+    return rc;
+}
+
+/* Attach the history database at path to db, in WAL mode */
+int k_AttachHistory(sqlite3* db, const char* path)
+{
+    char* attach = sqlite3_mprintf("ATTACH %Q AS history", path);
+    char* error_msg = NULL;
+    int rc;
+
+    rc = attach ? sqlite3_exec(db, attach, NULL, 0, &error_msg) : SQLITE_NOMEM;
+    if (rc == SQLITE_OK)
+        rc = sqlite3_exec(db, "PRAGMA history.journal_mode = WAL;"
+                              "PRAGMA history.synchronous = NORMAL;"
+                              "CREATE TABLE IF NOT EXISTS history.segments ("
+                              "  name   TEXT PRIMARY KEY,"
+                              "  source TEXT,"
+                              "  tier   INT,"
+                              "  start  INT,"
+                              "  end    INT"
+                              ")", NULL, 0, &error_msg);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, MAKE_RED "Can't open history %s: %s\n" RESET_COLOR, path,
+                error_msg ? error_msg : sqlite3_errmsg(db));
+        sqlite3_free(error_msg);
+    }
+    sqlite3_free(attach);
+    return rc;
+}
+
+/* Write the columns of rollups of snapshot table name to sql: their
+ * definitions if def, else the aggregates computing them from tier - 1 */
+int k_RollupColumns(sqlite3* db, const char* name, int def, int tier, k_Writer* sql)
+{
+    char* pragma = sqlite3_mprintf("PRAGMA main.table_info(%s)", name);
+    sqlite3_stmt* stmt = NULL;
+    int rc = pragma ? sqlite3_prepare_v2(db, pragma, -1, &stmt, NULL) : SQLITE_NOMEM;
+
+    sqlite3_free(pragma);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    if (def)
+        k_WriteStr(sql, "ts INT, pid INT, samples INT");
+    else if (tier == 1)
+        k_WriteStr(sql, "ts - ts % 60000, pid, count(*)");
+    else
+        k_WriteStr(sql, "ts - ts % 3600000, pid, sum(samples)");
+
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char* col  = (const char*) sqlite3_column_text(stmt, 1);
+        const char* type = (const char*) sqlite3_column_text(stmt, 2);
+        char* column;
+
+        if (strcmp(col, "pid") == 0)
+            continue;
+
+        if (strcasestr(type, "INT") || strcasestr(type, "REAL") ||
+            strcasestr(type, "FLOA") || strcasestr(type, "DOUB")) {
+            if (def)
+                column = sqlite3_mprintf(", min_%s %s, max_%s %s, avg_%s REAL",
+                                         col, type, col, type, col);
+            else if (tier == 1)
+                column = sqlite3_mprintf(", min(%s), max(%s), avg(%s)", col, col, col);
+            else
+                column = sqlite3_mprintf(", min(min_%s), max(max_%s), "
+                                         "sum(avg_%s * samples) / sum(samples)",
+                                         col, col, col);
+        } else {
+            /* Kept as the largest value seen, as names rarely change */
+            column = def ? sqlite3_mprintf(", %s %s", col, type)
+                         : sqlite3_mprintf(", max(%s)", col);
+        }
+        k_WriteStr(sql, column);
+        sqlite3_free(column);
+    }
+
+    return sqlite3_finalize(stmt);
+}
+
+/* Recreate the view over every segment of tier of the history of name. The
+ * tier's empty table is always part of it, so the view exists without
+ * segments. */
+int k_RebuildHistoryView(sqlite3* db, const char* name, int tier)
+{
+    const char* suffix = k_HistoryTiers[tier].suffix;
+    char* select = sqlite3_mprintf("SELECT ' UNION ALL SELECT * FROM ' || name "
+                                   "FROM history.segments "
+                                   "WHERE source = %Q AND tier = %d ORDER BY start",
+                                   name, tier);
+    k_Writer view = {-1};
+    sqlite3_stmt* stmt = NULL;
+    int rc = select ? sqlite3_prepare_v2(db, select, -1, &stmt, NULL) : SQLITE_NOMEM;
+
+    sqlite3_free(select);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+        k_WriteStr(&view, (const char*) sqlite3_column_text(stmt, 0));
+    k_WriteZeros(&view, 1);
+    sqlite3_finalize(stmt);
+
+    rc = view.error ? SQLITE_NOMEM :
+         k_HistoryExec(db, "DROP VIEW IF EXISTS history.%s_history%s;"
+                           "CREATE VIEW history.%s_history%s AS "
+                           "SELECT * FROM %s_history%s_empty%s",
+                           name, suffix, name, suffix, name, suffix, view.buf);
+    k_WriterFree(&view);
+    return rc;
+}
+
+/* Create the empty tables and views of the history of snapshot table name */
+int k_CreateHistory(sqlite3* db, const char* name)
+{
+    k_Writer columns = {-1};
+    int tier, rc;
+
+    rc = k_HistoryExec(db, "CREATE TABLE IF NOT EXISTS history.%s_history_empty AS "
+                           "SELECT 0 AS ts, * FROM main.%s WHERE 0", name, name);
+    if (rc == SQLITE_OK)
+        rc = k_RollupColumns(db, name, 1, 0, &columns);
+    k_WriteZeros(&columns, 1);
+
+    for (tier = 1; tier < NUM_TIERS && rc == SQLITE_OK; tier++)
+        rc = columns.error ? SQLITE_NOMEM :
+             k_HistoryExec(db, "CREATE TABLE IF NOT EXISTS history.%s_history%s_empty (%s)",
+                           name, k_HistoryTiers[tier].suffix, columns.buf);
+
+    for (tier = 0; tier < NUM_TIERS && rc == SQLITE_OK; tier++)
+        rc = k_RebuildHistoryView(db, name, tier);
+
+    k_WriterFree(&columns);
+    return rc;
+}
+
+/* Merge the adjacent pair of segments of tier of the history of name spanning
+ * the least time if there are more than max_segments, copying the shorter one
+ * into the other, and set merged. Segments merged this way grow
+ * geometrically, so a tier kept forever stays bounded, and a merged segment
+ * expires once its newest rows fall out of retention. */
+int k_MergeHistorySegments(sqlite3* db, const char* name, int tier, int max_segments,
+                           int* merged)
+{
+    char* count = sqlite3_mprintf("SELECT count(*) FROM history.segments "
+                                  "WHERE source = %Q AND tier = %d", name, tier);
+    char* select = sqlite3_mprintf(
+        "SELECT a.name, a.start, a.end, b.name, b.end FROM history.segments a, "
+        "history.segments b WHERE a.source = %Q AND a.tier = %d AND "
+        "b.source = a.source AND b.tier = a.tier AND b.start = (SELECT min(start) "
+        "FROM history.segments WHERE source = a.source AND tier = a.tier AND "
+        "start > a.start) ORDER BY b.end - a.start, a.start LIMIT 1", name, tier);
+    sqlite3_stmt* stmt = NULL;
+    char first[128], second[128];
+    long long start, middle, end;
+    int rc, num_segments = 0;
+
+    *merged = 0;
+    rc = count ? sqlite3_prepare_v2(db, count, -1, &stmt, NULL) : SQLITE_NOMEM;
+    if (rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW)
+        num_segments = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+    sqlite3_free(count);
+
+    if (rc == SQLITE_OK && num_segments > max_segments)
+        rc = select ? sqlite3_prepare_v2(db, select, -1, &stmt, NULL) : SQLITE_NOMEM;
+    sqlite3_free(select);
+    if (rc != SQLITE_OK || stmt == NULL || sqlite3_step(stmt) != SQLITE_ROW) {
+        sqlite3_finalize(stmt);
+        return rc;
+    }
+    snprintf(first, sizeof(first), "%s", sqlite3_column_text(stmt, 0));
+    start = sqlite3_column_int64(stmt, 1);
+    middle = sqlite3_column_int64(stmt, 2);
+    snprintf(second, sizeof(second), "%s", sqlite3_column_text(stmt, 3));
+    end = sqlite3_column_int64(stmt, 4);
+    sqlite3_finalize(stmt);
+
+    /* The merged segment keeps the longer one's table, under its own name
+     * even if that no longer matches its start */
+    if (middle - start >= end - middle)
+        rc = k_HistoryExec(db, "INSERT INTO history.%s SELECT * FROM history.%s;"
+                               "DROP TABLE history.%s;"
+                               "DELETE FROM history.segments WHERE name = %Q;"
+                               "UPDATE history.segments SET end = %lld WHERE name = %Q",
+                           first, second, second, second, end, first);
+    else
+        rc = k_HistoryExec(db, "INSERT INTO history.%s SELECT * FROM history.%s;"
+                               "DROP TABLE history.%s;"
+                               "DELETE FROM history.segments WHERE name = %Q;"
+                               "UPDATE history.segments SET start = %lld WHERE name = %Q",
+                           second, first, first, first, start, second);
+    if (rc == SQLITE_OK)
+        rc = k_RebuildHistoryView(db, name, tier);
+    *merged = rc == SQLITE_OK;
+    return rc;
+}
+
+/* Find the segment of tier of the history of name holding ts, creating it if
+ * there is none, and copy its name to segment and its end to end */
+int k_HistorySegment(sqlite3* db, k_History* history, const char* name, int tier,
+                     long long ts, char* segment, size_t len, long long* end)
+{
+    const char* suffix = k_HistoryTiers[tier].suffix;
+    long long length = tier == 0 ? k_RawSegmentMs(history->retention_ms[0]) :
+                                   k_HistoryTiers[tier].segment_ms;
+    long long start = ts - ts % length, last_end = 0;
+    char* select = sqlite3_mprintf("SELECT name, end FROM history.segments "
+                                   "WHERE source = %Q AND tier = %d AND start <= %lld "
+                                   "ORDER BY start DESC LIMIT 1", name, tier, ts);
+    sqlite3_stmt* stmt = NULL;
+    int rc;
+
+    rc = select ? sqlite3_prepare_v2(db, select, -1, &stmt, NULL) : SQLITE_NOMEM;
+    sqlite3_free(select);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        last_end = sqlite3_column_int64(stmt, 1);
+        if (ts < last_end) {
+            snprintf(segment, len, "%s", sqlite3_column_text(stmt, 0));
+            *end = last_end;
+            return sqlite3_finalize(stmt);
+        }
+    }
+    sqlite3_finalize(stmt);
+
+    /* Segments never overlap, even if the raw segment length changed */
+    if (start < last_end)
+        start = last_end;
+
+    snprintf(segment, len, "%s_history%s_%lld", name, suffix, start / 1000);
+    *end = ts - ts % length + length;
+    rc = k_HistoryExec(db, "CREATE TABLE history.%s AS SELECT * FROM %s_history%s_empty;"
+                           "CREATE INDEX history.%s_ts_pid ON %s(ts, pid);"
+                           "INSERT INTO history.segments VALUES (%Q, %Q, %d, %lld, %lld)",
+                       segment, name, suffix, segment, segment,
+                       segment, name, tier, start, *end);
+    if (rc == SQLITE_OK)
+        rc = k_RebuildHistoryView(db, name, tier);
+    return rc;
+}
+
+/* Roll up segments of the history of name that fell out of retention into the
+ * next tier, then drop them */
+int k_ExpireHistory(sqlite3* db, k_History* history, const char* name, long long now)
+{
+    int tier, rc = SQLITE_OK;
+
+    for (tier = 0; tier < NUM_TIERS && rc == SQLITE_OK; tier++) {
+        int expired = 0;
+
+        if (history->retention_ms[tier] == 0)
+            continue;
+
+        /* One at a time, as tables can't be dropped while a statement reads */
+        while (rc == SQLITE_OK) {
+            char* select = sqlite3_mprintf("SELECT name, start, end FROM history.segments "
+                                           "WHERE source = %Q AND tier = %d AND end <= %lld "
+                                           "ORDER BY start LIMIT 1",
+                                           name, tier, now - history->retention_ms[tier]);
+            sqlite3_stmt* stmt = NULL;
+            char segment[128], next[128];
+            long long start, end, next_end;
+
+            rc = select ? sqlite3_prepare_v2(db, select, -1, &stmt, NULL) : SQLITE_NOMEM;
+            sqlite3_free(select);
+            if (rc != SQLITE_OK || sqlite3_step(stmt) != SQLITE_ROW) {
+                sqlite3_finalize(stmt);
+                break;
+            }
+            snprintf(segment, sizeof(segment), "%s", sqlite3_column_text(stmt, 0));
+            start = sqlite3_column_int64(stmt, 1);
+            end = sqlite3_column_int64(stmt, 2);
+            sqlite3_finalize(stmt);
+
+            /* Into each segment of the next tier it overlaps, as merged
+             * segments can span several */
+            if (tier + 1 < NUM_TIERS) {
+                k_Writer columns = {-1};
+
+                rc = k_RollupColumns(db, name, 0, tier + 1, &columns);
+                k_WriteZeros(&columns, 1);
+                if (rc == SQLITE_OK && columns.error)
+                    rc = SQLITE_NOMEM;
+                for (; start < end && rc == SQLITE_OK; start = next_end) {
+                    rc = k_HistorySegment(db, history, name, tier + 1, start, next,
+                                          sizeof(next), &next_end);
+                    if (rc == SQLITE_OK)
+                        rc = k_HistoryExec(db, "INSERT INTO history.%s SELECT %s "
+                                               "FROM history.%s WHERE ts >= %lld AND "
+                                               "ts < %lld GROUP BY 1, 2",
+                                           next, columns.buf, segment, start, next_end);
+                }
+                k_WriterFree(&columns);
+            }
+
+            if (rc == SQLITE_OK)
+                rc = k_HistoryExec(db, "DROP TABLE history.%s;"
+                                       "DELETE FROM history.segments WHERE name = %Q",
+                                   segment, segment);
+            expired = 1;
+        }
+
+        if (rc == SQLITE_OK && expired)
+            rc = k_RebuildHistoryView(db, name, tier);
+    }
+
+    return rc;
+}
+
+/* Append the snapshot in the main database, collected at ts, to the history
+ * in a single transaction, expiring old segments */
+int k_IngestSnapshot(sqlite3* db, k_History* history, long long ts)
+{
+    int i, rc = sqlite3_exec(db, "BEGIN", NULL, 0, NULL);
+    char segment[128];
+
+    for (i = 0; i < history->num_tables && rc == SQLITE_OK; i++) {
+        const char* name = history->tables[i];
+        long long end;
+
+        rc = k_HistorySegment(db, history, name, 0, ts, segment, sizeof(segment), &end);
+        if (rc == SQLITE_OK)
+            rc = k_HistoryExec(db, "INSERT INTO history.%s SELECT %lld, * FROM main.%s",
+                               segment, ts, name);
+        if (rc == SQLITE_OK)
+            rc = k_ExpireHistory(db, history, name, ts);
+    }
+
+    if (rc != SQLITE_OK)
+        fprintf(stderr, MAKE_RED "Can't record snapshot\n" RESET_COLOR);
+    sqlite3_exec(db, rc == SQLITE_OK ? "COMMIT" : "ROLLBACK", NULL, 0, NULL);
+    return rc;
+}
+
+/* Merge segments of tiers over MAX_SEGMENTS, one pair per transaction after
+ * the snapshot is ingested, so an ingest never waits on copying old ones */
+int k_MergeHistory(sqlite3* db, k_History* history)
+{
+    int i, tier, merged, rc = SQLITE_OK;
+
+    for (i = 0; i < history->num_tables && rc == SQLITE_OK; i++) {
+        for (tier = 0; tier < NUM_TIERS && rc == SQLITE_OK; tier++) {
+            do {
+                rc = sqlite3_exec(db, "BEGIN", NULL, 0, NULL);
+                if (rc == SQLITE_OK)
+                    rc = k_MergeHistorySegments(db, history->tables[i], tier, MAX_SEGMENTS,
+                                                &merged);
+                sqlite3_exec(db, rc == SQLITE_OK ? "COMMIT" : "ROLLBACK", NULL, 0, NULL);
+            } while (rc == SQLITE_OK && merged);
+        }
+    }
+
+    if (rc != SQLITE_OK)
+        fprintf(stderr, MAKE_RED "Can't merge history segments\n" RESET_COLOR);
+    return rc;
+}
+
+/* Parse --retention RAW[,MINUTE[,HOUR]] seconds into history, keeping its
+ * retention for tiers left out, -1 if invalid */
+int k_ParseRetention(k_History* history, char* arg)
+{
+    long long seconds[NUM_TIERS];
+    int i;
+    char* end;
+
+    for (i = 0; i < NUM_TIERS; i++)
+        seconds[i] = history->retention_ms[i] / 1000;
+    for (i = 0; i < NUM_TIERS && *arg != '\0'; i++) {
+        seconds[i] = strtoll(arg, &end, 10);
+        if (end == arg || seconds[i] < 0 || (*end != ',' && *end != '\0'))
+            return -1;
+        arg = *end == ',' ? end + 1 : end;
+    }
+    if (i == 0 || *arg != '\0')
+        return -1;
+
+    for (i = 0; i < NUM_TIERS; i++)
+        history->retention_ms[i] = seconds[i] * 1000;
+    return 0;
+}
+
+/* Record a snapshot every interval_ms until killed */
+int k_RecordHistory(sqlite3* db, k_History* history)
+{
+    int i;
+
+    if (k_ReferenceTables(history->tables, history->num_tables) != SQLITE_OK)
+        return SQLITE_ERROR;
+    for (i = 0; i < history->num_tables; i++)
+        if (k_CreateHistory(db, history->tables[i]) != SQLITE_OK)
+            return SQLITE_ERROR;
+
+    while (1) {
+        long long start = k_NowMs(), ts = k_EpochMs(), wait_ms;
+
+        k_ResetSnapshotTables(db);
+        k_ReferenceTables(history->tables, history->num_tables);
+        if (k_PopulateReferencedTables(db) == SQLITE_OK &&
+            k_IngestSnapshot(db, history, ts) == SQLITE_OK)
+            k_MergeHistory(db, history);
+        k_ArenaReset(&query_arena);
+
+        wait_ms = start + history->interval_ms - k_NowMs();
+        if (wait_ms > 0) {
+            struct timespec delay = {wait_ms / 1000, wait_ms % 1000 * 1000000};
+            while (nanosleep(&delay, &delay) == -1 && errno == EINTR)
+                ;
+        }
+    }
+
+    return SQLITE_OK;
+}
+//
+//--------------------------------------------------------------------------//
+
+//--------------------------- CONTINUOUS QUERIES ---------------------------//
+//
+/* --watch MS runs the given queries every MS milliseconds, writing a query's
+ * result again only when it differs from the last one written. Queries the
+ * columnar path runs (see COLUMNAR EXECUTION) are maintained incrementally:
+ * every interval the process table is collected into columns and compared
+ * with the last collection by pid (both come in pid order), and only the
+ * processes that appeared, changed or went away are applied. A filter or
+ * projection keeps the rows passing its WHERE clause; an aggregate keeps its
+ * accumulators per group, subtracting old rows and adding new ones, and
+ * recomputes a min or max only for groups whose extreme went away. Queries
+ * no changed row passes the WHERE clause of aren't evaluated at all. Other
+ * queries (and min or max of name) run in full every interval. */
+
+/* A process that appeared (old_row -1), went away (new_row -1) or changed
+ * between two collections */
+typedef struct {
+    int old_row;
+    int new_row;
+} k_RowChange;
+
+typedef struct {
+    char* sql;              // Normalized
+    k_FastQuery q;
+    int incremental;        // Maintained from row changes, else run in full
+    k_Columns rows;         // Without aggregates, rows passing the WHERE clause
+    k_Columns next_rows;    // Built from rows and the changes of an interval
+    k_Columns keys;         // With aggregates, the first row of each group
+    k_Accumulator* acc;     // Per group and item
+    char* stale;            // Per group, set if a min or max must be recomputed
+    int num_groups;
+    int cap_groups;
+    int* slots;             // Group + 1 per hash slot of the group key, 0 if empty
+    size_t mask;
+    k_Writer last;          // Result last written
+    int written;
+} k_Watch;
+
+/* Run queries every interval_ms with --watch, 0 if disabled */
+long long watch_ms = 0;
+
+/* Whether column col is the same in row a of cols_a and row b of cols_b */
+int k_SameValue(k_Columns* cols_a, int a, k_Columns* cols_b, int b, int col)
+{
+    if (col == PROCESS_COLUMN_NAME)
+        return memcmp(cols_a->names[a], cols_b->names[b], PROCESS_NAME_LEN) == 0;
+    return cols_a->ints[col][a] == cols_b->ints[col][b];
+}
+
+/* Compare collections prev and cur by pid, filling *changes with the
+ * processes that differ, in pid order. Returns how many, or -1 if out of
+ * memory or a collection isn't in pid order. */
+int k_DiffColumns(k_Columns* prev, k_Columns* cur, k_RowChange** changes)
+{
+    int64_t* old_pids = prev->ints[PROCESS_COLUMN_PID];
+    int64_t* new_pids = cur->ints[PROCESS_COLUMN_PID];
+    k_RowChange* grown = realloc(*changes, (prev->num_rows + cur->num_rows + 1) *
+                                           sizeof(k_RowChange));
+    int i = 0, j = 0, n = 0, c;
+
+    if (grown == NULL)
+        return -1;
+    *changes = grown;
+
+    for (i = 1; i < prev->num_rows; i++)
+        if (old_pids[i] <= old_pids[i-1])
+            return -1;
+    for (j = 1; j < cur->num_rows; j++)
+        if (new_pids[j] <= new_pids[j-1])
+            return -1;
+
+    for (i = j = 0; i < prev->num_rows || j < cur->num_rows; ) {
+        k_RowChange change = {-1, -1};
+
+        if (j == cur->num_rows || (i < prev->num_rows && old_pids[i] < new_pids[j])) {
+            change.old_row = i++;
+        } else if (i == prev->num_rows || new_pids[j] < old_pids[i]) {
+            change.new_row = j++;
+        } else {
+            for (c = 0; c < NUM_PROCESS_COLUMNS; c++)
+                if (!k_SameValue(prev, i, cur, j, c))
+                    break;
+            if (c < NUM_PROCESS_COLUMNS) {
+                change.old_row = i;
+                change.new_row = j;
+            }
+            i++;
+            j++;
+            if (c == NUM_PROCESS_COLUMNS)
+                continue;
+        }
+        grown[n++] = change;
+    }
+
+    return n;
+}
+
+/* Whether row of cols passes the WHERE clause of q */
+int k_RowMatches(k_Columns* cols, k_FastQuery* q, int row)
+{
+    int i;
+
+    for (i = 0; i < q->num_predicates; i++) {
+        int sel = row;
+        if (k_FastFilter(cols, &q->predicates[i], &sel, 1, 0) == 0)
+            return 0;
+    }
+    return 1;
+}
+
+/* Index of the group of row of cols, adding the group if create. -1 if there
+ * is none, or no memory for it. */
+int k_WatchGroup(k_Watch* w, k_Columns* cols, int row, int create)
+{
+    int col = w->q.group_col, n = w->q.num_items, g;
+    size_t h;
+
+    if (col == -1)
+        return 0;
+
+    /* Keep the hash table at most half full */
+    if (create && (size_t) w->num_groups * 2 >= w->mask + 1) {
+        size_t mask = w->mask * 2 + 1;
+        int* slots = calloc(mask + 1, sizeof(int));
+
+        if (slots == NULL)
+            return -1;
+        for (g = 0; g < w->num_groups; g++) {
+            h = k_HashRow(&w->keys, col, g) & mask;
+            while (slots[h])
+                h = (h + 1) & mask;
+            slots[h] = g + 1;
+        }
+        free(w->slots);
+        w->slots = slots;
+        w->mask = mask;
+    }
+
+    h = k_HashRow(cols, col, row) & w->mask;
+    while (w->slots[h] && !k_SameValue(&w->keys, w->slots[h] - 1, cols, row, col))
+        h = (h + 1) & w->mask;
+    if (w->slots[h] || !create)
+        return w->slots[h] - 1;
+
+    if (w->num_groups == w->cap_groups) {
+        int cap = w->cap_groups * 2;
+        k_Accumulator* acc = realloc(w->acc, (size_t) cap * n * sizeof(k_Accumulator));
+        char* stale;
+
+        if (acc == NULL)
+            return -1;
+        w->acc = acc;
+        if ((stale = realloc(w->stale, cap)) == NULL)
+            return -1;
+        w->stale = stale;
+        w->cap_groups = cap;
+    }
+
+    if (k_CopyColumnsRow(&w->keys, cols, row))
+        return -1;
+    g = w->num_groups++;
+    memset(&w->acc[g * n], 0, n * sizeof(k_Accumulator));
+    w->stale[g] = 0;
+    w->slots[h] = g + 1;
+    return g;
+}
+
+/* Add (sign 1) or subtract (sign -1) row of cols to the accumulators of its
+ * group. -1 if out of memory, 1 if a sum overflowed. */
+int k_WatchAccumulate(k_Watch* w, k_Columns* cols, int row, int sign)
+{
+    int i, n = w->q.num_items, overflow = 0;
+    int g = k_WatchGroup(w, cols, row, sign > 0);
+
+    if (g == -1)
+        return -1;
+
+    for (i = 0; i < n; i++) {
+        k_FastItem* item = &w->q.items[i];
+        k_Accumulator* a = &w->acc[g * n + i];
+        int64_t v = item->kind == FAST_COLUMN || item->kind == FAST_COUNT ? 0 :
+                    cols->ints[item->col][row];
+
+        switch (item->kind) {
+        case FAST_SUM:
+        case FAST_AVG:
+            if (sign > 0)
+                overflow |= __builtin_add_overflow(a->value, v, &a->value);
+            else
+                overflow |= __builtin_sub_overflow(a->value, v, &a->value);
+            break;
+        case FAST_MIN:
+        case FAST_MAX:
+            if (sign < 0 && v == a->value)
+                w->stale[g] = 1;  // The extreme may have gone
+            else if (sign > 0 && (!a->count || (item->kind == FAST_MIN ? v < a->value :
+                                                                        v > a->value)))
+                a->value = v;
+            break;
+        }
+        a->count += sign;
+    }
+    return overflow;
+}
+
+/* Recompute the accumulators of stale groups (every group if all) from
+ * collection cols. -1 if out of memory or a sum overflows. */
+int k_WatchRecompute(k_Watch* w, k_Columns* cols, int all)
+{
+    int* sel = malloc((cols->num_rows + 1) * sizeof(int));
+    int* groups = malloc((cols->num_rows + 1) * sizeof(int));
+    int i, j, num = cols->num_rows, k = 0, n = w->q.num_items, rc = -1;
+
+    if (sel == NULL || groups == NULL)
+        goto done;
+
+    if (w->q.num_predicates == 0)
+        for (i = 0; i < num; i++)
+            sel[i] = i;
+    for (i = 0; i < w->q.num_predicates; i++)
+        num = k_FastFilter(cols, &w->q.predicates[i], sel, num, i == 0);
+
+    for (j = 0; j < num; j++) {
+        int g = k_WatchGroup(w, cols, sel[j], 0);
+        if (g != -1 && (all || w->stale[g])) {
+            sel[k] = sel[j];
+            groups[k++] = g;
+        }
+    }
+
+    for (j = 0; j < w->num_groups; j++)
+        if (all || w->stale[j])
+            memset(&w->acc[j * n], 0, n * sizeof(k_Accumulator));
+    memset(w->stale, 0, w->num_groups);
+
+    for (i = 0; i < n; i++)
+        if (k_FastAccumulate(cols, &w->q.items[i], sel, k, groups, w->acc + i, n) == -1)
+            goto done;
+    rc = 0;
+
+done:
+    free(sel);
+    free(groups);
+    return rc;
+}
+
+/* Drop the groups every row has left once they outnumber the others, keeping
+ * the rest in order, so keys that come and go (like the pids of short-lived
+ * processes) don't grow w without bound */
+void k_WatchCompact(k_Watch* w)
+{
+    int n = w->q.num_items, g, c, live = 0;
+    size_t h;
+
+    if (w->q.group_col == -1)
+        return;
+    for (g = 0; g < w->num_groups; g++)
+        live += w->acc[g * n].count != 0;
+    if (w->num_groups - live <= live)
+        return;
+
+    for (g = live = 0; g < w->num_groups; g++) {
+        if (w->acc[g * n].count == 0)
+            continue;
+        for (c = 0; c < NUM_PROCESS_COLUMNS; c++)
+            if (c != PROCESS_COLUMN_NAME)
+                w->keys.ints[c][live] = w->keys.ints[c][g];
+        memmove(w->keys.names[live], w->keys.names[g], PROCESS_NAME_LEN);
+        memmove(&w->acc[live * n], &w->acc[g * n], n * sizeof(k_Accumulator));
+        w->stale[live++] = w->stale[g];
+    }
+    w->num_groups = w->keys.num_rows = live;
+
+    memset(w->slots, 0, (w->mask + 1) * sizeof(int));
+    for (g = 0; g < live; g++) {
+        h = k_HashRow(&w->keys, w->q.group_col, g) & w->mask;
+        while (w->slots[h])
+            h = (h + 1) & w->mask;
+        w->slots[h] = g + 1;
+    }
+}
+
+/* Apply the num_changes changes between collections prev and cur to w.
+ * Returns 1 if any of them passed the WHERE clause before or after, 0 if
+ * none did, or -1 if w can't be maintained (out of memory or overflow). */
+int k_WatchApply(k_Watch* w, k_Columns* prev, k_Columns* cur, k_RowChange* changes,
+                 int num_changes)
+{
+    k_Columns* rows = &w->rows;
+    int64_t* pids = rows->ints[PROCESS_COLUMN_PID];
+    int i, j = 0, touched = 0, stale = 0, overflow = 0, rc;
+
+    w->next_rows.num_rows = 0;
+
+    for (i = 0; i < num_changes; i++) {
+        k_RowChange* change = &changes[i];
+        int was = change->old_row != -1 && k_RowMatches(prev, &w->q, change->old_row);
+        int is = change->new_row != -1 && k_RowMatches(cur, &w->q, change->new_row);
+        int64_t pid;
+
+        if (!was && !is)
+            continue;
+        touched = 1;
+
+        if (w->q.aggregate) {
+            if (was && (rc = k_WatchAccumulate(w, prev, change->old_row, -1)) == -1)
+                return -1;
+            overflow |= was && rc;
+            if (is && (rc = k_WatchAccumulate(w, cur, change->new_row, 1)) == -1)
+                return -1;
+            overflow |= is && rc;
+            continue;
+        }
+
+        /* Merge the changed rows into the kept ones, both in pid order */
+        pid = change->old_row != -1 ? prev->ints[PROCESS_COLUMN_PID][change->old_row] :
+                                      cur->ints[PROCESS_COLUMN_PID][change->new_row];
+        for (; j < rows->num_rows && pids[j] < pid; j++)
+            if (k_CopyColumnsRow(&w->next_rows, rows, j))
+                return -1;
+        if (was)
+            j++;  // The old version of the row
+        if (is && k_CopyColumnsRow(&w->next_rows, cur, change->new_row))
+            return -1;
+    }
+
+    if (!touched)
+        return 0;
+
+    if (w->q.aggregate) {
+        for (i = 0; i < w->num_groups && !stale; i++)
+            stale = w->stale[i];
+        if ((stale || overflow) && k_WatchRecompute(w, cur, overflow) == -1)
+            return -1;
+        k_WatchCompact(w);
+    } else {
+        k_Columns kept;
+
+        for (; j < rows->num_rows; j++)
+            if (k_CopyColumnsRow(&w->next_rows, rows, j))
+                return -1;
+        kept = w->rows;
+        w->rows = w->next_rows;
+        w->next_rows = kept;
+    }
+
+    return 1;
+}
+
+/* Set up w to watch query, 0 on success */
+int k_WatchInit(k_Watch* w, const char* query)
+{
+    char* sql = k_NormalizeQuery(query);
+    int i, n;
+
+    if (sql == NULL || (w->sql = strdup(sql)) == NULL)
+        return -1;
+
+    w->incremental = fp != -1 && k_ParseFastQuery(w->sql, &w->q) == SQLITE_OK;
+    n = w->q.num_items;
+    for (i = 0; i < n && w->incremental; i++)
+        if ((w->q.items[i].kind == FAST_MIN || w->q.items[i].kind == FAST_MAX) &&
+            w->q.items[i].col == PROCESS_COLUMN_NAME)
+            w->incremental = 0;  // Accumulators point into a collection
+
+    if (w->incremental && w->q.aggregate) {
+        w->cap_groups = 16;
+        w->mask = 31;
+        w->num_groups = w->q.group_col == -1 ? 1 : 0;
+        w->acc = calloc((size_t) w->cap_groups * n, sizeof(k_Accumulator));
+        w->stale = calloc(w->cap_groups, 1);
+        w->slots = calloc(w->mask + 1, sizeof(int));
+        if (w->acc == NULL || w->stale == NULL || w->slots == NULL)
+            return -1;
+    }
+
+    w->last.fd = -1;
+    return 0;
+}
+
+/* Run the statements of normalized sql, collecting the snapshot tables each
+ * reads, writing rows and errors to out */
+int k_RunSnapshotStatements(sqlite3* db, const char* sql, k_Writer* out)
+{
+    sqlite3_stmt* stmt = NULL;
+    const char* tail = sql;
+    int rc = SQLITE_OK;
+
+    while (rc == SQLITE_OK && *tail != '\0') {
+        rc = k_PrepareRecordingTables(db, tail, &stmt, &tail);
+        if (rc != SQLITE_OK || stmt == NULL)
+            continue;
+        if (snapshot_mode)
+            rc = k_PopulateReferencedTables(db);
+        if (rc == SQLITE_OK)
+            rc = k_StepQuery(stmt, output_format, out);
+        if (!sqlite3_stmt_readonly(stmt))
+            process_columns.populated = 0;
+        sqlite3_finalize(stmt);
+    }
+
+    if (rc != SQLITE_OK) {
+        k_WriteStr(out, MAKE_RED "SQL error: ");
+        k_WriteStr(out, sqlite3_errmsg(db));
+        k_WriteStr(out, "\n" RESET_COLOR);
+    }
+
+    return rc;
+}
+
+/* Write the current result of incremental w to out. FAST_FALLBACK if it has
+ * to run in SQLite. */
+int k_WatchWrite(sqlite3* db, k_Watch* w, k_Writer* out)
+{
+    k_FastQuery q = w->q;
+    int n = q.num_items, g, i, num_results = 0, rc = SQLITE_NOMEM;
+    k_Cell* cells;
+    int* order;
+    int* rows;
+
+    if (!q.aggregate) {
+        q.num_predicates = 0;  // Every kept row passes
+        return k_RunFastQuery(db, &q, &w->rows, output_format, out);
+    }
+
+    cells = malloc(((size_t) w->num_groups * n + 1) * sizeof(k_Cell));
+    order = malloc((w->num_groups + 1) * sizeof(int));
+    rows = malloc((w->num_groups + 1) * sizeof(int));
+
+    if (cells != NULL && order != NULL && rows != NULL) {
+        k_FastSort sort = {&w->q, &w->keys, cells, rows};
+
+        /* Groups every row has left are kept until compacted, but not written */
+        for (g = 0; g < w->num_groups; g++) {
+            rows[g] = g;
+            if (q.group_col != -1 && w->acc[g * n].count == 0)
+                continue;
+            order[num_results++] = g;
+            for (i = 0; i < n; i++)
+                cells[g * n + i] = k_FastCell(&w->keys, &q.items[i], &w->acc[g * n + i], g);
+        }
+        rc = k_WriteFastResults(db, &sort, order, num_results, output_format, out);
+    }
+
+    free(cells);
+    free(order);
+    free(rows);
+    return rc;
+}
+
+void k_WatchFree(k_Watch* w)
+{
+    free(w->sql);
+    k_FreeColumns(&w->rows);
+    k_FreeColumns(&w->next_rows);
+    k_FreeColumns(&w->keys);
+    free(w->acc);
+    free(w->stale);
+    free(w->slots);
+    k_WriterFree(&w->last);
+}
+
+/* Run queries every interval_ms, writing each result when it changes */
+int k_WatchQueries(sqlite3* db, char** queries, int num_queries, long long interval_ms)
+{
+    k_Watch* watches = calloc(num_queries, sizeof(k_Watch));
+    k_Columns prev = {0};
+    k_Columns* cur = &process_columns;  // Also what SQLite's process is loaded from
+    k_RowChange* changes = NULL;
+    int i, incremental = 0;
+
+    if (watches == NULL)
+        return SQLITE_NOMEM;
+    for (i = 0; i < num_queries; i++) {
+        if (k_WatchInit(&watches[i], queries[i]) == -1)
+            return SQLITE_NOMEM;
+        incremental |= watches[i].incremental;
+    }
+    k_ArenaReset(&query_arena);
+
+    while (1) {
+        long long start = k_NowMs(), wait_ms;
+        int num_changes = -1;
+
+        k_ResetSnapshotTables(db);
+
+        if (incremental && k_PopulateColumns(cur, fp, &query_arena) == SQLITE_OK)
+            num_changes = k_DiffColumns(&prev, cur, &changes);
+
+        for (i = 0; i < num_queries; i++) {
+            k_Watch* w = &watches[i];
+            k_Writer out = {-1};
+            int run = 1;  // In SQLite
+
+            if (w->incremental) {
+                int rc = num_changes == -1 ? -1 :
+                         k_WatchApply(w, &prev, cur, changes, num_changes);
+
+                if (rc == -1)
+                    w->incremental = 0;  // Out of step with the collections
+                else if (rc == 0 && w->written)
+                    continue;  // Nothing it reads changed
+                else if (k_WatchWrite(db, w, &out) == SQLITE_OK)
+                    run = 0;
+                else
+                    out.len = 0;
+            }
+            if (run)
+                k_RunSnapshotStatements(db, w->sql, &out);
+
+            if (!w->written || out.len != w->last.len ||
+                memcmp(out.buf, w->last.buf, out.len) != 0) {
+                k_Writer last = w->last;
+
+                k_WriteBytes(&stdout_writer, out.buf, out.len);
+                k_WriterFlush(&stdout_writer);
+                w->last = out;
+                w->written = 1;
+                out = last;
+            }
+            k_WriterFree(&out);
+        }
+
+        /* Keep this collection for the next diff, and its buffers for the
+         * one after (reset at the next k_ResetSnapshotTables) */
+        if (num_changes != -1) {
+            k_Columns collected = *cur;
+            *cur = prev;
+            prev = collected;
+        }
+        k_ArenaReset(&query_arena);
+
+        for (i = incremental = 0; i < num_queries; i++)
+            incremental |= watches[i].incremental;
+
+        wait_ms = start + interval_ms - k_NowMs();
+        if (wait_ms > 0) {
+            struct timespec delay = {wait_ms / 1000, wait_ms % 1000 * 1000000};
+            while (nanosleep(&delay, &delay) == -1 && errno == EINTR)
+                ;
+        }
+    }
+
+    for (i = 0; i < num_queries; i++)
+        k_WatchFree(&watches[i]);
+    free(watches);
+    k_FreeColumns(&prev);
+    free(changes);
+    return SQLITE_OK;
+}
+//
+//--------------------------------------------------------------------------//
+
+//----------------------------- META-COMMANDS ------------------------------//
+//
+/* Run a REPL meta-command such as .staleness, .refresh, .sample or .cache */
+void k_DoMetaCommand(sqlite3* db, char* command)
+{
+    long long ms;
+
+    if (strcmp(command, ".staleness") == 0) {
+        fprintf(stdout, "%lld\n", staleness_ms);
+    } else if (sscanf(command, ".staleness %lld", &ms) == 1 && ms >= 0) {
+        if (!snapshot_mode)
+            fprintf(stdout, MAKE_RED "Staleness only applies with --snapshot\n" RESET_COLOR);
+        else
+            staleness_ms = ms;
+    } else if (strcmp(command, ".refresh") == 0) {
+        k_ResetSnapshotTables(db);
+    } else if (strcmp(command, ".sample") == 0) {
+        if (sample.rate > 0)
+            fprintf(stdout, "%g%%\n", sample.rate * 100);
+        else if (sample.rows > 0)
+            fprintf(stdout, "%d\n", sample.rows);
+        else
+            fprintf(stdout, "off\n");
+    } else if (strncmp(command, ".sample ", 8) == 0) {
+        if (k_ParseSample(&sample, command + 8) == -1)
+            fprintf(stdout, MAKE_RED "Invalid sample: %s\n" RESET_COLOR, command + 8);
+        else
+            k_ResetSnapshotTables(db);  // Collected with the old sample
+    } else if (strcmp(command, ".cache") == 0) {
+        k_PrintCacheStats();
+        k_PrintResultCacheStats();
+    } else if (strcmp(command, ".result_cache") == 0) {
+        fprintf(stdout, "%zu,%d\n", result_cache_bytes, result_cache_entries);
+    } else if (strncmp(command, ".result_cache ", 14) == 0) {
+        if (k_ParseResultCache(command + 14) == -1)
+            fprintf(stdout, MAKE_RED "Invalid result cache limits: %s\n" RESET_COLOR,
+                    command + 14);
+    } else if (strcmp(command, ".mode") == 0) {
+        fprintf(stdout, "%s\n", output_format->name);
+    } else if (strncmp(command, ".mode ", 6) == 0) {
+        k_Format* format = k_FindFormat(command + 6);
+        if (format == NULL)
+            fprintf(stdout, MAKE_RED "Unknown format: %s\n" RESET_COLOR, command + 6);
+        else
+            output_format = format;
+    } else {
+        fprintf(stdout, MAKE_RED "Unknown command: %s\n" RESET_COLOR, command);
+    }
+}
+//
+//--------------------------------------------------------------------------//
+
+/* Print usage */
+void k_Usage(char* prog)
+{
+    fprintf(stderr, "Usage: %s [--snapshot] [--staleness MS] [--background MS] [--jobs N]\n"
+                    "       %*s [--publish PATH | --connect PATH] [--format FORMAT]\n"
+                    "       %*s [--sample P%%|N] [--result-cache BYTES[,N]] [query...]\n"
+                    "       %s --export-parquet FILE [table...]\n"
+                    "       %s --history FILE --record MS [--retention S[,S[,S]]]\n"
+                    "       %*s [table...]\n"
+                    "       %s --watch MS [--format FORMAT] query...\n"
+                    "  --snapshot      copy each table into SQLite before every query, so all\n"
+                    "                  scans of a query see the same point in time\n"
+                    "  --staleness MS  reuse snapshot tables for up to MS milliseconds in the\n"
+                    "                  REPL (implies --snapshot)\n"
+                    "  --background MS rebuild snapshots in a background thread every MS\n"
+                    "                  milliseconds, swapping them in between queries\n"
+                    "                  (implies --snapshot)\n"
+                    "  --jobs N        run the given queries on N threads against one\n"
+                    "                  snapshot (implies --snapshot)\n"
+                    "  --publish PATH  serve snapshots to other processes on the Unix\n"
+                    "                  socket PATH, collecting a new one when the last is\n"
+                    "                  older than --staleness\n"
+                    "  --connect PATH  query the snapshot served on PATH instead of the\n"
+                    "                  module\n"
+                    "  --format FORMAT write results as list (columns separated by |, the\n"
+                    "                  REPL default), pipeline (separated by __, the\n"
+                    "                  default for queries given here), csv, tsv, jsonl\n"
+                    "                  or arrow (an Arrow IPC stream per statement)\n"
+                    "  --sample P%%|N   have the module return a uniform random sample of\n"
+                    "                  P percent of the processes, or of N of them;\n"
+                    "                  sample_rate() gives the fraction kept\n"
+                    "  --result-cache BYTES[,N]\n"
+                    "                  keep the output of up to N (64) snapshot queries,\n"
+                    "                  BYTES (16 MiB) in all, and repeat it while the\n"
+                    "                  tables they read are unchanged; 0 disables it\n"
+                    "  --export-parquet FILE\n"
+                    "                  write the given snapshot tables (all if none) to\n"
+                    "                  FILE as Parquet, one file per table with the table\n"
+                    "                  name added before the extension if there are several\n"
+                    "  --history FILE  attach the history database FILE as history\n"
+                    "  --record MS     append a snapshot of the given tables (process if\n"
+                    "                  none) to the history database every MS milliseconds\n"
+                    "  --retention RAW[,MINUTE[,HOUR]]\n"
+                    "                  seconds to keep recorded snapshots for, before\n"
+                    "                  rolling them up per minute; then per-minute rollups\n"
+                    "                  before rolling them up per hour (7 days by default);\n"
+                    "                  and per-hour rollups (a year by default)\n"
+                    "  --watch MS      run the given queries every MS milliseconds, writing\n"
+                    "                  a query's result again only when it has changed\n",
+                    prog, (int) strlen(prog), "", (int) strlen(prog), "", prog, prog,
+                    (int) strlen(prog), "", prog);
+}
+
+/* Benchmarks in bench/ include this file with KQUERY_NO_MAIN defined */
+#ifndef KQUERY_NO_MAIN
+int main(int argc, char* argv[])
+{
+    char query[MAX_QUERY_LEN];
+    int i, num_jobs = 1, exit_status = 0;
+
+    char* publish_path = NULL;
+    char* connect_path = NULL;
+    char* export_path = NULL;
+    char* history_path = NULL;
+    char* default_tables[] = {"process"};
+    k_History history = {default_tables, 1, 0, {DAY_MS, 7 * DAY_MS, 365 * DAY_MS}};
+    sqlite3* db;
+
+    struct option options[] = {
+        {"snapshot",   no_argument,       NULL, 's'},
+        {"staleness",  required_argument, NULL, 't'},
+        {"background", required_argument, NULL, 'b'},
+        {"jobs",       required_argument, NULL, 'j'},
+        {"publish",    required_argument, NULL, 'p'},
+        {"connect",    required_argument, NULL, 'c'},
+        {"format",     required_argument, NULL, 'f'},
+        {"export-parquet", required_argument, NULL, 'e'},
+        {"history",    required_argument, NULL, 'H'},
+        {"record",     required_argument, NULL, 'r'},
+        {"retention",  required_argument, NULL, 'R'},
+        {"sample",     required_argument, NULL, 'S'},
+        {"result-cache", required_argument, NULL, 'C'},
+        {"watch",      required_argument, NULL, 'w'},
+        {"help",       no_argument,       NULL, 'h'},
+        {NULL,         0,                 NULL,  0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+        switch (opt) {
+        case 's':
+            snapshot_mode = 1;
+            break;
+        case 't':
+            snapshot_mode = 1;
+            staleness_ms = atoll(optarg);
+            break;
+        case 'b':
+            snapshot_mode = 1;
+            background_ms = atoll(optarg);
+            if (background_ms <= 0) {
+                k_Usage(argv[0]);
+                exit(-1);
+            }
+            break;
+        case 'j':
+            snapshot_mode = 1;
+            num_jobs = atoi(optarg);
+            if (num_jobs <= 0) {
+                k_Usage(argv[0]);
+                exit(-1);
+            }
+            break;
+        case 'p':
+            snapshot_mode = 1;
+            publish_path = optarg;
+            break;
+        case 'c':
+            connect_path = optarg;
+            break;
+        case 'e':
+            snapshot_mode = 1;
+            export_path = optarg;
+            break;
+        case 'H':
+            history_path = optarg;
+            break;
+        case 'r':
+            snapshot_mode = 1;
+            history.interval_ms = atoll(optarg);
+            if (history.interval_ms <= 0) {
+                k_Usage(argv[0]);
+                exit(-1);
+            }
+            break;
+        case 'R':
+            if (k_ParseRetention(&history, optarg) == -1) {
+                k_Usage(argv[0]);
+                exit(-1);
+            }
+            break;
+        case 'f':
+            output_format = k_FindFormat(optarg);
+            if (output_format == NULL) {
+                k_Usage(argv[0]);
+                exit(-1);
+            }
+            break;
+        case 'S':
+            if (k_ParseSample(&sample, optarg) == -1) {
+                k_Usage(argv[0]);
+                exit(-1);
+            }
+            break;
+        case 'C':
+            if (k_ParseResultCache(optarg) == -1) {
+                k_Usage(argv[0]);
+                exit(-1);
+            }
+            break;
+        case 'w':
+            snapshot_mode = 1;
+            watch_ms = atoll(optarg);
+            if (watch_ms <= 0) {
+                k_Usage(argv[0]);
+                exit(-1);
+            }
+            break;
+        case 'h':
+            k_Usage(argv[0]);
+            exit(0);
+        default:
+            k_Usage(argv[0]);
+            exit(-1);
+        }
+    }
+
+    if (output_format == NULL)
+        output_format = k_FindFormat(argc > optind ? "pipeline" : "list");
+
+    /* Watched queries collect on their own schedule */
+    if (watch_ms)
+        background_ms = 0;
+
+    /* Background snapshots are attached as snap, which recording, export and
+     * publishing (reading main) never see */
+    if (background_ms && (history.interval_ms || export_path != NULL || publish_path != NULL)) {
+        fprintf(stderr, MAKE_RED "--background can't be used with --record, "
+                        "--export-parquet or --publish\n" RESET_COLOR);
+        exit(-1);
+    }
+
+    /* Batch workers copy main only, and collect their snapshot once anyway */
+    if (background_ms && num_jobs > 1) {
+        fprintf(stderr, MAKE_RED "--background can't be used with --jobs\n" RESET_COLOR);
+        exit(-1);
+    }
+
+    k_InstallAllocator();
+    sqlite3_config(SQLITE_CONFIG_URI, 1);
+
+    if (connect_path != NULL) {
+        /* Snapshots from a publisher are complete, nothing to collect */
+        snapshot_mode = 0;
+        background_ms = 0;
+        fp = -1;
+
+        db = k_ConnectSnapshot(connect_path);
+        if (db == NULL)
+            exit(-1);
+    } else {
+        /* Open the file (module) */
+        strcat(the_file, dir_name);
+        strcat(the_file, "/");
+        strcat(the_file, file_name);
+        if ((fp = open(the_file, O_RDWR)) == -1) {
+            fprintf(stderr, MAKE_RED "Error opening %s\n" RESET_COLOR, the_file);
+            close(fp);
+            exit(-1);
+        }
+
+        db = k_SQLiteOpen();
+
+        if (background_ms)
+            k_StartRefresher(db);
+        else if (snapshot_mode)
+            k_CreateSnapshotTables(db);
+        else
+            k_CreateProcessVTab(db);
+    }
+
+    if (history_path != NULL && k_AttachHistory(db, history_path) != SQLITE_OK)
+        exit(-1);
+
+    if (history.interval_ms) {
+        if (history_path == NULL) {
+            k_Usage(argv[0]);
+            exit(-1);
+        }
+        if (argc > optind) {
+            history.tables = argv + optind;
+            history.num_tables = argc - optind;
+        }
+        k_RecordHistory(db, &history);
+    } else if (watch_ms) {
+        int num_queries = argc - optind;
+        char** queries = malloc((num_queries + 1) * sizeof(char*));
+
+        if (num_queries == 0) {
+            k_Usage(argv[0]);
+            exit(-1);
+        }
+        for (i = 0; i < num_queries; i++) {
+            queries[i] = calloc(1, MAX_QUERY_LEN);
+            k_GetQueryFromCommandLine(queries[i], argv[optind + i], MAX_QUERY_LEN);
+        }
+        k_WatchQueries(db, queries, num_queries, watch_ms);
+    } else if (publish_path != NULL) {
+        k_PublishSnapshots(db, publish_path);
+    } else if (export_path != NULL) {
+        if (k_ExportParquet(db, export_path, argv + optind, argc - optind) != SQLITE_OK)
+            exit_status = 1;
+    } else if (argc - optind > 1 && num_jobs > 1) {
+        int num_queries = argc - optind;
+        char** queries = malloc(num_queries * sizeof(char*));
+
+        for (i = 0; i < num_queries; i++) {
+            queries[i] = calloc(1, MAX_QUERY_LEN);
+            k_GetQueryFromCommandLine(queries[i], argv[optind + i], MAX_QUERY_LEN);
+        }
+
+        if (k_ExecuteBatch(db, queries, num_queries, num_jobs) != SQLITE_OK)
+            exit_status = 1;
+
+        for (i = 0; i < num_queries; i++)
+            free(queries[i]);
+        free(queries);
+    } else if (argc - optind >= 1) {
+        for (i = optind; i < argc; i++) {
+            memset(query, 0, sizeof(query));
+            k_GetQueryFromCommandLine(query, argv[i], MAX_QUERY_LEN);
+            k_ExecuteQuery(db, query, output_format);
+            k_ArenaReset(&query_arena);
+        }
+    } else {
+        /* Enter REPL */
+        while (1) {
+            fprintf(stdout, "kquery> ");
+
+            if (k_GetQueryFromStdin(query, MAX_QUERY_LEN) == -1)
+                break;
+
+            if (query[0] == '.') {
+                k_DoMetaCommand(db, query);
+                continue;
+            }
+
+            if (background_ms)
+                k_SwapSnapshot(db);
+            else
+                k_ExpireSnapshotTables(db, staleness_ms);
+            k_ExecuteQuery(db, query, output_format);
+            k_PrintSnapshotInfo();
+            k_ArenaReset(&query_arena);
+        }
+    }
+
+	/* Cleanup */
+    if (background_ms)
+        k_StopRefresher();
+    k_ClearStatementCache();
+    k_ClearResultCache();
+    sqlite3_close(db);
+    k_ArenaFree(&query_arena);
+    k_WriterFree(&stdout_writer);
+    if (fp != -1)
+        close(fp);
+
+    return exit_status;
 }
+#endif
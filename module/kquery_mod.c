@@ -25,82 +25,269 @@
 #include <linux/uaccess.h>
 #include <linux/slab.h>
 #include <linux/sched.h>
+#include <linux/vmalloc.h>
+#include <linux/sort.h>
+#include <linux/random.h>
 
 #include "kquery_mod.h"
 
-char *respbuf;
+/* Slack for processes forked between counting and collecting */
+#define PROCESS_SLACK 64
 
 /*
- * Returns insert command with appropriate values for Process table
+ * Process collected by process_open. Its start time tells it apart from a
+ * process that reused the pid before it was fetched.
  */
-static void process_get_row(char *buf)
+struct kquery_pid {
+	pid_t pid;
+	u64 start_time;		/* 0 if not known when opened */
+};
+
+/*
+ * Per-open-file state, so each user of the module gets its own cursor
+ */
+struct kquery_session {
+	char *resp;
+	size_t resp_len;
+
+	struct kquery_pid *pids;
+	int num_pids;
+	int next_pid;
+};
+
+/*
+ * Fills row with the Process table fields of task
+ */
+static void process_fill_row(struct task_struct *task, struct process_row *row)
+{
+	struct mm_struct *mm;
+
+	row->pid = task_pid_vnr(task);
+	rcu_read_lock();
+	row->parent_pid = task_pid_vnr(rcu_dereference(task->real_parent));
+	rcu_read_unlock();
+	/* Exited tasks are TASK_DEAD with the exit state kept separately, so
+	 * both are reported, as fs/proc/array.c does */
+	row->state = task->state | task->exit_state;
+	row->flags = task->flags;
+	row->priority = task->normal_prio;
+	row->num_vmas = 0;
+	row->total_vm = 0;
+
+	get_task_comm(row->name, task);
+
+	mm = get_task_mm(task);
+	if (mm != NULL) {
+		down_read(&mm->mmap_sem);
+		row->num_vmas = mm->map_count;
+		row->total_vm = mm->total_vm;
+		up_read(&mm->mmap_sem);
+		mmput(mm);
+	}
+}
+
+static int pid_cmp(const void *a, const void *b)
+{
+	pid_t pa = ((const struct kquery_pid *)a)->pid;
+	pid_t pb = ((const struct kquery_pid *)b)->pid;
+
+	return pa < pb ? -1 : pa > pb;
+}
+
+/*
+ * Releases the pids collected by process_open
+ */
+static void process_close(struct kquery_session *session)
+{
+	vfree(session->pids);
+	session->pids = NULL;
+	session->num_pids = 0;
+	session->next_pid = 0;
+}
+
+/*
+ * Adds pid to the sample being collected: each process is kept with
+ * probability ppm / 1000000 (all if ppm is 0), and of those, a uniform
+ * reservoir of at most max_pids is kept (all if 0). passed counts the
+ * processes that got past ppm so far, which the reservoir draws from.
+ */
+static void process_sample(struct kquery_session *session, pid_t pid,
+			   u64 start_time, int *passed, int ppm, int max_pids)
 {
-	static int current_process = -1;
-	static int num_processes = 0;
-	static struct task_struct **processes;
-
-	if (current_process == -1) {
-		struct task_struct *task;
-		int i = 0;
-
-		for_each_process(task)
-			num_processes++;
-
-		processes = kmalloc(num_processes * sizeof(task), GFP_ATOMIC);
-
-		for_each_process(task)
-			processes[i++] = task;
-
-		sprintf(buf, "%d", num_processes);
-
-		current_process = 0;
-	} else if (current_process < num_processes) {
-		struct task_struct *task = processes[current_process];
-
-        	/* Fields to retrieve */
-		pid_t pid = pid_vnr(get_task_pid(task, PIDTYPE_PID));
-		pid_t parent_pid = pid_vnr(get_task_pid(task->real_parent, 
-							PIDTYPE_PID));
-		long state = task->state;
-		unsigned int flags = task->flags;
-		int prio = task->normal_prio;
-		char comm[sizeof(current->comm)];
-
-		struct mm_struct *mm;
-		int num_vmas = 0;
-		unsigned long total_vm = 0;
-
-		get_task_comm(comm, task);
-
-		mm = task->mm;    
-
-		if (mm != NULL) {
-			down_read(&mm->mmap_sem);
-			num_vmas = mm->map_count;
-                	total_vm = mm->total_vm;
-                	up_read(&mm->mmap_sem);
-                }
-
-                sprintf(buf, 
-                "INSERT INTO process VALUES (%d,'%s',%d,%ld,%u,%d,%d,%lu);", 
-							pid, 
-							comm, 
-							parent_pid, 
-							state, 
-							flags, 
-							prio, 
-							num_vmas, 
-							total_vm);
-                current_process++;
-        } else {
-        	current_process = -1;
-        	num_processes = 0;
-
-        	strcpy(buf, "");
-
-        	kfree(processes);
-        	processes = NULL;
-        }
+	u32 slot;
+
+	if (ppm > 0 && ppm < 1000000 && prandom_u32_max(1000000) >= ppm)
+		return;
+	++*passed;
+
+	if (max_pids <= 0 || session->num_pids < max_pids)
+		slot = session->num_pids++;
+	else if ((slot = prandom_u32_max(*passed)) >= max_pids)
+		return;
+
+	session->pids[slot].pid = pid;
+	session->pids[slot].start_time = start_time;
+}
+
+/*
+ * Collects the pids of the processes with min_pid <= pid <= max_pid, sorted,
+ * sampled as described in process_sample. Only pids are kept, so the
+ * processes a scan stopped early never fetches are neither referenced nor
+ * read. Responds with the number of pids kept and of processes in range.
+ */
+static void process_open(struct kquery_session *session,
+			 pid_t min_pid, pid_t max_pid, int ppm, int max_pids)
+{
+	struct task_struct *task;
+	int capacity = PROCESS_SLACK, matched = 0, passed = 0;
+
+	process_close(session);
+
+	/* A single pid is looked up when fetched, without walking every task */
+	if (min_pid == max_pid) {
+		session->pids = vmalloc(sizeof(*session->pids));
+		if (session->pids != NULL) {
+			process_sample(session, min_pid, 0, &passed, ppm,
+				       max_pids);
+			matched++;
+		}
+
+		sprintf(session->resp, "%d %d", session->num_pids, matched);
+		session->resp_len = strlen(session->resp) + 1;
+		return;
+	}
+
+	rcu_read_lock();
+	for_each_process(task)
+		capacity++;
+	rcu_read_unlock();
+
+	/* The reservoir can't be larger than the pids allocated for it */
+	if (max_pids > capacity)
+		max_pids = capacity;
+	else if (max_pids > 0)
+		capacity = max_pids;
+
+	session->pids = vmalloc(capacity * sizeof(*session->pids));
+	if (session->pids == NULL) {
+		strcpy(session->resp, "");
+		session->resp_len = 1;
+		return;
+	}
+
+	rcu_read_lock();
+	for_each_process(task) {
+		pid_t pid = task_pid_vnr(task);
+
+		if (pid < min_pid || pid > max_pid)
+			continue;
+		if (session->num_pids == capacity && max_pids <= 0)
+			break;
+
+		process_sample(session, pid, task->start_time, &passed, ppm,
+			       max_pids);
+		matched++;
+	}
+	rcu_read_unlock();
+
+	sort(session->pids, session->num_pids, sizeof(*session->pids),
+	     pid_cmp, NULL);
+
+	sprintf(session->resp, "%d %d", session->num_pids, matched);
+	session->resp_len = strlen(session->resp) + 1;
+}
+
+/*
+ * Returns a reference to the process collected as p, or NULL if it exited
+ * (or isn't a thread group leader). A process that reused its pid since has
+ * another start time, and counts as exited.
+ */
+static struct task_struct *process_get(struct kquery_pid *p)
+{
+	struct task_struct *task;
+
+	rcu_read_lock();
+	task = pid_task(find_vpid(p->pid), PIDTYPE_PID);
+	if (task != NULL && !thread_group_leader(task))
+		task = NULL;
+	if (task != NULL && p->start_time != 0 &&
+	    task->start_time != p->start_time)
+		task = NULL;
+	if (task != NULL)
+		get_task_struct(task);
+	rcu_read_unlock();
+
+	return task;
+}
+
+/*
+ * Returns a batch of at most max_rows rows from the pids collected by
+ * process_open, skipping processes that exited (or whose pid was reused) in
+ * the meantime
+ */
+static void process_fetch(struct kquery_session *session, int max_rows)
+{
+	struct process_batch *batch = (struct process_batch *)session->resp;
+	struct process_row *rows = (struct process_row *)(batch + 1);
+	int capacity = (MAX_RESP - sizeof(*batch)) / sizeof(*rows);
+
+	if (max_rows <= 0 || max_rows > capacity)
+		max_rows = capacity;
+
+	batch->num_rows = 0;
+	while (batch->num_rows < max_rows &&
+	       session->next_pid < session->num_pids) {
+		struct task_struct *task =
+			process_get(&session->pids[session->next_pid++]);
+
+		if (task == NULL)
+			continue;
+
+		process_fill_row(task, &rows[batch->num_rows++]);
+		put_task_struct(task);
+	}
+	batch->done = session->next_pid == session->num_pids;
+
+	session->resp_len = sizeof(*batch) + batch->num_rows * sizeof(*rows);
+}
+
+/*
+ * Sets up the session of a newly opened file
+ */
+static int kquery_open(struct inode *inode, struct file *file)
+{
+	struct kquery_session *session;
+
+	session = kzalloc(sizeof(*session), GFP_KERNEL);
+	if (session == NULL)
+		return -ENOMEM;
+
+	session->resp = kmalloc(MAX_RESP, GFP_KERNEL);
+	if (session->resp == NULL) {
+		kfree(session);
+		return -ENOMEM;
+	}
+
+	strcpy(session->resp, "");
+	session->resp_len = 1;
+
+	file->private_data = session;
+
+	return 0;
+}
+
+/*
+ * Tears down the session of a file being closed
+ */
+static int kquery_release(struct inode *inode, struct file *file)
+{
+	struct kquery_session *session = file->private_data;
+
+	process_close(session);
+	kfree(session->resp);
+	kfree(session);
+
+	return 0;
 }
 
 /*
@@ -109,29 +296,26 @@ static void process_get_row(char *buf)
 static ssize_t kquery_call(struct file *file, const char __user *buf,
 	size_t count, loff_t *ppos)
 {
-	int rc;
+	struct kquery_session *session = file->private_data;
 	char callbuf[MAX_CALL];
+	int min_pid, max_pid, ppm = 0, max_pids = 0, max_rows;
 
 	if (count >= MAX_CALL)
 		return -EINVAL;
 
-	preempt_disable();
-	
-	respbuf = kmalloc(MAX_RESP, GFP_ATOMIC);
-	if (respbuf == NULL) {
-		preempt_enable(); 
-		return -ENOSPC;
-	}
-	
-	strcpy(respbuf,"");
-
-	rc = copy_from_user(callbuf, buf, count);
-	callbuf[MAX_CALL - 1] = '\0';
+	if (copy_from_user(callbuf, buf, count))
+		return -EFAULT;
+	callbuf[count] = '\0';
 
-	if (strcmp(callbuf, "process_get_row") == 0)
-		process_get_row(respbuf);
+	strcpy(session->resp, "");
+	session->resp_len = 1;
 
-	preempt_enable();
+	if (sscanf(callbuf, "process_open %d %d %d %d",
+		   &min_pid, &max_pid, &ppm, &max_pids) >= 2) {
+		process_open(session, min_pid, max_pid, ppm, max_pids);
+	} else if (sscanf(callbuf, "process_fetch %d", &max_rows) == 1) {
+		process_fetch(session, max_rows);
+	}
 
 	*ppos = 0;
 
@@ -144,39 +328,31 @@ static ssize_t kquery_call(struct file *file, const char __user *buf,
 static ssize_t kquery_return(struct file *file, char __user *userbuf,
 	size_t count, loff_t *ppos)
 {
-	int rc;
-
-	preempt_disable();
-
-	rc = strlen(respbuf) + 1;
+	struct kquery_session *session = file->private_data;
+	size_t len = min(count, session->resp_len);
 
-	if (count < rc) {
-		respbuf[count - 1] = '\0';
-		rc = copy_to_user(userbuf, respbuf, count);
-	} else {
-		rc = copy_to_user(userbuf, respbuf, rc);
-	}
-
-	kfree(respbuf);
-	respbuf = NULL;
-
-	preempt_enable();
+	if (copy_to_user(userbuf, session->resp, len))
+		return -EFAULT;
 
 	*ppos = 0;
 
-	return rc;
+	return len;
 } 
 
 /*
- * Override read and write
+ * Override open, release, read and write
  */
 static const struct file_operations myfops = {
+	.open = kquery_open,
+	.release = kquery_release,
 	.read = kquery_return,
 	.write = kquery_call,
 };
 
 struct dentry *dir, *file;
 
+#define CHECK_BIT(name, value) BUILD_BUG_ON((name) != (value));
+
 /*
  * Creates shared file
  */
@@ -184,6 +360,10 @@ static int __init kquery_mod_init(void)
 {
 	int file_value;
 
+	/* The names kquery gives the state and flags bits match this kernel */
+	KQUERY_TASK_STATES(CHECK_BIT)
+	KQUERY_PROCESS_FLAGS(CHECK_BIT)
+
 	dir = debugfs_create_dir(dir_name, NULL);
 	if (dir == NULL) {
 		printk(KERN_DEBUG 
@@ -211,8 +391,6 @@ static void __exit kquery_mod_exit(void)
 {
 	debugfs_remove(file);
 	debugfs_remove(dir);
-	if (respbuf != NULL)
-		kfree(respbuf);
 }
 
 module_init(kquery_mod_init);
@@ -20,7 +20,74 @@
  */
 
 #define MAX_CALL 100
-#define MAX_RESP 1024
+#define MAX_RESP 16384
+
+#define PROCESS_NAME_LEN 16
+
+/* Row of the Process table as returned by process_fetch */
+struct process_row {
+	int pid;
+	int parent_pid;
+	long long state;
+	unsigned int flags;
+	int priority;
+	int num_vmas;
+	unsigned long long total_vm;
+	char name[PROCESS_NAME_LEN];
+};
+
+/*
+ * Bits of the state and flags columns, as defined in include/linux/sched.h
+ * (4.14 to 5.7). The module checks each against the kernel it is built for.
+ */
+#define KQUERY_TASK_STATES(X) \
+	X(TASK_INTERRUPTIBLE,   0x0001) \
+	X(TASK_UNINTERRUPTIBLE, 0x0002) \
+	X(__TASK_STOPPED,       0x0004) \
+	X(__TASK_TRACED,        0x0008) \
+	X(EXIT_DEAD,            0x0010) \
+	X(EXIT_ZOMBIE,          0x0020) \
+	X(TASK_PARKED,          0x0040) \
+	X(TASK_DEAD,            0x0080) \
+	X(TASK_WAKEKILL,        0x0100) \
+	X(TASK_WAKING,          0x0200) \
+	X(TASK_NOLOAD,          0x0400) \
+	X(TASK_NEW,             0x0800)
+
+#define KQUERY_PROCESS_FLAGS(X) \
+	X(PF_IDLE,              0x00000002) \
+	X(PF_EXITING,           0x00000004) \
+	X(PF_EXITPIDONE,        0x00000008) \
+	X(PF_VCPU,              0x00000010) \
+	X(PF_WQ_WORKER,         0x00000020) \
+	X(PF_FORKNOEXEC,        0x00000040) \
+	X(PF_MCE_PROCESS,       0x00000080) \
+	X(PF_SUPERPRIV,         0x00000100) \
+	X(PF_DUMPCORE,          0x00000200) \
+	X(PF_SIGNALED,          0x00000400) \
+	X(PF_MEMALLOC,          0x00000800) \
+	X(PF_NPROC_EXCEEDED,    0x00001000) \
+	X(PF_USED_MATH,         0x00002000) \
+	X(PF_USED_ASYNC,        0x00004000) \
+	X(PF_NOFREEZE,          0x00008000) \
+	X(PF_FROZEN,            0x00010000) \
+	X(PF_KSWAPD,            0x00020000) \
+	X(PF_MEMALLOC_NOFS,     0x00040000) \
+	X(PF_MEMALLOC_NOIO,     0x00080000) \
+	X(PF_LESS_THROTTLE,     0x00100000) \
+	X(PF_KTHREAD,           0x00200000) \
+	X(PF_RANDOMIZE,         0x00400000) \
+	X(PF_SWAPWRITE,         0x00800000) \
+	X(PF_NO_SETAFFINITY,    0x04000000) \
+	X(PF_MCE_EARLY,         0x08000000) \
+	X(PF_FREEZER_SKIP,      0x40000000) \
+	X(PF_SUSPEND_TASK,      0x80000000)
+
+/* Header of a process_fetch response, followed by num_rows rows */
+struct process_batch {
+	int num_rows;
+	int done;
+};
 
 char dir_name[] = "kquery_mod";
 char file_name[] = "call";